@@ -42,14 +42,20 @@
 
 #include <cerrno>
 #include <cmath>
+#include <condition_variable>
 #include <csignal>
+#include <cstdarg>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <algorithm>
 
@@ -60,29 +66,22 @@ extern "C" {
   #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
 };
 #define __STDC_FORMAT_MACROS
+#include <dirent.h>
 #include <inttypes.h>
 #include <locale.h>
 #include <netdb.h>
 #include <ncurses.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <memory>
 using namespace std;
 
 #define VERSION "2.3.0"
-/*
- * MAXCONS is set to 16k, the default number of states in iptables. Generally
- * speaking the ncurses pad is this many lines long, but since ncurses
- * uses a short for their dimensions, a pad can never be longer than 32767.
- * Thus we define both of these values and NLINES as the lesser of the two.
- */
-#define MAXCONS 16384
-#define MAXLINES 32767
-#if MAXCONS < MAXLINES
-  #define NLINES MAXCONS
-#else
-  #define NLINES MAXLINES
-#endif
 #define MAXFIELDS 20
 // This is the default format string if we don't dynamically determine it
 #define DEFAULT_FORMAT "%-21s %-21s %-7s %-12s %-9s\n"
@@ -95,11 +94,104 @@ using namespace std;
 // This is the format string for the "totals" line, always.
 #define TOTALS_FORMAT \
   "Total States: %i -- TCP: %i UDP: %i ICMP: %i Other: %i (Filtered: %i)\n"
+// ... and what --changes adds to the end of it
+#define CHANGES_FORMAT " -- New: %u/s Closed: %u/s\n"
+// How many refreshes --changes keeps closed states on the screen for
+#define GHOST_REFRESHES 3
+// Refresh rate, in milliseconds: the default, and the range we accept
+#define DEFAULT_RATE 1000
+#define MIN_RATE 50
+#define MAX_RATE 60000
+// Adaptive refresh: never refresh faster than this, and by default don't
+// spend more than this % of one CPU refreshing.
+#define ADAPTIVE_MIN_RATE 250
+#define DEFAULT_CPU_BUDGET 5
 // Options for truncating from the front or the back
 #define TRUNC_FRONT 0
 #define TRUNC_END 1
 // maxlength for string we pass to inet_ntop()
 #define NAMELEN 100
+// How much single-run output we buffer before write()ing it out
+#define OUTBUF_SIZE (1 << 20)
+// Output formats for single-run/headless modes
+#define OUTPUT_TEXT 0
+#define OUTPUT_JSON 1
+#define OUTPUT_CSV 2
+#define OUTPUT_TSV 3
+#define OUTPUT_BIN 4
+// Record types and version for --output bin, see bin_snap_t/bin_entry_t
+#define BIN_VERSION 1
+#define BIN_SNAPSHOT 1
+#define BIN_ENTRY 2
+// bin_snap_t.count when we don't know it up front (--stream)
+#define BIN_COUNT_UNKNOWN 0xffffffff
+// Counter column widths for --stream, which can't size them from the table
+#define STREAM_BYTES 12
+#define STREAM_PACKETS 9
+// How many talkers --top shows by default, and how many counters it keeps
+// per key: TOP_COUNTERS per talker shown, but at least TOP_MIN_COUNTERS
+#define TOP_DEFAULT 10
+#define TOP_COUNTERS 16
+#define TOP_MIN_COUNTERS 1024
+// What --top counts talkers by, see talkers_add()
+#define TOP_SRC 0
+#define TOP_DST 1
+#define TOP_DPORT 2
+#define TOP_KEYS 3
+// Data sources, see backends[]
+#define SOURCE_NETLINK 0
+#define SOURCE_PROCFS 1
+#define SOURCE_REPLAY 2
+#define SOURCE_SYNTHETIC 3
+#define SOURCE_MAX 3
+#define PROCFS_PATH "/proc/net/nf_conntrack"
+#define PROCFS_BUF_SIZE (1 << 20)
+#define DEFAULT_SYNTHETIC 10000
+// Table sizes for --bench
+#define DEFAULT_BENCH "10k,100k,1M,5M"
+// Phases of a refresh we time, see stats_t
+#define PHASE_DUMP 0
+#define PHASE_PROCESS 1
+#define PHASE_RESOLVE 2
+#define PHASE_SORT 3
+#define PHASE_FORMAT 4
+#define PHASE_RENDER 5
+#define PHASE_MAX 5
+// Formats for --stats
+#define STATS_TEXT 0
+#define STATS_JSON 1
+/*
+ * Memory accounting, see mem_t: roughly what malloc() adds to each
+ * allocation, and how far we've had to go to stay within --max-memory
+ */
+#define MEM_OVERHEAD 16
+#define MEM_OK 0
+#define MEM_NOCACHE 1
+#define MEM_TOPK 2
+#define MEM_SAMPLE 3
+// The smallest --max-memory we accept, so there's room for some states
+#define MIN_MEMORY (4 << 20)
+// How long to keep resolved names around, in seconds
+#define NAME_CACHE_TTL 300
+// What --group can group states by, see group_table()
+#define GROUP_NONE 0
+#define GROUP_SRC 1
+#define GROUP_DST 2
+#define GROUP_DPORT 3
+#define GROUP_PROTO 4
+#define GROUP_STATE 5
+#define GROUP_SERVICE 6
+#define GROUP_MARK 7
+#define GROUP_NETNS 8
+// How many TCP states a group's breakdown shows
+#define GROUP_STATES 3
+/*
+ * Distinct sources per group are counted exactly up to GROUP_SPARSE of
+ * them, then with a HyperLogLog sketch of 2^HLL_BITS registers
+ */
+#define GROUP_SPARSE 4
+#define HLL_BITS 10
+#define HLL_REGISTERS (1 << HLL_BITS)
 // Sorting options
 #define SORT_SRC 0
 #define SORT_SRC_PT 1
@@ -119,9 +211,44 @@ using namespace std;
 /*
  * GLOBAL VARS
  */
-int sort_factor = 1;
 bool need_resize = false;
 
+// The half-open states in states[] below, for --syn-alert
+#define STATE_SYN_SENT 1
+#define STATE_SYN_RECV 2
+// How many flooded destinations to list above the table, see syn_finish()
+#define SYN_PANEL_LINES 3
+/*
+ * --churn counts events by kind, in total and for CHURN_PROTOS protocols,
+ * and keeps CHURN_AVERAGES moving averages of each, see churn_tick()
+ */
+#define CHURN_NEW 0
+#define CHURN_DESTROY 1
+#define CHURN_PROTOS 4
+#define CHURN_AVERAGES 3
+// Destinations are counted over CHURN_WINDOW seconds, and the top few shown
+#define CHURN_WINDOW 10
+#define CHURN_TOP 3
+#define CHURN_COUNTERS 1024
+#define CHURN_PANEL_LINES 3
+// How many seconds churn_tick() will catch up on one at a time
+#define CHURN_CATCHUP 600
+// How much the kernel can queue up for us between reads
+#define CHURN_RCVBUF (8 << 20)
+/*
+ * --netns: where named network namespaces are (as made by 'ip netns'), how
+ * many states a collector thread hands over at once and how many batches
+ * can be waiting, the widest the Netns column gets, how many namespaces we
+ * can tell apart (tentry_t.netns is 16 bits), and how many refreshes one
+ * that's gone keeps its slot, so its ghosts still show the right name
+ */
+#define NETNS_DIR "/run/netns"
+#define NETNS_BATCH 1024
+#define NETNS_QUEUE 64
+#define NETNS_WIDTH 16
+#define NETNS_MAX 65536
+#define NETNS_KEEP (GHOST_REFRESHES + 2)
+
 /* shameless stolen from libnetfilter_conntrack_tcp.c */
 static const char *states[] = {
   "NONE",
@@ -140,12 +267,39 @@ static const char *states[] = {
 /*
  * STRUCTS
  */
+/*
+ * Where a NATed state is translated to, as seen from the original
+ * direction: the reply tuple turned around. 'swapped' is whether this
+ * holds the original tuple instead, see nat_swap().
+ */
+struct nat_t {
+  in6_addr src, dst;
+  unsigned long srcpt, dstpt;
+  bool swapped;
+};
 // One state-table entry
 struct tentry_t {
   string proto, state, ttl, sname, dname, spname, dpname;
   in6_addr src, dst;
   uint8_t family;
-  unsigned long srcpt, dstpt, bytes, packets, s;
+  unsigned long srcpt, dstpt, s;
+  // The raw values the strings above are built from
+  uint8_t l4proto, tcpstate, icmp_type, icmp_code;
+  uint16_t icmp_id, zone;
+  uint32_t timeout, mark;
+  uint64_t bytes, packets;
+  // which of netns.spaces the state is from, always 0 without --netns
+  uint16_t netns;
+  // per second since the last refresh, only set with --rates
+  uint64_t byte_rate, packet_rate;
+  /*
+   * With --changes: whether the state is new since the last refresh, and
+   * if it's closed since, how many more refreshes to show it for
+   */
+  bool fresh;
+  uint8_t ghost;
+  // NULL unless the state is NATed, see set_nat()
+  unique_ptr<nat_t> nat;
 };
 // x/y of the terminal window
 struct screensize_t {
@@ -154,12 +308,17 @@ struct screensize_t {
 // Struct 'o flags
 struct flags_t {
   bool single, totals, lookup, skiplb, staticsize, skipdns, tag_truncate,
-       filter_src, filter_dst, filter_srcpt, filter_dstpt, filter_inv, noscroll, nocolor,
-       counters;
+       filter_src, filter_dst, filter_srcpt, filter_dstpt, filter_mark,
+       filter_netns, filter_inv, noscroll, nocolor, mark,
+       counters, headless, stream, stats, group, rates, changes, nat;
 };
 // Struct 'o counters
 struct counters_t {
   unsigned int total, tcp, udp, icmp, other, skipped;
+  // states that passed the filters but didn't fit in --max-memory
+  unsigned int dropped;
+  // with --changes, states opened and closed per second, and ghost rows
+  unsigned int opened, closed, ghosts;
 };
 // Various filters to be applied pending the right flags in flags_t
 struct filters_t {
@@ -168,11 +327,368 @@ struct filters_t {
   uint8_t srcnet, dstnet;
   uint8_t srcfam, dstfam;
   unsigned long srcpt, dstpt;
+  // match states whose mark & markmask is mark (already masked)
+  uint32_t mark, markmask;
+  // match states in namespace netns, and zone too if has_zone
+  uint16_t netns, zone;
+  bool has_zone;
 };
 // The max-length of fields in the stable table
 struct max_t {
   unsigned int src, dst, proto, state, ttl;
-  unsigned long bytes, packets;
+  unsigned int bytes, packets, mark, netns;
+};
+/*
+ * --output bin is a stream of records, each starting with its length and
+ * type, so readers can skip types they don't know. Each type has a fixed
+ * size and everything is naturally aligned, so a capture can be mmap()ed
+ * and walked in place. Integers are in host byte order, addresses in
+ * network byte order.
+ *
+ * Every dump starts with a bin_snap_t, followed by 'count' bin_entry_t's.
+ */
+struct bin_snap_t {
+  uint16_t len;
+  uint8_t type;
+  uint8_t version;
+  uint32_t count;
+  // wall-clock time of the dump, in usec since the epoch
+  uint64_t time;
+};
+struct bin_entry_t {
+  uint16_t len;
+  uint8_t type;
+  uint8_t family;
+  uint8_t l4proto, tcpstate, icmp_type, icmp_code;
+  uint16_t sport, dport, icmp_id, zone;
+  uint32_t ttl, mark;
+  uint64_t bytes, packets;
+  uint8_t src[16], dst[16];
+};
+// A buffer of output for a file descriptor, see out_write() and friends
+struct outbuf_t {
+  int fd;
+  size_t used;
+  char buf[OUTBUF_SIZE];
+};
+/*
+ * A printf()-style format of only "%-<width>s" fields, parsed once so we
+ * don't have to re-parse it for every line: lits[i] comes before field i,
+ * and there's one more literal (usually "\n") after the last field.
+ */
+struct rowfmt_t {
+  vector<string> lits;
+  vector<unsigned int> widths;
+};
+/*
+ * Where the time went in the last refresh, and how much work there was.
+ * The per-state phases (process and resolve) cost a couple of clock reads
+ * per state, so they're only timed separately when 'detail' is set -
+ * otherwise they're counted as part of the dump.
+ */
+struct stats_t {
+  bool detail;
+  uint64_t usec[PHASE_MAX+1];
+  // how long the last render took, which outlives stats_reset()
+  uint64_t last_render;
+  // states we were given, filtered out, and looked up in DNS
+  uint64_t seen, filtered, resolved;
+  // lookups that did/didn't need to go to the system, e.g. proto_name()
+  uint64_t cache_hits, cache_misses;
+  // tentry_t's allocated
+  uint64_t allocs;
+};
+/*
+ * What we think the big things in memory add up to, in bytes, and the
+ * --max-memory budget (0 for none) they have to fit in. If the table
+ * won't fit, we first drop the name caches, then stop growing the table:
+ * from then on we keep either the top states by bytes (if counters are
+ * shown) or a random sample of all of them, see retain_entry().
+ */
+struct mem_t {
+  uint64_t budget;
+  // the states in the table, and the table's array of pointers to them
+  uint64_t table, slots;
+  // resolved names, see names_t
+  uint64_t caches;
+  // output buffers and what curses keeps for the screen
+  uint64_t render;
+  // what --rates and --changes keep of each state from refresh to refresh
+  uint64_t rates, changes;
+  // one of MEM_*, for the last refresh
+  int level;
+  // states that passed the filters this refresh, for sampling
+  uint64_t candidates;
+};
+// What to group states by, see group_table()
+struct grouping_t {
+  int by;
+  // prefix lengths for GROUP_SRC and GROUP_DST
+  unsigned int prefix4, prefix6;
+};
+// A group of states, as group_table() adds them up
+struct group_slot_t {
+  uint8_t family, l4proto;
+  // whether the states are of more than one protocol
+  bool mixed;
+  in6_addr key;
+  // protocol and port, for GROUP_SERVICE
+  uint32_t port;
+  uint32_t conns, ttl;
+  /*
+   * Distinct sources: their hashes while there are at most GROUP_SPARSE,
+   * then which sketch (from 1) counts them, see group_src()
+   */
+  uint32_t srcs, sketch;
+  uint64_t src_hashes[GROUP_SPARSE];
+  uint32_t tcpstates[sizeof(states) / sizeof(states[0])];
+  uint64_t bytes, packets, byte_rate, packet_rate;
+};
+// A state's counters as of the last refresh, see rate_entry()
+struct rate_slot_t {
+  // tuple_hash() of the state, 0 if the slot is empty
+  uint64_t key;
+  uint64_t bytes, packets;
+};
+/*
+ * The counters of every state in the previous and current snapshots, as
+ * open-addressing hash tables, and the times they were taken.
+ */
+struct rates_t {
+  vector<rate_slot_t> prev, next;
+  size_t prev_count, next_count;
+  uint64_t prev_time, time;
+};
+/*
+ * The tuple_hash()es of every state in the previous and current refreshes,
+ * as open-addressing sets (0 is an empty slot), for --changes. 'kept' is
+ * how many of the current ones were also in the previous one, and 'table'
+ * whether the table still holds the last refresh's states, to make ghosts.
+ */
+struct changes_t {
+  vector<uint64_t> prev, next;
+  size_t prev_count, next_count, kept;
+  uint64_t prev_time, time;
+  bool table;
+};
+// Half-open TCP states to one destination, see syn_entry()
+struct syn_slot_t {
+  uint8_t family;
+  // whether it was over the thresholds
+  bool flagged;
+  in6_addr dst;
+  // 0 if the slot is empty
+  uint32_t count;
+  // change in 'count' per second since the last refresh
+  int64_t growth;
+};
+/*
+ * The SYN flood detector (--syn-alert): half-open states per destination
+ * this refresh and last, as open-addressing tables like rates_t, and which
+ * destinations are over the thresholds.
+ */
+struct synflood_t {
+  bool enabled;
+  // alert at this many half-open states, or this much growth per second
+  uint32_t threshold, growth;
+  // run for each alert, if set (--alert-cmd), and why it last couldn't be
+  string command, error;
+  vector<syn_slot_t> prev, next;
+  size_t prev_count, next_count;
+  uint64_t prev_time, time;
+  // biggest first
+  vector<syn_slot_t> alerts;
+};
+// A state as --history keeps it, see hist_entry()
+struct hist_slot_t {
+  // tuple_hash() of the state
+  uint64_t key;
+  // with the TTL as when it expires, in seconds since the epoch
+  bin_entry_t rec;
+  // which of netns.spaces it's in, which bin_entry_t doesn't have
+  uint16_t netns;
+};
+// A state whose counters (and maybe TTL) are all that changed
+struct hist_counters_t {
+  uint64_t key;
+  uint64_t bytes, packets;
+  uint32_t ttl;
+};
+// How to get from one snapshot back to the one before it, see hist_finish()
+struct hist_delta_t {
+  // when the older snapshot was taken
+  uint64_t time;
+  // states that changed or went away, as they were before
+  vector<hist_slot_t> changed;
+  // ... or just their old counters and TTL
+  vector<hist_counters_t> counters;
+  // keys of the states that are new
+  vector<uint64_t> added;
+};
+/*
+ * Recent snapshots, for rewinding (--history): the latest in full, sorted
+ * by key, and then deltas going back in time, newest first.
+ */
+struct history_t {
+  // 0 if we're not keeping history
+  uint64_t budget;
+  // what the deltas take up
+  uint64_t bytes;
+  vector<hist_slot_t> latest, next;
+  uint64_t latest_time, next_time;
+  deque<hist_delta_t> deltas;
+  // how many snapshots back we're showing, 0 for live
+  unsigned int offset;
+};
+// Resolved host and port names, so we don't go to DNS every refresh
+struct names_t {
+  // keyed by the address followed by the family
+  unordered_map<string, string> hosts;
+  // keyed by the port, plus 1 << 16 for UDP
+  unordered_map<uint32_t, string> ports;
+  // bytes in the entries (not counting the hash tables themselves)
+  uint64_t bytes;
+  // when (on the monotonic clock) to forget everything
+  uint64_t expires;
+};
+// What we last drew on each line of the table, see print_table()
+struct rowcache_t {
+  // screen line the first state was drawn on, -1 if nothing is cached
+  int top;
+  vector<uint64_t> lines;
+};
+// One key a Space-Saving summary is counting, see summary_add()
+struct top_counter_t {
+  uint8_t family;
+  in6_addr key;
+  // an overestimate by at most 'error'
+  uint64_t count, error;
+  // where in summary_t.index this counter is
+  uint32_t slot;
+};
+/*
+ * A Space-Saving summary: a min-heap of at most 'counters' counters, and
+ * an open-addressing hash table of their heap positions plus 1 (0 for an
+ * empty slot) to find them by key.
+ */
+struct summary_t {
+  vector<top_counter_t> heap;
+  vector<uint32_t> index;
+  size_t counters;
+  // everything that's been added
+  uint64_t total;
+};
+// The top talkers for --top, by states and by bytes
+struct talkers_t {
+  unsigned int k;
+  // whether we're counting bytes too (with -C)
+  bool bytes;
+  uint64_t states_seen;
+  summary_t states[TOP_KEYS], byte_counts[TOP_KEYS];
+};
+/*
+ * For --churn: the conntrack event socket, this second's events by kind
+ * (CHURN_NEW or CHURN_DESTROY) in total and then per protocol, and their
+ * moving averages. Destinations get a Space-Saving summary per kind, for
+ * this CHURN_WINDOW and the last complete one, which is what we show.
+ */
+struct churn_t {
+  bool enabled;
+  struct nfct_handle *cth;
+  int fd;
+  uint64_t count[2][CHURN_PROTOS + 1];
+  double avg[2][CHURN_PROTOS + 1][CHURN_AVERAGES];
+  // whether the averages have been started, see churn_tick()
+  bool primed;
+  // when (on the monotonic clock) this second and this window started
+  uint64_t second, window;
+  summary_t dsts[2], last_dsts[2];
+  bool have_last;
+  // how many times the kernel had to drop events we didn't read in time
+  uint64_t overruns;
+};
+/*
+ * State for --stream, where conntrack_hook() writes each entry out as soon
+ * as it has it instead of adding it to the table. 'entry' is reused for
+ * every state, and 'max' is the fixed set of widths we format to.
+ */
+struct stream_t {
+  int output;
+  uint64_t time;
+  rowfmt_t rowfmt;
+  max_t max;
+  tentry_t entry;
+  // with --top, states are counted here instead of written out
+  talkers_t *talkers;
+};
+// The shape of the table the synthetic source makes, see parse_synth()
+struct synth_t {
+  // relative weights of each protocol
+  unsigned int tcp, udp, icmp, other;
+  // percentages of IPv6 states, and of states going to 'hot_dsts' hosts
+  unsigned int v6, hot, hot_dsts;
+  // maximum TTL, and roughly the maximum packet counter
+  unsigned int ttl;
+  uint64_t packets;
+};
+/*
+ * For --netns: the network namespaces we know of, and the conntrack socket
+ * we opened in each (NULL if we're not dumping it). 'seen', 'gone' (how
+ * many refreshes since it was last seen) and 'last' (when, in usec since
+ * the epoch) are for netns_scan(). spaces[0] is always the one we're
+ * running in, called ".".
+ */
+struct netns_space_t {
+  string name;
+  struct nfct_handle *cth;
+  bool seen;
+  unsigned int gone;
+  uint64_t last;
+};
+struct netns_t {
+  // 'all' is whether we watch everything under NETNS_DIR
+  bool enabled, all;
+  vector<netns_space_t> spaces;
+  // where each name is in 'spaces', and slots that are free to reuse
+  unordered_map<string, uint16_t> index;
+  vector<uint16_t> free;
+  // our own namespace, to go back to after opening a socket in another
+  int self;
+  /*
+   * Batches of states from the collector threads, waiting to be processed,
+   * and how many collectors are still going. The collectors wait for 'room'
+   * and the main thread for 'ready'.
+   */
+  mutex lock;
+  condition_variable ready, room;
+  deque<vector<tentry_t*>> batches;
+  unsigned int running;
+};
+// Where we get states from, and what that source needs to remember
+struct source_t {
+  int type;
+  // procfs and replay
+  string path;
+  // replay: the file, and whether we've already read the next snapshot
+  FILE *file;
+  bool have_snap;
+  // synthetic: how many states to make, and what they look like
+  unsigned long count;
+  synth_t synth;
+  /*
+   * replay: how fast to play it back (0 means a snapshot per refresh), and
+   * the capture times of the current and next snapshot
+   */
+  double speed;
+  uint64_t snap_time, next_snap_time;
+  // how many times we've read from it
+  uint64_t generation;
+  // if set, a copy of everything we read is saved here (--record)
+  outbuf_t *record;
+  // if set, what we need to work out rates (--rates)
+  rates_t *rates;
+  // if set, what we need to spot new and closed states (--changes)
+  changes_t *changes;
 };
 struct hook_data {
   vector<tentry_t*> *stable;
@@ -180,6 +696,35 @@ struct hook_data {
   max_t *max;
   counters_t *counts;
   const filters_t *filters;
+  // NULL unless we're streaming
+  stream_t *stream;
+  // NULL unless we're recording, see source_t
+  outbuf_t *record;
+  // NULL unless we're showing rates, see source_t
+  rates_t *rates;
+  // NULL unless we're showing changes, see source_t
+  changes_t *changes;
+  // a --history snapshot, which is just for show and isn't recorded again
+  bool past;
+  // the live table while we show a --history snapshot: only the hooks see it
+  bool hidden;
+};
+
+// Instrumentation, see stats_t. Global since it's counted everywhere.
+stats_t stats;
+// Memory accounting and name caches, see mem_t and names_t
+mem_t mem;
+names_t names;
+// The SYN flood detector, see synflood_t
+synflood_t synflood;
+// Snapshots to rewind to, see history_t
+history_t history;
+// Connection churn from conntrack events, see churn_t
+churn_t churn;
+// The network namespaces we watch, see netns_t
+netns_t netns;
+static const char *phase_names[PHASE_MAX+1] = {
+  "dump", "process", "resolve", "sort", "format", "render"
 };
 
 
@@ -223,1468 +768,5875 @@ void splita(char s, string line, vector<string> &result)
 /*
  * This determines the length of an integer (i.e. number of digits)
  */
-unsigned int digits(unsigned long x)
+unsigned int digits(uint64_t x)
 {
-  return (unsigned int) floor(log10((double)x))+1;
+  unsigned int n = 1;
+  while (x >= 10) {
+    x /= 10;
+    n++;
+  }
+  return n;
 }
 
 /*
- * Check to ensure an IP & netmask are valid
+ * FORMATTING
+ *
+ * We turn every address, port, and counter in the table into text on
+ * every refresh, so with big tables the generic tools (ostringstream,
+ * inet_ntop(), snprintf()) dominate. These do the same jobs with no
+ * allocation and no locale or format parsing. Each writes into a caller
+ * buffer, returns the length, and does NOT NUL-terminate.
  */
-bool check_ip(const char *arg, in6_addr *addr, uint8_t *family, uint8_t *netmask, bool *has_netmask)
-{
-  const char *p_arg;
-  char ip[NAMELEN];
 
-  // Check for netmask prefix
-  p_arg = strrchr(arg, '/');
-  if (p_arg == NULL) {
-    memcpy(ip, arg, (strlen(arg) + 1));
-    *has_netmask = false;
-  } else {
-    size_t ip_len = strlen(arg) - strlen(p_arg);
-    memcpy(ip, arg, ip_len);
-    ip[ip_len] = '\0';
+// "00" through "99", so we can convert two digits per division
+static const char digit_pairs[] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
 
-    const char *net_arg = arg + ip_len + 1;
-    if (net_arg[0] == '\0')
-      return false;
-    int net_int = atoi(net_arg);
-    if (net_int < 0 || net_int > 128)
-      return false; // Max IPv6 prefix length
-    *has_netmask = true;
-    *netmask = (uint8_t) net_int;
+/*
+ * Decimal representation of 'val'. 'buf' must have room for 20
+ * characters.
+ */
+size_t fmt_uint(char *buf, uint64_t val)
+{
+  char tmp[20];
+  char *p = tmp + sizeof(tmp);
+  while (val >= 100) {
+    unsigned int pair = (val % 100) * 2;
+    val /= 100;
+    *--p = digit_pairs[pair + 1];
+    *--p = digit_pairs[pair];
+  }
+  if (val >= 10) {
+    *--p = digit_pairs[val * 2 + 1];
+    *--p = digit_pairs[val * 2];
+  } else {
+    *--p = '0' + val;
   }
+  size_t len = tmp + sizeof(tmp) - p;
+  memcpy(buf, p, len);
+  return len;
+}
 
-  // Get IP
-  int ret;
-  ret = inet_pton(AF_INET6, ip, addr);
-  if (ret) {
-    *family = AF_INET6;
-    return true;
+/*
+ * Dotted-quad. Every octet's text is looked up in a table built at
+ * startup, so this is just four small copies. 'buf' must have room for 15
+ * characters.
+ */
+struct octet_table_t {
+  struct {
+    char str[3];
+    uint8_t len;
+  } octet[256];
+
+  octet_table_t()
+  {
+    for (unsigned int i = 0; i < 256; i++)
+      octet[i].len = fmt_uint(octet[i].str, i);
   }
-  ret = inet_pton(AF_INET, ip, addr);
-  if (ret) {
-    if (*has_netmask && *netmask > 32)
-      return false; // Max IPv4 prefix length
-    *family = AF_INET;
-    return true;
+};
+static const octet_table_t octets;
+
+size_t fmt_ipv4(char *buf, const uint8_t *addr)
+{
+  char *p = buf;
+  for (int i = 0; i < 4; i++) {
+    const auto &o = octets.octet[addr[i]];
+    if (i)
+      *p++ = '.';
+    memcpy(p, o.str, 3);
+    p += o.len;
   }
-  return false;
+  return p - buf;
 }
 
 /*
- * Compare IPv4/6 addresses with a netmask 
- * https://gist.github.com/duedal/b83303b4988a4afb2a75
+ * IPv6 in RFC 5952 form: lowercase, no leading zeros, the longest run of
+ * two or more zero groups (the first, if there's a tie) replaced with
+ * "::", and IPv4-mapped addresses with the IPv4 part in dotted-quad. 'buf'
+ * must have room for INET6_ADDRSTRLEN characters.
  */
-bool match_netmask(uint8_t family, const in6_addr &address, const in6_addr &network, uint8_t bits) {
-  if (family == AF_INET) {
-    if (bits == 0) {
-      // C99 6.5.7 (3): u32 << 32 is undefined behaviour
-      return true;
+size_t fmt_ipv6(char *buf, const uint8_t *addr)
+{
+  static const char hex[] = "0123456789abcdef";
+  unsigned int groups[8];
+  for (int i = 0; i < 8; i++)
+    groups[i] = (addr[i*2] << 8) | addr[i*2 + 1];
+
+  int best = -1, best_len = 0;
+  for (int i = 0; i < 8; ) {
+    if (groups[i] != 0) {
+      i++;
+      continue;
     }
-
-    struct in_addr addr4, net4;
-    memcpy(&addr4, &address, sizeof(in_addr));
-    memcpy(&net4, &network, sizeof(in_addr));
-    return !((addr4.s_addr ^ net4.s_addr) & htonl(0xFFFFFFFFu << (32 - bits)));
-  } else {
-    const uint32_t *a = address.s6_addr32;
-    const uint32_t *n = network.s6_addr32;
-
-    int bits_whole, bits_incomplete;
-    bits_whole = bits >> 5;         // number of whole u32
-    bits_incomplete = bits & 0x1F;  // number of bits in incomplete u32
-    if (bits_whole) {
-      if (memcmp(a, n, bits_whole << 2)) {
-        return false;
-      }
+    int j = i;
+    while (j < 8 && groups[j] == 0)
+      j++;
+    if (j - i > best_len) {
+      best = i;
+      best_len = j - i;
     }
-    if (bits_incomplete) {
-      uint32_t mask = htonl((0xFFFFFFFFu) << (32 - bits_incomplete));
-      if ((a[bits_whole] ^ n[bits_whole]) & mask) {
-        return false;
-      }
+    i = j;
+  }
+  if (best_len < 2)
+    best = -1;
+
+  char *p = buf;
+  // ::ffff:a.b.c.d
+  if (best == 0 && best_len == 5 && groups[5] == 0xffff) {
+    memcpy(p, "::ffff:", 7);
+    p += 7;
+    return (p - buf) + fmt_ipv4(p, addr + 12);
+  }
+
+  for (int i = 0; i < 8; i++) {
+    if (i == best) {
+      *p++ = ':';
+      *p++ = ':';
+      i += best_len - 1;
+      continue;
     }
-    return true;
+    if (i && i != best + best_len)
+      *p++ = ':';
+    unsigned int g = groups[i];
+    if (g >= 0x1000)
+      *p++ = hex[g >> 12];
+    if (g >= 0x100)
+      *p++ = hex[(g >> 8) & 0xf];
+    if (g >= 0x10)
+      *p++ = hex[(g >> 4) & 0xf];
+    *p++ = hex[g & 0xf];
   }
-  return false;
+  return p - buf;
 }
 
-/*
- * The help
- */
-void version()
+size_t fmt_ip(char *buf, uint8_t family, const in6_addr &addr)
 {
-  cout << "IPTables State Top Version " << VERSION << endl << endl;
+  if (family == AF_INET)
+    return fmt_ipv4(buf, addr.s6_addr);
+  return fmt_ipv6(buf, addr.s6_addr);
 }
 
-void help()
+/*
+ * A TTL in seconds as "hhh:mm:ss", with the hours right-aligned in 3
+ * characters, like printf("%3u:%02u:%02u"). 'buf' must have room for 16
+ * characters.
+ */
+size_t fmt_ttl(char *buf, unsigned int seconds)
 {
-  cout << "IPTables State Top Version " << VERSION << endl;
-  cout << "Usage: iptstate [<options>]\n\n";
-  cout << "  -c, --no-color\n";
-  cout << "\tToggle color-code by protocol\n\n";
-  cout << "  -C, --counters\n";
-  cout << "\tToggle display of bytes/packets counters\n\n";
-  cout << "  -d, --dst-filter <IP>[/<NETMASK>]\n";
-  cout << "\tOnly show states with a destination of <IP> and optional <NETMASK>\n";
-  cout << "\tNote: Hostname matching is not yet supported.\n\n";
-  cout << "  -D --dstpt-filter <port>\n";
-  cout << "\tOnly show states with a destination port of <port>\n\n";
-  cout << "  -h, --help\n";
-  cout << "\tThis help message\n\n";
-  cout << "  -i, --invert-filters\n";
-  cout << "\tInvert filters to display non-matching results\n\n";
-  cout << "  -l, --lookup\n";
-  cout << "\tShow hostnames instead of IP addresses. Enabling this will also"
-    << " enable\n\t-L to prevent an ever-growing number of DNS requests.\n\n";
-  cout << "  -m, --mark-truncated\n";
-  cout << "\tMark truncated hostnames with a '+'\n\n";
-  cout << "  -o, --no-dynamic\n";
-  cout << "\tToggle dynamic formatting\n\n";
-  cout << "  -L, --no-dns\n";
-  cout << "\tSkip outgoing DNS lookup states\n\n";
-  cout << "  -f, --no-loopback\n";
-  cout << "\tFilter states on loopback\n\n";
-  cout << "  -p, --no-scroll\n";
-  cout << "\tNo scrolling (don't use a \"pad\")\n\n";
-  cout << "  -r, --reverse\n";
-  cout << "\tReverse sort order\n\n";
-  cout << "  -R, --rate <seconds>\n";
-  cout << "\tRefresh rate, followed by rate in seconds\n";
-  cout << "\tNote: For statetop, not applicable for -s\n\n";
-  cout << "  -1, --single\n";
-  cout << "\tSingle run (no curses)\n\n";
-  cout << "  -b, --sort <column>\n";
-  cout << "\tThis determines what column to sort by. Options:\n";
-  cout << "\t  d: Destination IP (or Name)\n";
-  cout << "\t  p: Protocol\n";
-  cout << "\t  s: State\n";
-  cout << "\t  t: TTL\n";
-  cout << "\t  b: Bytes\n";
-  cout << "\t  P: Packets\n";
-  cout << "\tTo sort by Source IP (or Name), don't use -b.\n";
-  cout << "\tNote that bytes/packets are only available when"
-    << " supported in the kernel,\n";
-  cout << "\tand enabled with -C\n\n";
-  cout << "  -s, --src-filter <IP>[/<NETMASK>]\n";
-  cout << "\tOnly show states with a source of <IP> and optional <NETMASK>\n";
-  cout << "\tNote: Hostname matching is not yet supported.\n\n";
-  cout << "  -S, --srcpt-filter <port>\n";
-  cout << "\tOnly show states with a source port of <port>\n\n";
-  cout << "  -t, --totals\n";
-  cout << "\tToggle display of totals\n\n";
-  cout << "See man iptstate(8) or the interactive help for more"
-    << " information.\n";
-  exit(0);
+  unsigned int hours = seconds / 3600;
+  unsigned int minutes = seconds / 60 % 60;
+  seconds %= 60;
+
+  char *p = buf;
+  if (hours < 100)
+    *p++ = ' ';
+  if (hours < 10)
+    *p++ = ' ';
+  p += fmt_uint(p, hours);
+  *p++ = ':';
+  memcpy(p, digit_pairs + minutes * 2, 2);
+  p += 2;
+  *p++ = ':';
+  memcpy(p, digit_pairs + seconds * 2, 2);
+  p += 2;
+  return p - buf;
 }
 
 /*
- * Resolve hostnames
+ * Protocol names. getprotobynumber() reads /etc/protocols every time
+ * (or asks NSS), which is far too slow to do for every state, and there
+ * are only 256 of them, so we look each one up once.
  */
-void resolve_host(const uint8_t &family, const in6_addr &ip, string &name)
+const string &proto_name(uint8_t proto)
 {
-  struct hostent *hostinfo = NULL;
+  static string names[256];
+  static bool looked_up[256];
 
-  if ((hostinfo = gethostbyaddr((char *)&ip, sizeof(ip), family)) != NULL) {
-    name = hostinfo->h_name;
+  if (looked_up[proto]) {
+    stats.cache_hits++;
   } else {
-    char str[NAMELEN];
-    name = inet_ntop(family, (void *)&ip, str, NAMELEN-1) ;
+    stats.cache_misses++;
+    struct protoent *pe = getprotobynumber(proto);
+    if (pe == NULL) {
+      char tmp[20];
+      names[proto].assign(tmp, fmt_uint(tmp, proto));
+    } else {
+      names[proto] = pe->p_name;
+      /*
+       * if proto is "ipv6-icmp" we can just say "icmp6" to save space...
+       * it's more common/standard anyway
+       */
+      if (names[proto] == "ipv6-icmp")
+        names[proto] = "icmp6";
+    }
+    looked_up[proto] = true;
   }
+  return names[proto];
 }
 
-void resolve_port(const unsigned int &port, string &name, const string &proto)
+/*
+ * OUTPUT BUFFERING
+ *
+ * When dumping a large table in single-run mode, printf() and iostreams
+ * (parsing the format and locking the stream for every line) cost far more
+ * than the actual I/O. So single-run output is built up in a big buffer with
+ * these, and handed to the kernel with a few large write()s.
+ */
+
+// Single-run output goes through here rather than stdio
+outbuf_t stdout_buf = { STDOUT_FILENO, 0, {} };
+
+void out_flush(outbuf_t &ob)
 {
-  struct servent *portinfo = NULL;
+  size_t done = 0;
+  while (done < ob.used) {
+    ssize_t ret = write(ob.fd, ob.buf + done, ob.used - done);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      // Nowhere to report this to, and no point retrying.
+      break;
+    }
+    done += ret;
+  }
+  ob.used = 0;
+}
 
-  if ((portinfo = getservbyport(htons(port), proto.c_str())) != NULL) {
-    name = portinfo->s_name;
-  } else {
-    ostringstream buf;
-    buf.str("");
-    buf << port;
-    name = buf.str();
+void out_write(outbuf_t &ob, const char *str, size_t len)
+{
+  if (ob.used + len > OUTBUF_SIZE) {
+    out_flush(ob);
+    if (len > OUTBUF_SIZE) {
+      ssize_t ret [[maybe_unused]] = write(ob.fd, str, len);
+      return;
+    }
   }
+  memcpy(ob.buf + ob.used, str, len);
+  ob.used += len;
+}
+
+void out_write(outbuf_t &ob, const string &str)
+{
+  out_write(ob, str.data(), str.size());
 }
 
 /*
- * If lookup mode is on, we lookup the names and put them in the structure.
- *
- * If lookup mode is not on, we generate strings of the addresses and put
- * those in the structure.
- *
- * Finally, we update the max_t structure.
- *
- * NOTE: We stringify addresses largely because in the IPv6 case we need
- * to treat them like truncate-able strings.
+ * Write 'str', padded with spaces to 'width' - i.e. printf("%-*s").
+ * Like printf() we don't truncate if it's too long.
  */
-void stringify_entry(tentry_t *entry, max_t &max, const flags_t &flags)
+void out_pad(outbuf_t &ob, const char *str, size_t len, size_t width)
 {
-  unsigned int size = 0;
-  ostringstream buffer;
-  char tmp[NAMELEN];
+  out_write(ob, str, len);
+  if (len >= width)
+    return;
+  size_t pad = width - len;
+  if (ob.used + pad > OUTBUF_SIZE)
+    out_flush(ob);
+  memset(ob.buf + ob.used, ' ', pad);
+  ob.used += pad;
+}
 
-  bool have_port = entry->proto == "tcp" || entry->proto == "udp";
-  if (!have_port) {
-    entry->spname = entry->dpname = "";
-  }
+/*
+ * printf() into the buffer. Only for the odd header line, the per-state
+ * lines use out_row().
+ */
+void out_printf(outbuf_t &ob, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+void out_printf(outbuf_t &ob, const char *fmt, ...)
+{
+  char tmp[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+  va_end(ap);
+  if (len < 0)
+    return;
+  if ((size_t)len >= sizeof(tmp))
+    len = sizeof(tmp) - 1;
+  out_write(ob, tmp, len);
+}
 
-  if (flags.lookup) {
-    resolve_host(entry->family, entry->src, entry->sname);
-    resolve_host(entry->family, entry->dst, entry->dname);
-    if (have_port) {
-      resolve_port(entry->srcpt, entry->spname, entry->proto);
-      resolve_port(entry->dstpt, entry->dpname, entry->proto);
+/*
+ * Parse a format from determine_format() (or DEFAULT_FORMAT) into a
+ * rowfmt_t. Anything other than "%-<width>s" and "%%" is kept literally.
+ */
+void parse_format(const string &format, rowfmt_t &fmt)
+{
+  fmt.lits.clear();
+  fmt.widths.clear();
+  string lit;
+  for (size_t i = 0; i < format.size(); i++) {
+    if (format[i] != '%') {
+      lit += format[i];
+      continue;
     }
-  } else {
-    buffer << inet_ntop(entry->family, (void*)&(entry->src), tmp, NAMELEN-1);
-    entry->sname = buffer.str();
-    buffer.str("");
-    buffer << inet_ntop(entry->family, (void*)&(entry->dst), tmp, NAMELEN-1);
-    entry->dname = buffer.str();
-    buffer.str("");
-    if (have_port) {
-      buffer << entry->srcpt;
-      entry->spname = buffer.str();
-      buffer.str("");
-      buffer << entry->dstpt;
-      entry->dpname = buffer.str();
-      buffer.str("");
+    if (i + 1 < format.size() && format[i+1] == '%') {
+      lit += '%';
+      i++;
+      continue;
+    }
+    size_t j = i + 1;
+    if (j < format.size() && format[j] == '-')
+      j++;
+    unsigned int width = 0;
+    while (j < format.size() && isdigit(format[j]))
+      width = width * 10 + (format[j++] - '0');
+    if (j >= format.size() || format[j] != 's') {
+      lit += format[i];
+      continue;
     }
+    fmt.lits.push_back(lit);
+    fmt.widths.push_back(width);
+    lit = "";
+    i = j;
   }
+  fmt.lits.push_back(lit);
+}
 
-  size = entry->sname.size() + entry->spname.size() + 1;
-  if (size > max.src)
-    max.src = size;
+/*
+ * Write one line of 'fmt' with the given fields. 'fields' must have as
+ * many entries as fmt has widths.
+ */
+void out_row(outbuf_t &ob, const rowfmt_t &fmt, const char *fields[],
+             const size_t lens[])
+{
+  for (size_t i = 0; i < fmt.widths.size(); i++) {
+    out_write(ob, fmt.lits[i]);
+    out_pad(ob, fields[i], lens[i], fmt.widths[i]);
+  }
+  out_write(ob, fmt.lits.back());
+}
 
-  size = entry->dname.size() + entry->dpname.size() + 1;
-  if (size > max.dst)
-    max.dst = size;
+/*
+ * 64-bit FNV-1a. Used to fingerprint rendered rows, so it just needs to be
+ * cheap and spread well, not be cryptographically strong. Pass in the
+ * previous result to hash several things together.
+ */
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+uint64_t fnv_hash(const void *data, size_t len, uint64_t hash = FNV_OFFSET)
+{
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
 }
 
+uint64_t fnv_hash(const string &str, uint64_t hash = FNV_OFFSET)
+{
+  // hash the terminating NUL too, so "ab"+"c" != "a"+"bc"
+  return fnv_hash(str.c_str(), str.size() + 1, hash);
+}
 
 /*
- * SORT FUNCTIONS
+ * Current time in microseconds on the given clock. We use CLOCK_MONOTONIC
+ * for scheduling, since it doesn't jump around, and
+ * CLOCK_PROCESS_CPUTIME_ID to measure how much CPU we're using.
  */
-bool src_sort(tentry_t *one, tentry_t *two)
+uint64_t now_usec(clockid_t clock = CLOCK_MONOTONIC)
 {
-  /*
-   * memcmp() will properly sort v4 or v6 addresses, but not cross-family
-   * (presumably because of garbage in the top 96 bytes when you store
-   * a v4 address in a in6_addr), so we sort by family and then memcmp()
-   * within the same family.
-   */
-  if (one->family == two->family) {
-    return memcmp(one->src.s6_addr, two->src.s6_addr, 16) * sort_factor < 0;
-  } else if (one->family == AF_INET) {
-    return sort_factor > 0;
-  } else {
-    return sort_factor < 0;
-  }
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-bool srcname_sort(tentry_t *one, tentry_t *two)
+/*
+ * Sleep until 'when' on the monotonic clock, see now_usec()
+ */
+void sleep_until(uint64_t when)
 {
-  return one->sname.compare(two->sname) * sort_factor < 0;
+  uint64_t now = now_usec();
+  if (now >= when)
+    return;
+  timespec wait;
+  wait.tv_sec = (when - now) / 1000000;
+  wait.tv_nsec = (when - now) % 1000000 * 1000;
+  nanosleep(&wait, NULL);
 }
 
-bool dst_sort(tentry_t *one, tentry_t *two)
+/*
+ * INSTRUMENTATION
+ */
+
+/*
+ * Start counting a new refresh. We keep the render time, since that's
+ * measured after the status line showing it has been drawn.
+ */
+void stats_reset(bool detail)
 {
-  // See src_sort() for details
-  if (one->family == two->family) {
-    return memcmp(one->dst.s6_addr, two->dst.s6_addr, 16) * sort_factor < 0;
-  } else if (one->family == AF_INET) {
-    return sort_factor > 0;
-  } else {
-    return sort_factor < 0;
-  }
+  uint64_t render = stats.last_render;
+  memset(&stats, 0, sizeof(stats));
+  stats.detail = detail;
+  stats.last_render = stats.usec[PHASE_RENDER] = render;
 }
 
-bool dstname_sort(tentry_t *one, tentry_t *two)
+// Add the time since 'start' to 'phase', and make 'start' now
+void stats_time(int phase, uint64_t &start)
 {
-  return one->dname.compare(two->dname) * sort_factor < 0;
+  uint64_t now = now_usec();
+  stats.usec[phase] += now - start;
+  start = now;
 }
 
 /*
- * int comparison that takes care of sort_factor
- * used for ports, bytes, etc...
+ * Like stats_time(), but for the render phase: that's timed once per
+ * refresh and carried over to the next, so it's set rather than added to.
  */
-bool cmpint(int one, int two)
+void stats_render(uint64_t &start)
 {
-  return (sort_factor > 0) ? one < two : one > two;
+  uint64_t now = now_usec();
+  stats.last_render = stats.usec[PHASE_RENDER] = now - start;
+  start = now;
 }
 
-bool srcpt_sort(tentry_t *one, tentry_t *two)
+void stats_text(string &out)
 {
-  return cmpint(one->srcpt, two->srcpt);
+  char tmp[128];
+  out.clear();
+  for (int i = 0; i <= PHASE_MAX; i++) {
+    if (!stats.detail && (i == PHASE_PROCESS || i == PHASE_RESOLVE))
+      continue;
+    snprintf(tmp, sizeof(tmp), "%s %.1fms ", phase_names[i],
+             stats.usec[i] / 1000.0);
+    out += tmp;
+  }
+  uint64_t lookups = stats.cache_hits + stats.cache_misses;
+  snprintf(tmp, sizeof(tmp), "| %" PRIu64 " seen, %" PRIu64 " filtered, %"
+           PRIu64 " resolved, %.1f%% cache hits, %" PRIu64 " allocs",
+           stats.seen, stats.filtered, stats.resolved,
+           lookups ? 100.0 * stats.cache_hits / lookups : 100.0, stats.allocs);
+  out += tmp;
+  snprintf(tmp, sizeof(tmp), " | mem %.1fM table, %.1fM names, %.1fM render,"
+           " %.1fM tracking", (mem.table + mem.slots) / 1048576.0,
+           mem.caches / 1048576.0, mem.render / 1048576.0,
+           (mem.rates + mem.changes) / 1048576.0);
+  out += tmp;
+  if (mem.budget) {
+    static const char *levels[] = {"", ", names dropped", ", top-K",
+                                   ", sampled"};
+    snprintf(tmp, sizeof(tmp), " of %.1fM%s", mem.budget / 1048576.0,
+             levels[mem.level]);
+    out += tmp;
+  }
 }
 
-bool dstpt_sort(tentry_t *one, tentry_t *two)
+void stats_json(string &out)
 {
-  return cmpint(one->dstpt, two->dstpt);
+  char tmp[128];
+  out = "{";
+  for (int i = 0; i <= PHASE_MAX; i++) {
+    snprintf(tmp, sizeof(tmp), "\"%s_ms\":%.3f,", phase_names[i],
+             stats.usec[i] / 1000.0);
+    out += tmp;
+  }
+  snprintf(tmp, sizeof(tmp), "\"seen\":%" PRIu64 ",\"filtered\":%" PRIu64
+           ",\"resolved\":%" PRIu64 ",", stats.seen, stats.filtered,
+           stats.resolved);
+  out += tmp;
+  snprintf(tmp, sizeof(tmp), "\"cache_hits\":%" PRIu64 ",\"cache_misses\":%"
+           PRIu64 ",\"allocs\":%" PRIu64 ",", stats.cache_hits,
+           stats.cache_misses, stats.allocs);
+  out += tmp;
+  // one at a time, so even the biggest tables fit in 'tmp'
+  const struct {
+    const char *name;
+    uint64_t bytes;
+  } fields[] = {
+    {"table", mem.table + mem.slots},
+    {"names", mem.caches},
+    {"render", mem.render},
+    {"tracking", mem.rates + mem.changes},
+    {"budget", mem.budget},
+  };
+  for (const auto &field : fields) {
+    snprintf(tmp, sizeof(tmp), "\"mem_%s\":%" PRIu64 ",", field.name,
+             field.bytes);
+    out += tmp;
+  }
+  snprintf(tmp, sizeof(tmp), "\"mem_level\":%d}", mem.level);
+  out += tmp;
 }
 
-bool proto_sort(tentry_t *one, tentry_t *two)
+// For --stats outside of curses
+void print_stats(int format)
 {
-  return one->proto.compare(two->proto) * sort_factor < 0;
+  string out;
+  if (format == STATS_JSON)
+    stats_json(out);
+  else
+    stats_text(out);
+  cerr << out << endl;
 }
 
-bool state_sort(tentry_t *one, tentry_t *two)
+/*
+ * MEMORY ACCOUNTING
+ *
+ * These are estimates: we count what we allocate, plus MEM_OVERHEAD for
+ * each allocation, rather than asking malloc().
+ */
+
+// Heap used by a string, beyond the string object itself
+uint64_t string_bytes(const string &str)
 {
-  return one->state.compare(two->state) * sort_factor < 0;
+  // short strings are kept inside the object
+  static const size_t local = string().capacity();
+  return str.capacity() > local ? str.capacity() + 1 + MEM_OVERHEAD : 0;
 }
 
-bool ttl_sort(tentry_t *one, tentry_t *two)
+uint64_t entry_bytes(const tentry_t *entry)
 {
-  return one->ttl.compare(two->ttl) * sort_factor < 0;
+  return sizeof(tentry_t) + MEM_OVERHEAD + string_bytes(entry->proto)
+    + string_bytes(entry->state) + string_bytes(entry->ttl)
+    + string_bytes(entry->sname) + string_bytes(entry->dname)
+    + string_bytes(entry->spname) + string_bytes(entry->dpname)
+    + (entry->nat ? sizeof(nat_t) + MEM_OVERHEAD : 0);
 }
 
-bool bytes_sort(tentry_t *one, tentry_t *two)
+uint64_t mem_used()
 {
-  return cmpint(one->bytes, two->bytes);
+  return mem.table + mem.slots + mem.caches + mem.render + mem.rates
+    + mem.changes;
 }
 
-bool packets_sort(tentry_t *one, tentry_t *two)
+void names_clear()
 {
-  return cmpint(one->packets, two->packets);
+  unordered_map<string, string>().swap(names.hosts);
+  unordered_map<uint32_t, string>().swap(names.ports);
+  names.bytes = mem.caches = 0;
+  names.expires = now_usec() + (uint64_t)NAME_CACHE_TTL * 1000000;
 }
 
 /*
- * CURSES HELPER FUNCTIONS
+ * Remember a name if there's room for it. 'bytes' is what the key costs
+ * beyond the hash table node.
  */
+template <typename K>
+void names_add(unordered_map<K, string> &cache, const K &key,
+               const string &name, uint64_t bytes)
+{
+  bytes += sizeof(typename unordered_map<K, string>::value_type)
+    + 2 * sizeof(void *) + MEM_OVERHEAD + string_bytes(name);
+  if (mem.budget
+      && (mem.level >= MEM_NOCACHE || mem_used() + bytes > mem.budget))
+    return;
+  cache.emplace(key, name);
+  names.bytes += bytes;
+  mem.caches = names.bytes + sizeof(void *)
+    * (names.hosts.bucket_count() + names.ports.bucket_count());
+}
 
 /*
- * Finish-up for curses environment
+ * Parse a size in bytes, with an optional k, M or G suffix (powers of
+ * 1024).
  */
-void end_curses()
+bool parse_size(const char *arg, uint64_t &size)
 {
-  if (stdscr == NULL)
-    return;
-  curs_set(1);
-  nocbreak();
-  endwin();
-  cout << endl;
+  char *end;
+  size = strtoull(arg, &end, 10);
+  if (end == arg)
+    return false;
+  switch (*end) {
+    case 'k': case 'K':
+      size <<= 10;
+      end++;
+      break;
+    case 'm': case 'M':
+      size <<= 20;
+      end++;
+      break;
+    case 'g': case 'G':
+      size <<= 30;
+      end++;
+      break;
+  }
+  return *end == '\0' && size > 0;
 }
 
 /*
- * SIGWINCH signal handler.
+ * Parse a refresh rate. It's in seconds, but can have a fraction (0.5),
+ * or be given in milliseconds with an "ms" suffix (500ms). "auto" turns
+ * on adaptive refreshing.
  */
-void winch_handler(int sig)
+bool parse_rate(const char *arg, unsigned int &rate, bool &adaptive)
 {
-  sigset_t mask_set;
-  sigset_t old_set;
-  // Reset signal handler
-  signal(28, winch_handler);
-  // ignore this signal for a bit
-  sigfillset(&mask_set);
-  sigprocmask(SIG_SETMASK, &mask_set, &old_set);
+  if (!strcmp(arg, "auto")) {
+    adaptive = true;
+    return true;
+  }
 
-  need_resize = true;
+  char *end;
+  double val = strtod(arg, &end);
+  if (end == arg)
+    return false;
+  if (!strcmp(end, "ms"))
+    val /= 1000;
+  else if (*end != '\0' && strcmp(end, "s"))
+    return false;
+
+  val *= 1000;
+  if (!isfinite(val) || val < MIN_RATE || val > MAX_RATE)
+    return false;
+  rate = (unsigned int) val;
+  adaptive = false;
+  return true;
 }
 
 /*
- * SIGKILL signal handler
+ * Work out the next adaptive refresh interval.
+ *
+ * 'cost' is the CPU time (in usec) the last refresh took. We pick an interval
+ * such that refreshing costs at most 'budget' % of one CPU. If that means
+ * slowing down, we do so right away, but we only speed back up gradually,
+ * so one cheap refresh after a big one doesn't make us thrash.
  */
-void kill_handler(int sig)
+unsigned int adapt_rate(unsigned int rate, uint64_t cost, unsigned int budget)
 {
-  end_curses();
-  printf("Caught signal %d, cleaning up.\n", sig);
-  exit(0);
+  uint64_t want = cost * 100 / budget / 1000;
+  if (want < rate)
+    want = (rate + want) / 2;
+  if (want < ADAPTIVE_MIN_RATE)
+    want = ADAPTIVE_MIN_RATE;
+  if (want > MAX_RATE)
+    want = MAX_RATE;
+  return want;
 }
 
 /*
- * Start-up for curses environment
- *
- * NOTE: That by default we create a pad. A pad is a special type of window that
- *       can be bigger than the screen. See the comments in interactive_help()
- *       below for how to use it and how it works.
- *
- *       However, pad's lack the double-buffering and other features of standard
- *       ncurses windows and thus can appear slower. Thus we allow the user to
- *       downgrade to standard windows if they choose. See the comments
- *       switch_scroll() for more details.
- *
+ * Check to ensure an IP & netmask are valid
  */
-static WINDOW* start_curses(flags_t &flags)
+bool check_ip(const char *arg, in6_addr *addr, uint8_t *family, uint8_t *netmask, bool *has_netmask)
 {
-  [[maybe_unused]] int y, x;
-  initscr();
-  cbreak();
-  noecho();
-  halfdelay(1);
-
-  /*
-   * If we're starting curses, we care about SIGWNCH, SIGINT, and SIGTERM
-   * so this seems like as good a place as any to setup our signal
-   * handler.
-   */
-  // Resize
-  signal(28, winch_handler);
-  // Shutdown
-  signal(2, kill_handler);
-  signal(15, kill_handler);
+  const char *p_arg;
+  char ip[NAMELEN];
 
-  if (has_colors()) {
-    start_color();
-    // for tcp
-    init_pair(1, COLOR_GREEN, COLOR_BLACK);
-    // for udp
-    init_pair(2, COLOR_YELLOW, COLOR_BLACK);
-    // for icmp
-    init_pair(3, COLOR_RED, COLOR_BLACK);
-    // for prompts
-    init_pair(4, COLOR_BLACK, COLOR_RED);
-    // for the currently selected row
-    init_pair(5, COLOR_BLACK, COLOR_GREEN);
-    init_pair(6, COLOR_BLACK, COLOR_YELLOW);
-    init_pair(7, COLOR_BLACK, COLOR_RED);
+  // Check for netmask prefix
+  p_arg = strrchr(arg, '/');
+  if (p_arg == NULL) {
+    memcpy(ip, arg, (strlen(arg) + 1));
+    *has_netmask = false;
   } else {
-    flags.nocolor = true;
+    size_t ip_len = strlen(arg) - strlen(p_arg);
+    memcpy(ip, arg, ip_len);
+    ip[ip_len] = '\0';
+
+    const char *net_arg = arg + ip_len + 1;
+    if (net_arg[0] == '\0')
+      return false;
+    int net_int = atoi(net_arg);
+    if (net_int < 0 || net_int > 128)
+      return false; // Max IPv6 prefix length
+    *has_netmask = true;
+    *netmask = (uint8_t) net_int;
   }
 
-  if (!flags.noscroll) {
-    getmaxyx(stdscr, y, x);
-    return newpad(NLINES, x);
+  // Get IP
+  int ret;
+  ret = inet_pton(AF_INET6, ip, addr);
+  if (ret) {
+    *family = AF_INET6;
+    return true;
   }
-  return stdscr;
+  ret = inet_pton(AF_INET, ip, addr);
+  if (ret) {
+    if (*has_netmask && *netmask > 32)
+      return false; // Max IPv4 prefix length
+    *family = AF_INET;
+    return true;
+  }
+  return false;
 }
 
 /*
- * Figure out the best way to get the screensize_t, and then do it
+ * Compare IPv4/6 addresses with a netmask 
+ * https://gist.github.com/duedal/b83303b4988a4afb2a75
  */
-screensize_t get_size(const bool &single)
-{
-  int maxx = 0, maxy = 0;
-  if (!single) {          
-    getmaxyx(stdscr, maxy, maxx);
+bool match_netmask(uint8_t family, const in6_addr &address, const in6_addr &network, uint8_t bits) {
+  if (family == AF_INET) {
+    if (bits == 0) {
+      // C99 6.5.7 (3): u32 << 32 is undefined behaviour
+      return true;
+    }
+
+    struct in_addr addr4, net4;
+    memcpy(&addr4, &address, sizeof(in_addr));
+    memcpy(&net4, &network, sizeof(in_addr));
+    return !((addr4.s_addr ^ net4.s_addr) & htonl(0xFFFFFFFFu << (32 - bits)));
   } else {
-    maxx = 72;
+    const uint32_t *a = address.s6_addr32;
+    const uint32_t *n = network.s6_addr32;
 
-    struct winsize w;
-    // try all 3 std filehandles since people may have pipe in/out of us
-    for (int fd : {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO}) {
-      if (ioctl(fd, TIOCGWINSZ, &w) == 0 && w.ws_col > 0) {
-        maxx = w.ws_col;
-        break;
+    int bits_whole, bits_incomplete;
+    bits_whole = bits >> 5;         // number of whole u32
+    bits_incomplete = bits & 0x1F;  // number of bits in incomplete u32
+    if (bits_whole) {
+      if (memcmp(a, n, bits_whole << 2)) {
+        return false;
       }
     }
-
-    if (getenv("COLS"))
-      maxx = atoi(getenv("COLS"));
+    if (bits_incomplete) {
+      uint32_t mask = htonl((0xFFFFFFFFu) << (32 - bits_incomplete));
+      if ((a[bits_whole] ^ n[bits_whole]) & mask) {
+        return false;
+      }
+    }
+    return true;
   }
-
-  screensize_t a;
-  a.x = maxx;
-  a.y = maxy;
-
-  return a;
+  return false;
 }
 
 /*
- * Error function for screen being too small.
+ * The help
  */
-void term_too_small()
+void version()
 {
-  end_curses();
-  cout << "I'm sorry, your terminal must be atleast 72 columns"
-       << "wide to run iptstate\n";
-  exit(3);
+  cout << "IPTables State Top Version " << VERSION << endl << endl;
 }
 
-/*
- * This is one of those "well, I should impliment it to be complete, but
- * I doubt it'll get used very often features." It was a nice-thing-to-do
- * to impliment the ability for iptstate to use stdscr instead of a pad
- * as this provides the doulbe-buffering and other features that pads
- * do not. This is probably useful to a small subset of users. It's pretty
- * unlikely people will want to interactively want to change this during
- * runtime, but since I implimented noscroll, it's only proper to impliment
- * interactive toggling.
- *
- * TECH NOTE:
- *      This is just a note for myself so I remember why this is the way it is.
- *
- *      The syntax WINDOW *&mainwin is right, thought it's doing what you'd
- *      expect WINDOW &*mainwin to do... except that's invalid. So it's just a
- *      &foo pass on a WINDOW*.
- */
-void switch_scroll(flags_t &flags, WINDOW *&mainwin)
+void help()
 {
-  [[maybe_unused]] int x, y;
-  if (flags.noscroll) {
-    getmaxyx(stdscr, y, x);
-    // remove stuff from the bottom window
-    erase();
-    // build pad
-    wmove(mainwin, 0, 0);
-    mainwin = newpad(NLINES, x);
-    wmove(mainwin, 0, 0);
-    keypad(mainwin,1);
-    halfdelay(1);
+  cout << "IPTables State Top Version " << VERSION << endl;
+  cout << "Usage: iptstate [<options>]\n\n";
+  cout << "  -c, --no-color\n";
+  cout << "\tToggle color-code by protocol\n\n";
+  cout << "  -C, --counters\n";
+  cout << "\tToggle display of bytes/packets counters\n\n";
+  cout << "  -d, --dst-filter <IP>[/<NETMASK>]\n";
+  cout << "\tOnly show states with a destination of <IP> and optional <NETMASK>\n";
+  cout << "\tNote: Hostname matching is not yet supported.\n\n";
+  cout << "  -D --dstpt-filter <port>\n";
+  cout << "\tOnly show states with a destination port of <port>\n\n";
+  cout << "  -h, --help\n";
+  cout << "\tThis help message\n\n";
+  cout << "  -i, --invert-filters\n";
+  cout << "\tInvert filters to display non-matching results\n\n";
+  cout << "  -l, --lookup\n";
+  cout << "\tShow hostnames instead of IP addresses. Enabling this will also"
+    << " enable\n\t-L to prevent an ever-growing number of DNS requests.\n\n";
+  cout << "  -m, --mark-truncated\n";
+  cout << "\tMark truncated hostnames with a '+'\n\n";
+  cout << "  -o, --no-dynamic\n";
+  cout << "\tToggle dynamic formatting\n\n";
+  cout << "  -L, --no-dns\n";
+  cout << "\tSkip outgoing DNS lookup states\n\n";
+  cout << "  -f, --no-loopback\n";
+  cout << "\tFilter states on loopback\n\n";
+  cout << "  -p, --no-scroll\n";
+  cout << "\tNo scrolling (only show the first screen of states)\n\n";
+  cout << "  -r, --reverse\n";
+  cout << "\tReverse sort order\n\n";
+  cout << "  -R, --rate <seconds>|auto\n";
+  cout << "\tRefresh rate, followed by rate in seconds. Fractions (0.5) and\n";
+  cout << "\tmilliseconds (500ms) are allowed. 'auto' adapts the rate to how\n";
+  cout << "\texpensive each refresh is, see --cpu-budget\n";
+  cout << "\tNote: For statetop, not applicable for -s\n\n";
+  cout << "  --bench[=<sizes>]\n";
+  cout << "\tBenchmark each stage of processing on synthetic tables of\n";
+  cout << "\t<sizes> states (default " DEFAULT_BENCH ") and exit\n\n";
+  cout << "  --cpu-budget <percent>\n";
+  cout << "\tWith '-R auto', the most CPU (% of one core) to spend refreshing.\n";
+  cout << "\tDefaults to " << DEFAULT_CPU_BUDGET << "%\n\n";
+  cout << "  -1, --single\n";
+  cout << "\tSingle run (no curses)\n\n";
+  cout << "  --output text|json|csv|tsv|bin\n";
+  cout << "\tOutput format for single-run and headless modes. json is one\n";
+  cout << "\tobject per line, bin is a compact binary record stream. Any\n";
+  cout << "\tformat but text implies -1 unless --headless or --stream is given\n\n";
+  cout << "  --group src|dst|dport|dst:dport|proto|state|mark|netns|src/N[/M]|\n";
+  cout << "          dst/N[/M]\n";
+  cout << "\tShow one line per source, destination, etc. instead of per state,\n";
+  cout << "\twith the number of states and (estimated) distinct sources, a\n";
+  cout << "\tbreakdown of TCP states and summed counters. /N groups IPv4\n";
+  cout << "\taddresses by prefix, and /M IPv6 ones (default /64). Sort by\n";
+  cout << "\tconnections with -b d, or by distinct sources with -b S\n\n";
+  cout << "  --mark\n";
+  cout << "\tShow each state's mark (CONNMARK) in a column\n\n";
+  cout << "  --mark-filter <value>[/<mask>]\n";
+  cout << "\tOnly show states whose mark, ANDed with <mask>, is <value>. With\n";
+  cout << "\tnetlink this is done in the kernel, so other states aren't even\n";
+  cout << "\tread\n\n";
+  cout << "  --nat\n";
+  cout << "\tFor NATed states, show (and filter, sort and group by) where\n";
+  cout << "\tthey're translated to rather than the original addresses and\n";
+  cout << "\tports. JSON output has the other side as well\n\n";
+  cout << "  --netns all|<name>[,<name>...]\n";
+  cout << "\tWatch the conntrack tables of these network namespaces (under\n";
+  cout << "\t" << NETNS_DIR << ", or . for our own) together, dumping them all\n";
+  cout << "\tat once, and show which one (and zone) each state is in\n\n";
+  cout << "  --netns-filter <name>[/<zone>]\n";
+  cout << "\tOnly show states in this namespace, and zone if given\n\n";
+  cout << "  --rates\n";
+  cout << "\tShow bytes and packets per second since the last refresh instead\n";
+  cout << "\tof totals (implies -C). Sorting by them sorts by rate\n\n";
+  cout << "  --changes\n";
+  cout << "\tHighlight states that are new since the last refresh, keep ones\n";
+  cout << "\tthat have closed on the screen (dimmed) for " << GHOST_REFRESHES
+       << " refreshes, and\n";
+  cout << "\tshow how many opened and closed per second with the totals (-t)\n\n";
+  cout << "  --churn\n";
+  cout << "\tShow how many states are created and destroyed per second (1, 10\n";
+  cout << "\tand 60 second averages), per protocol and for the busiest\n";
+  cout << "\tdestinations, from conntrack events. Netlink source only\n\n";
+  cout << "  --syn-alert <count>[/<growth>]\n";
+  cout << "\tFlag destinations with at least <count> half-open (SYN_SENT or\n";
+  cout << "\tSYN_RECV) TCP states, or gaining at least <growth> of them per\n";
+  cout << "\tsecond (0 to only use one). Shown above the table, or written to\n";
+  cout << "\tstderr in single-run and headless modes\n\n";
+  cout << "  --alert-cmd <command>\n";
+  cout << "\tRun <command> with sh -c when a destination is flagged by\n";
+  cout << "\t--syn-alert and when it's no longer over the thresholds. See the\n";
+  cout << "\tman page for the environment it gets\n\n";
+  cout << "  --headless\n";
+  cout << "\tLike -1, but keep writing out the table every refresh (-R)\n\n";
+  cout << "  --stats[=text|json]\n";
+  cout << "\tShow how long each phase of a refresh took, and how much work\n";
+  cout << "\tit did: on stderr in single-run and headless modes, or as a\n";
+  cout << "\tstatus line in statetop (toggle with 'I')\n\n";
+  cout << "  --stream\n";
+  cout << "\tLike -1, but write out each state as soon as it's read, in\n";
+  cout << "\tkernel order, instead of building a table first. Uses constant\n";
+  cout << "\tmemory regardless of table size. Can't be used with -b or -r\n\n";
+  cout << "  --top[=K]\n";
+  cout << "\tLike --stream, but instead of the states, show the top K (default\n";
+  cout << "\t10) sources, destinations and destination ports by number of\n";
+  cout << "\tstates, and with -C by bytes. Counts are estimates, but memory\n";
+  cout << "\tuse is fixed regardless of table size\n\n";
+  cout << "  --history <bytes>[k|M|G]\n";
+  cout << "\tKeep up to this much history of past refreshes, which '[' and\n";
+  cout << "\t']' step back and forward through. Only what changed between\n";
+  cout << "\trefreshes is kept\n\n";
+  cout << "  --max-memory <bytes>[k|M|G]\n";
+  cout << "\tKeep the table, name caches and screen buffers within this much\n";
+  cout << "\tmemory. If the table doesn't fit, name caches are dropped, then\n";
+  cout << "\tonly the top states by bytes (with -C) or a random sample are kept\n\n";
+  cout << "  -b, --sort <column>\n";
+  cout << "\tThis determines what column to sort by. Options:\n";
+  cout << "\t  d: Destination IP (or Name)\n";
+  cout << "\t  p: Protocol\n";
+  cout << "\t  s: State\n";
+  cout << "\t  t: TTL\n";
+  cout << "\t  b: Bytes\n";
+  cout << "\t  P: Packets\n";
+  cout << "\tTo sort by Source IP (or Name), don't use -b.\n";
+  cout << "\tNote that bytes/packets are only available when"
+    << " supported in the kernel,\n";
+  cout << "\tand enabled with -C\n\n";
+  cout << "  --source netlink|procfs[:<file>]|replay:<file>|synthetic[:<opts>]\n";
+  cout << "\tWhere to read states from: the kernel (the default), a\n";
+  cout << "\t/proc/net/nf_conntrack-style file, a capture made with\n";
+  cout << "\t--output bin, or made-up states for testing. See the man page\n";
+  cout << "\tfor the synthetic options\n\n";
+  cout << "  --record <file>\n";
+  cout << "\tSave every state read (before filtering) to <file>, in the\n";
+  cout << "\tsame format as --output bin\n\n";
+  cout << "  --replay <file>\n";
+  cout << "\tPlay back a capture from --record or --output bin in real time\n\n";
+  cout << "  --speed <N>\n";
+  cout << "\tPlay back --replay captures <N> times faster (or slower)\n\n";
+  cout << "  -s, --src-filter <IP>[/<NETMASK>]\n";
+  cout << "\tOnly show states with a source of <IP> and optional <NETMASK>\n";
+  cout << "\tNote: Hostname matching is not yet supported.\n\n";
+  cout << "  -S, --srcpt-filter <port>\n";
+  cout << "\tOnly show states with a source port of <port>\n\n";
+  cout << "  -t, --totals\n";
+  cout << "\tToggle display of totals\n\n";
+  cout << "See man iptstate(8) or the interactive help for more"
+    << " information.\n";
+  exit(0);
+}
+
+/*
+ * Resolve hostnames
+ */
+void resolve_host(const uint8_t &family, const in6_addr &ip, string &name)
+{
+  string key((const char *)&ip, sizeof(ip));
+  key += (char)family;
+  auto cached = names.hosts.find(key);
+  if (cached != names.hosts.end()) {
+    stats.cache_hits++;
+    name = cached->second;
+    return;
+  }
+  stats.cache_misses++;
+
+  stats.resolved++;
+  struct hostent *hostinfo = NULL;
+
+  if ((hostinfo = gethostbyaddr((char *)&ip, sizeof(ip), family)) != NULL) {
+    name = hostinfo->h_name;
+  } else {
+    char str[NAMELEN];
+    name.assign(str, fmt_ip(str, family, ip));
+  }
+  names_add(names.hosts, key, name, string_bytes(key));
+}
+
+void resolve_port(const unsigned int &port, string &name, const string &proto)
+{
+  uint32_t key = port | (proto == "udp" ? 1 << 16 : 0);
+  auto cached = names.ports.find(key);
+  if (cached != names.ports.end()) {
+    stats.cache_hits++;
+    name = cached->second;
+    return;
+  }
+  stats.cache_misses++;
+
+  stats.resolved++;
+  struct servent *portinfo = NULL;
+
+  if ((portinfo = getservbyport(htons(port), proto.c_str())) != NULL) {
+    name = portinfo->s_name;
+  } else {
+    char str[20];
+    name.assign(str, fmt_uint(str, port));
+  }
+  names_add(names.ports, key, name, 0);
+}
+
+/*
+ * If lookup mode is on, we lookup the names and put them in the structure.
+ *
+ * If lookup mode is not on, we generate strings of the addresses and put
+ * those in the structure.
+ *
+ * Finally, we update the max_t structure.
+ *
+ * NOTE: We stringify addresses largely because in the IPv6 case we need
+ * to treat them like truncate-able strings.
+ */
+void stringify_entry(tentry_t *entry, max_t &max, const flags_t &flags)
+{
+  unsigned int size = 0;
+  char tmp[NAMELEN];
+
+  bool have_port = entry->proto == "tcp" || entry->proto == "udp";
+  if (!have_port) {
+    entry->spname = entry->dpname = "";
+  }
+
+  if (flags.lookup) {
+    resolve_host(entry->family, entry->src, entry->sname);
+    resolve_host(entry->family, entry->dst, entry->dname);
+    if (have_port) {
+      resolve_port(entry->srcpt, entry->spname, entry->proto);
+      resolve_port(entry->dstpt, entry->dpname, entry->proto);
+    }
+  } else {
+    entry->sname.assign(tmp, fmt_ip(tmp, entry->family, entry->src));
+    entry->dname.assign(tmp, fmt_ip(tmp, entry->family, entry->dst));
+    if (have_port) {
+      entry->spname.assign(tmp, fmt_uint(tmp, entry->srcpt));
+      entry->dpname.assign(tmp, fmt_uint(tmp, entry->dstpt));
+    }
+  }
+
+  size = entry->sname.size() + entry->spname.size() + 1;
+  if (size > max.src)
+    max.src = size;
+
+  size = entry->dname.size() + entry->dpname.size() + 1;
+  if (size > max.dst)
+    max.dst = size;
+}
+
+
+/*
+ * SORT FUNCTIONS
+ *
+ * Every sortable column gets a small "key" struct with a three-way cmp()
+ * and a by_family flag. entry_sort<> then turns a key and a direction into
+ * an actual std::sort() comparator, and sort_by<> instantiates a complete
+ * sort for it. sort_table() picks one of those out of the sorters[] table
+ * once per refresh.
+ *
+ * Since the direction and column are template arguments rather than a
+ * global we multiply every result by, the compiler can inline the whole
+ * comparison into the sort loop, and sorting doesn't depend on any global
+ * state, so it's safe to do from any thread.
+ */
+inline int cmp_num(uint64_t one, uint64_t two)
+{
+  return (one > two) - (one < two);
+}
+
+/*
+ * memcmp() will properly sort v4 or v6 addresses, but not cross-family
+ * (presumably because of garbage in the top 96 bytes when you store
+ * a v4 address in a in6_addr), so address keys set by_family, which has
+ * entry_sort<> group by family and then memcmp() within the same family.
+ */
+struct src_key {
+  static const bool by_family = true;
+  static int cmp(const tentry_t *one, const tentry_t *two)
+  {
+    return memcmp(one->src.s6_addr, two->src.s6_addr, 16);
+  }
+};
+
+struct srcname_key {
+  static const bool by_family = false;
+  static int cmp(const tentry_t *one, const tentry_t *two)
+  {
+    return one->sname.compare(two->sname);
+  }
+};
+
+struct dst_key {
+  static const bool by_family = true;
+  static int cmp(const tentry_t *one, const tentry_t *two)
+  {
+    return memcmp(one->dst.s6_addr, two->dst.s6_addr, 16);
+  }
+};
+
+struct dstname_key {
+  static const bool by_family = false;
+  static int cmp(const tentry_t *one, const tentry_t *two)
+  {
+    return one->dname.compare(two->dname);
+  }
+};
+
+struct srcpt_key {
+  static const bool by_family = false;
+  static int cmp(const tentry_t *one, const tentry_t *two)
+  {
+    return cmp_num(one->srcpt, two->srcpt);
+  }
+};
+
+struct dstpt_key {
+  static const bool by_family = false;
+  static int cmp(const tentry_t *one, const tentry_t *two)
+  {
+    return cmp_num(one->dstpt, two->dstpt);
+  }
+};
+
+struct proto_key {
+  static const bool by_family = false;
+  static int cmp(const tentry_t *one, const tentry_t *two)
+  {
+    return one->proto.compare(two->proto);
+  }
+};
+
+struct state_key {
+  static const bool by_family = false;
+  static int cmp(const tentry_t *one, const tentry_t *two)
+  {
+    return one->state.compare(two->state);
+  }
+};
+
+struct ttl_key {
+  static const bool by_family = false;
+  static int cmp(const tentry_t *one, const tentry_t *two)
+  {
+    return one->ttl.compare(two->ttl);
+  }
+};
+
+struct bytes_key {
+  static const bool by_family = false;
+  static int cmp(const tentry_t *one, const tentry_t *two)
+  {
+    return cmp_num(one->bytes, two->bytes);
+  }
+};
+
+struct packets_key {
+  static const bool by_family = false;
+  static int cmp(const tentry_t *one, const tentry_t *two)
+  {
+    return cmp_num(one->packets, two->packets);
+  }
+};
+
+struct byte_rate_key {
+  static const bool by_family = false;
+  static int cmp(const tentry_t *one, const tentry_t *two)
+  {
+    return cmp_num(one->byte_rate, two->byte_rate);
+  }
+};
+
+struct packet_rate_key {
+  static const bool by_family = false;
+  static int cmp(const tentry_t *one, const tentry_t *two)
+  {
+    return cmp_num(one->packet_rate, two->packet_rate);
+  }
+};
+
+/*
+ * The comparator itself. Reversing is just swapping the arguments, which
+ * also puts IPv6 ahead of IPv4 for by_family keys, as it always has.
+ */
+template <class Key, bool Reverse>
+struct entry_sort {
+  static bool less(const tentry_t *one, const tentry_t *two)
+  {
+    if (Key::by_family && one->family != two->family)
+      return one->family == AF_INET;
+    return Key::cmp(one, two) < 0;
+  }
+
+  bool operator()(const tentry_t *one, const tentry_t *two) const
+  {
+    return Reverse ? less(two, one) : less(one, two);
+  }
+};
+
+template <class Key, bool Reverse>
+void sort_by(vector<tentry_t*> &stable)
+{
+  std::sort(stable.begin(), stable.end(), entry_sort<Key, Reverse>());
+}
+
+typedef void (*sort_fn_t)(vector<tentry_t*> &);
+struct sorter_t {
+  const char *name;
+  // indexed by "reverse"
+  sort_fn_t sort[2];
+};
+#define SORTER(key, name) { name, { sort_by<key, false>, sort_by<key, true> } }
+
+/*
+ * Indexed by SORT_* and then by whether or not we're in lookup mode, since
+ * that's what decides whether src/dst sort by address or by name - or 2
+ * for groups (see group_table()), where the source and destination columns
+ * are the group and its number of states.
+ */
+static const sorter_t sorters[SORT_MAX + 1][3] = {
+  { SORTER(src_key, "SrcIP"), SORTER(srcname_key, "SrcName"),
+    SORTER(src_key, "Group") },
+  { SORTER(srcpt_key, "SrcPort"), SORTER(srcpt_key, "SrcPort"),
+    SORTER(srcpt_key, "Sources") },
+  { SORTER(dst_key, "DstIP"), SORTER(dstname_key, "DstName"),
+    SORTER(dstpt_key, "Conns") },
+  { SORTER(dstpt_key, "DstPort"), SORTER(dstpt_key, "DstPort"),
+    SORTER(dstpt_key, "Conns") },
+  { SORTER(proto_key, "Prt"), SORTER(proto_key, "Prt"),
+    SORTER(proto_key, "Prt") },
+  { SORTER(state_key, "State"), SORTER(state_key, "State"),
+    SORTER(state_key, "States") },
+  { SORTER(ttl_key, "TTL"), SORTER(ttl_key, "TTL"), SORTER(ttl_key, "TTL") },
+  { SORTER(bytes_key, "Bytes"), SORTER(bytes_key, "Bytes"),
+    SORTER(bytes_key, "Bytes") },
+  { SORTER(packets_key, "Packets"), SORTER(packets_key, "Packets"),
+    SORTER(packets_key, "Packets") },
+};
+
+// With --rates, the counter columns sort by rate instead
+static const sorter_t rate_sorters[2] = {
+  SORTER(byte_rate_key, "Bytes/s"), SORTER(packet_rate_key, "Packets/s"),
+};
+
+/*
+ * CURSES HELPER FUNCTIONS
+ */
+
+/*
+ * Finish-up for curses environment
+ */
+void end_curses()
+{
+  if (stdscr == NULL)
+    return;
+  curs_set(1);
+  nocbreak();
+  endwin();
+  cout << endl;
+}
+
+/*
+ * SIGWINCH signal handler.
+ */
+void winch_handler(int sig)
+{
+  sigset_t mask_set;
+  sigset_t old_set;
+  // Reset signal handler
+  signal(28, winch_handler);
+  // ignore this signal for a bit
+  sigfillset(&mask_set);
+  sigprocmask(SIG_SETMASK, &mask_set, &old_set);
+
+  need_resize = true;
+}
+
+/*
+ * SIGKILL signal handler
+ */
+void kill_handler(int sig)
+{
+  end_curses();
+  printf("Caught signal %d, cleaning up.\n", sig);
+  exit(0);
+}
+
+/*
+ * Start-up for curses environment
+ *
+ * NOTE: We used to render the whole table into a pad (a window that can be
+ *       bigger than the screen) and scroll by showing different parts of it.
+ *       That capped us at however many lines we were willing to allocate for
+ *       the pad, and meant formatting thousands of lines nobody would see.
+ *
+ *       Now we draw straight onto stdscr and only draw the rows that are
+ *       actually on the screen - scrolling just changes which part of the
+ *       sorted table we draw. See print_table().
+ */
+static WINDOW* start_curses(flags_t &flags)
+{
+  initscr();
+  cbreak();
+  noecho();
+  halfdelay(1);
+
+  /*
+   * If we're starting curses, we care about SIGWNCH, SIGINT, and SIGTERM
+   * so this seems like as good a place as any to setup our signal
+   * handler.
+   */
+  // Resize
+  signal(28, winch_handler);
+  // Shutdown
+  signal(2, kill_handler);
+  signal(15, kill_handler);
+
+  if (has_colors()) {
+    start_color();
+    // for tcp
+    init_pair(1, COLOR_GREEN, COLOR_BLACK);
+    // for udp
+    init_pair(2, COLOR_YELLOW, COLOR_BLACK);
+    // for icmp
+    init_pair(3, COLOR_RED, COLOR_BLACK);
+    // for prompts
+    init_pair(4, COLOR_BLACK, COLOR_RED);
+    // for the currently selected row
+    init_pair(5, COLOR_BLACK, COLOR_GREEN);
+    init_pair(6, COLOR_BLACK, COLOR_YELLOW);
+    init_pair(7, COLOR_BLACK, COLOR_RED);
+    // for states that are new since the last refresh (--changes)
+    init_pair(8, COLOR_CYAN, COLOR_BLACK);
+  } else {
+    flags.nocolor = true;
+  }
+
+  return stdscr;
+}
+
+/*
+ * Figure out the best way to get the screensize_t, and then do it
+ */
+screensize_t get_size(const bool &single)
+{
+  int maxx = 0, maxy = 0;
+  if (!single) {          
+    getmaxyx(stdscr, maxy, maxx);
+  } else {
+    maxx = 72;
+
+    struct winsize w;
+    // try all 3 std filehandles since people may have pipe in/out of us
+    for (int fd : {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO}) {
+      if (ioctl(fd, TIOCGWINSZ, &w) == 0 && w.ws_col > 0) {
+        maxx = w.ws_col;
+        break;
+      }
+    }
+
+    if (getenv("COLS"))
+      maxx = atoi(getenv("COLS"));
+  }
+
+  screensize_t a;
+  a.x = maxx;
+  a.y = maxy;
+
+  return a;
+}
+
+/*
+ * Error function for screen being too small.
+ */
+void term_too_small()
+{
+  end_curses();
+  cout << "I'm sorry, your terminal must be atleast 72 columns"
+       << "wide to run iptstate\n";
+  exit(3);
+}
+
+/*
+ * This is one of those "well, I should impliment it to be complete, but
+ * I doubt it'll get used very often features." Since we stopped using a pad
+ * there's nothing to tear down or build here anymore; noscroll simply pins
+ * the view to the first page of states and ignores navigation keys.
+ */
+void switch_scroll(flags_t &flags)
+{
+  flags.noscroll = !flags.noscroll;
+}
+
+/*
+ * Prompt the user for something, and get an answer.
+ */
+void get_input(WINDOW *win, string &input, const string &prompt,
+               const flags_t &flags)
+{
+
+  /*
+   * This function is here so that we can prompt and get an answer
+   * and the user can get an echo of what they're inputting. This is
+   * already a non-straight-forward thing to do in cbreak() mode, but
+   * it turns out that using pads makes it even more difficult.
+   *
+   * We do this in a one-line window of its own over the top line of
+   * the screen, which we throw away when we're done. The main loop redraws
+   * whatever was under it on the next pass.
+   *
+   * We leave curses' echo off and echo characters ourselves with
+   * wechochar() so that backspace behaves.
+   */
+  
+  input = "";
+  [[maybe_unused]] int x, y;
+  getmaxyx(stdscr, y, x);
+  WINDOW *cmd = newwin(1, x, 0, 0);
+  if (!flags.nocolor)
+    wattron(cmd, COLOR_PAIR(4));
+  keypad(cmd, true);
+  wprintw(cmd, "%s", prompt.c_str());
+  wclrtoeol(cmd);
+  wrefresh(cmd);
+
+
+  int ch;
+  int charcount = 0;
+  nodelay(cmd,0);
+
+  while (1) {
+    ch = wgetch(cmd);
+    switch (ch) {
+      case '\n':
+      // 7 is ^G
+      case 7:
+        if (ch == 7)
+          input = "";
+        if (!flags.nocolor)
+          wattroff(cmd, COLOR_PAIR(4));
+        delwin(cmd);
+        noecho();
+        touchwin(win);
+        wmove(win, 0, 0);
+        return;
+        break;
+      // on most platforms KEY_BACKSPACE will catch
+      // all backspaces...
+      case KEY_BACKSPACE:
+      // but on some platforms ncurses fails, so ensure we catch both 8 (0x8) and 127 (0x7e)
+      // which are the two valid backspace keycodes
+      case 8:
+      case 127:
+        if (charcount > 0) {
+          input = input.substr(0, input.size()-1);
+          wechochar(cmd, '\b');
+          wechochar(cmd, ' ');
+          wechochar(cmd, '\b');
+          charcount--;
+        }
+        break;
+      case ERR:
+        continue;
+        break;
+      default:
+        input += ch;
+        charcount++;
+        wechochar(cmd, ch);
+    }
+    wrefresh(cmd);
+  }
+}
+
+/*
+ * Create a window with noticable colors (if colors are enabled)
+ * and print a warning. Means curses_warning.
+ */
+void c_warn(WINDOW *win, const string &warning, const flags_t &flags)
+{
+
+  /*
+   * This function is here so that we can warn a user in curses,
+   * usually about bad input.
+   */
+  
+  [[maybe_unused]] int x, y;
+  getmaxyx(stdscr, y, x);
+  WINDOW *warn = newwin(1, x, 0, 0);
+  if (!flags.nocolor)
+    wattron(warn, COLOR_PAIR(4));
+  wprintw(warn, "%s", warning.c_str());
+  wprintw(warn, " Press any key to continue...");
+  wclrtoeol(warn);
+  wrefresh(warn);
+  while ((y = wgetch(warn))) {
+    if (y != ERR) {
+      break;
+    }
+  }
+  if (!flags.nocolor)
+    wattroff(warn, COLOR_PAIR(4));
+  delwin(warn);
+  noecho();
+  touchwin(win);
+  wmove(win, 0, 0);
+  return;
+}
+
+/*
+ * Initialize the max_t structure with some sane defaults. We'll grow
+ * them later as needed.
+ */
+// Whether there's a Mark column - groups don't have a mark
+bool show_mark(const flags_t &flags)
+{
+  return flags.mark && !flags.group;
+}
+
+// Whether there's a Netns column - like Mark, not for groups
+bool show_netns(const flags_t &flags)
+{
+  return netns.enabled && !flags.group;
+}
+
+void initialize_maxes(max_t &max, flags_t &flags)
+{
+  /*
+   * For NO lookup:
+   * src/dst IP can be no bigger than 21 chars:
+   *    IP (max of 15) + colon (1) + port (max of 5) = 21
+   *
+   * For lookup:
+   * if it's a name, we start with the width of the header, and we can
+   * grow from there as needed.
+   */
+  if (flags.lookup) {
+    max.src = 6;
+    max.dst = 11;
+  } else {
+    max.src = max.dst = 21;
+  }
+  /*
+   * The proto starts at 3, since tcp/udp are the most common, but will
+   * grow if we see bigger proto strings such as "ICMP".
+   */
+  max.proto = 3;
+  /*
+   * "ESTABLISHED" is generally the longest state, we almost always have
+   * several, so we'll start with this. It also looks really bad if state
+   * is changing size a lot, so we start with a common minumum.
+   */
+  max.state = 11;
+  // TTL we statically make 7: xxx:xx:xx
+  max.ttl = 9;
+
+  // Start with something sane, and room for "B/s" and "P/s" with rates
+  max.bytes = flags.rates ? 3 : 2;
+  max.packets = flags.rates ? 3 : 2;
+  // room for "Mark" and "Netns"
+  max.mark = 4;
+  max.netns = 5;
+}
+
+/*
+ * The actual work of handling a resize.
+ *
+ * We don't get the new size without the endwin/refresh, so this order
+ * must be preserved.
+ */
+void handle_resize(WINDOW *&win, const flags_t &flags, screensize_t &ssize)
+{
+  endwin();
+  refresh();
+  getmaxyx(stdscr, ssize.y, ssize.x);
+  wmove(win, 0, 0);
+}
+
+/*
+ * Take in a 'curr' value, and delete a given conntrack
+ */
+void delete_state(WINDOW *&win, const tentry_t *entry, const flags_t &flags)
+{
+  struct nfct_handle *cth;
+  struct nf_conntrack *ct;
+  /*
+   * With --netns, it has to go through a socket in the state's namespace.
+   * The table was read through the sockets we have now, but only from
+   * namespaces seen in the last scan - any other slot may have gone to a
+   * different namespace since (see netns_scan()).
+   */
+  if (netns.enabled)
+    cth = netns.spaces[entry->netns].gone ? NULL
+                                          : netns.spaces[entry->netns].cth;
+  else
+    cth = nfct_open(CONNTRACK, 0);
+  if (!cth) {
+    c_warn(win, "That state's network namespace has gone", flags);
+    return;
+  }
+  ct = nfct_new();
+  int ret;
+  string response;
+  char str[NAMELEN];
+  string src, dst;
+
+  // with --nat we may be showing the translated tuple, but we need the original
+  const bool swapped = entry->nat && entry->nat->swapped;
+  const in6_addr &osrc = swapped ? entry->nat->src : entry->src;
+  const in6_addr &odst = swapped ? entry->nat->dst : entry->dst;
+  unsigned long srcpt = swapped ? entry->nat->srcpt : entry->srcpt;
+  unsigned long dstpt = swapped ? entry->nat->dstpt : entry->dstpt;
+
+  src = inet_ntop(entry->family, (void *)&osrc, str, NAMELEN-1);
+  dst = inet_ntop(entry->family, (void *)&odst, str, NAMELEN-1);
+
+  ostringstream msg;
+  msg.str("");
+  msg << "Deleting state: ";
+  if (entry->proto == "tcp" || entry->proto == "udp") {
+    msg << src << ":" << srcpt << " -> " << dst << ":" << dstpt;
+  } else {
+    msg << src << " -> " << dst;
+  }
+  msg << " -- Are you sure? (y/n)";
+  get_input(win, response, msg.str(), flags);
+
+  if (response != "y" && response != "Y" && response != "yes" &&
+    response != "YES" && response != "Yes") {
+    c_warn(win, "NOT deleting state.", flags);
+    return;
+  }
+
+  nfct_set_attr_u8(ct, ATTR_ORIG_L3PROTO, entry->family);
+
+  if (entry->family == AF_INET) {
+    nfct_set_attr(ct, ATTR_ORIG_IPV4_SRC, (void *)&(osrc.s6_addr));
+    nfct_set_attr(ct, ATTR_ORIG_IPV4_DST, (void *)&(odst.s6_addr));
+  } else if (entry->family == AF_INET6) {
+    nfct_set_attr(ct, ATTR_ORIG_IPV6_SRC, (void *)&(osrc.s6_addr));
+    nfct_set_attr(ct, ATTR_ORIG_IPV6_DST, (void *)&(odst.s6_addr));
+  }
+
+  nfct_set_attr_u8(ct, ATTR_ORIG_L4PROTO, entry->l4proto);
+  // the same tuple can be in more than one zone
+  nfct_set_attr_u16(ct, ATTR_ZONE, entry->zone);
+
+  if (entry->proto == "tcp" || entry->proto == "udp") {
+    nfct_set_attr_u16(ct, ATTR_ORIG_PORT_SRC, htons(srcpt));
+    nfct_set_attr_u16(ct, ATTR_ORIG_PORT_DST, htons(dstpt));
+  } else if (entry->proto == "icmp" || entry->proto == "icmp6") {
+    nfct_set_attr_u8(ct, ATTR_ICMP_TYPE, entry->icmp_type);
+    nfct_set_attr_u8(ct, ATTR_ICMP_CODE, entry->icmp_code);
+    nfct_set_attr_u16(ct, ATTR_ICMP_ID, entry->icmp_id);
+  }
+
+  ret = nfct_query(cth, NFCT_Q_DESTROY, ct);
+  if (ret < 0) {
+    string msg = "Failed to delete state: ";
+    msg += strerror(errno);
+    c_warn(win, msg, flags);
+  }
+
+}
+
+
+/*
+ * CORE FUNCTIONS
+ */
+
+/*
+ * DATA SOURCES
+ *
+ * Everything downstream of build_table() works on tentry_t's, and doesn't
+ * care where they came from. Each source (see backends[]) reads states from
+ * somewhere, fills in the raw fields of a tentry_t for each one - the
+ * "normalized" entry, with ports in host byte order and IPv4 addresses in
+ * the first 4 bytes of src/dst - and hands it to process_entry(), which
+ * does the rest.
+ *
+ * Only netlink is a real, live, conntrack table. The others exist so that
+ * iptstate can be run, tested and benchmarked on a machine without root or
+ * without much of a state table.
+ */
+
+// Defined with the rest of the output code below
+void stream_entry(stream_t &stream, tentry_t *entry, const flags_t &flags);
+void talkers_add(talkers_t &talkers, const tentry_t *entry,
+                 const flags_t &flags);
+void write_bin_snap(outbuf_t &ob, uint32_t count, uint64_t time);
+void write_bin(outbuf_t &ob, const tentry_t *entry, uint8_t type);
+void bin_from_entry(const tentry_t *entry, uint8_t type, bin_entry_t &rec);
+// ... and with history
+void hist_entry(const tentry_t *entry);
+// ... and with the synthetic source
+uint64_t mix64(uint64_t x);
+// ... and with grouping
+uint64_t addr_hash(uint8_t family, const in6_addr &addr);
+// ... and with --churn
+void churn_panel(vector<string> &lines);
+// ... and with --netns
+int netns_find(const string &name);
+size_t fmt_netns(char *buf, uint16_t ns, uint16_t zone);
+void netns_dump(hook_data &hook);
+
+/*
+ * Get an entry for a source to fill in. When streaming, we don't keep
+ * entries, so we just reuse the same one for every state.
+ */
+tentry_t *new_entry(hook_data &data)
+{
+  if (data.stream)
+    return &data.stream->entry;
+  stats.allocs++;
+  return new tentry_t;
+}
+
+/*
+ * Given the reply tuple of 'entry', remember where it's translated to -
+ * but only if it is. Most states aren't NATed, and keeping both tuples for
+ * all of them would nearly double the size of a big table.
+ */
+void set_nat(tentry_t *entry, const in6_addr &rsrc, const in6_addr &rdst,
+             unsigned long rsrcpt, unsigned long rdstpt)
+{
+  if (!memcmp(&rsrc, &entry->dst, sizeof(rsrc))
+      && !memcmp(&rdst, &entry->src, sizeof(rdst))
+      && rsrcpt == entry->dstpt && rdstpt == entry->srcpt) {
+    entry->nat.reset();
+    return;
+  }
+  if (!entry->nat)
+    entry->nat.reset(new nat_t);
+  entry->nat->src = rdst;
+  entry->nat->dst = rsrc;
+  entry->nat->srcpt = rdstpt;
+  entry->nat->dstpt = rsrcpt;
+  entry->nat->swapped = false;
+}
+
+/*
+ * Swap the original and translated tuples of a NATed state, so that with
+ * --nat everything downstream (filters, sorting, grouping and display)
+ * sees the translated side without having to know about it.
+ */
+void nat_swap(tentry_t *entry)
+{
+  swap(entry->src, entry->nat->src);
+  swap(entry->dst, entry->nat->dst);
+  swap(entry->srcpt, entry->nat->srcpt);
+  swap(entry->dstpt, entry->nat->dstpt);
+  entry->nat->swapped = !entry->nat->swapped;
+}
+
+/*
+ * Build the strings we display from the raw fields of a normalized entry,
+ * and update the totals and field sizes to match.
+ */
+void describe_entry(tentry_t *entry, max_t &max, counters_t &counts,
+                    bool rates = false)
+{
+  char buf[64];
+  size_t len;
+
+  entry->proto = proto_name(entry->l4proto);
+  entry->ttl.assign(buf, fmt_ttl(buf, entry->timeout));
+  entry->state.clear();
+
+  // with rates, the counter columns show those instead
+  uint64_t bytes = rates ? entry->byte_rate : entry->bytes;
+  uint64_t packets = rates ? entry->packet_rate : entry->packets;
+  if (digits(bytes) > max.bytes) {
+    max.bytes = digits(bytes);
+  }
+  if (digits(packets) > max.packets) {
+    max.packets = digits(packets);
+  }
+
+  if (entry->proto.size() > max.proto)
+    max.proto = entry->proto.size();
+  if (digits(entry->mark) > max.mark)
+    max.mark = digits(entry->mark);
+  if (netns.enabled) {
+    len = fmt_netns(buf, entry->netns, entry->zone);
+    if (len > max.netns)
+      max.netns = len;
+  }
+
+  // OK, proto dependent stuff
+  if (entry->proto == "tcp") {
+    if (entry->tcpstate < sizeof(states) / sizeof(states[0]))
+      entry->state = states[entry->tcpstate];
+    counts.tcp++;
+  } else if (entry->proto == "udp") {
+    counts.udp++;
+  } else if (entry->proto == "icmp" || entry->proto == "icmp6") {
+    // type/code (id)
+    len = fmt_uint(buf, entry->icmp_type);
+    buf[len++] = '/';
+    len += fmt_uint(buf + len, entry->icmp_code);
+    buf[len++] = ' ';
+    buf[len++] = '(';
+    len += fmt_uint(buf + len, entry->icmp_id);
+    buf[len++] = ')';
+    entry->state.assign(buf, len);
+    counts.icmp++;
+    if (entry->state.size() > max.state)
+      max.state = entry->state.size();
+  } else {
+    counts.other++;
+  }
+}
+
+/*
+ * FILTERING
+ */
+
+/*
+ * Parse a mark filter: a value, and optionally a mask to apply to marks
+ * before comparing them (VAL/MASK). Both can be in hex with 0x.
+ */
+bool parse_mark(const char *arg, filters_t &filters)
+{
+  char *end;
+  errno = 0;
+  unsigned long val = strtoul(arg, &end, 0);
+  unsigned long mask = 0xffffffff;
+  if (end == arg || errno || val > 0xffffffff)
+    return false;
+  if (*end == '/') {
+    const char *p = end + 1;
+    mask = strtoul(p, &end, 0);
+    if (end == p || errno || mask > 0xffffffff)
+      return false;
+  }
+  if (*end != '\0')
+    return false;
+  filters.markmask = mask;
+  filters.mark = val & mask;
+  return true;
+}
+
+/*
+ * Parse a namespace filter: a namespace as for --netns, and optionally a
+ * zone in it (NAME/ZONE). The namespace has to be one we know of.
+ */
+bool parse_netns_filter(const string &arg, filters_t &filters)
+{
+  size_t slash = arg.find('/');
+  string name = arg.substr(0, slash);
+  if (name.empty())
+    return false;
+  filters.has_zone = slash != string::npos;
+  filters.zone = 0;
+  if (filters.has_zone) {
+    const char *p = arg.c_str() + slash + 1;
+    char *end;
+    unsigned long zone = strtoul(p, &end, 10);
+    if (end == p || *end != '\0' || zone > 0xffff)
+      return false;
+    filters.zone = zone;
+  }
+  int ns = netns_find(name);
+  if (ns < 0)
+    return false;
+  filters.netns = ns;
+  return true;
+}
+
+/*
+ * Returns whether 'entry' should be shown.
+ */
+bool filter_entry(const tentry_t *entry, const flags_t &flags,
+                  const filters_t &filters)
+{
+  static const uint8_t lb[4] = {127, 0, 0, 1};
+  static const in6_addr lb6 = IN6ADDR_LOOPBACK_INIT;
+  size_t entrysize = entry->family == AF_INET
+    ? sizeof(in_addr)
+    : sizeof(in6_addr);
+  if (flags.skiplb && (entry->family == AF_INET
+                        ? !memcmp(&(entry->src), &lb, sizeof(in_addr))
+                        : !memcmp(&(entry->src), &lb6, sizeof(in6_addr)))) {
+    return false;
+  }
+
+  if (flags.skipdns && (entry->dstpt == 53)) {
+    return false;
+  }
+
+  if (flags.filter_src && !filters.has_srcnet) {
+    if ((flags.filter_inv && !memcmp(&(entry->src), &(filters.src), entrysize)) || 
+        (!flags.filter_inv && memcmp(&(entry->src), &(filters.src), entrysize))) {
+      return false;
+    }
+  }
+
+  if (flags.filter_src && filters.has_srcnet) {
+    if ((flags.filter_inv && match_netmask(entry->family, entry->src, filters.src, filters.srcnet)) || 
+        (!flags.filter_inv && !match_netmask(entry->family, entry->src, filters.src, filters.srcnet))) {
+      return false;
+    }
+  }
+
+  if (flags.filter_srcpt) {
+    if ((flags.filter_inv && entry->srcpt == filters.srcpt) || 
+        (!flags.filter_inv && entry->srcpt != filters.srcpt)) {
+      return false;
+    }
+  }
+
+  if (flags.filter_dst && !filters.has_dstnet) {
+    if ((flags.filter_inv && !memcmp(&(entry->dst), &(filters.dst), entrysize)) || 
+        (!flags.filter_inv && memcmp(&(entry->dst), &(filters.dst), entrysize))) {
+      return false;
+    }
+  }
+
+  if (flags.filter_dst && filters.has_dstnet) {
+    if ((flags.filter_inv && match_netmask(entry->family, entry->dst, filters.dst, filters.dstnet)) || 
+        (!flags.filter_inv && !match_netmask(entry->family, entry->dst, filters.dst, filters.dstnet))) {
+      return false;
+    }
+  }
+
+  if (flags.filter_dstpt) {
+    if ((flags.filter_inv && entry->dstpt == filters.dstpt) || 
+        (!flags.filter_inv && entry->dstpt != filters.dstpt)) {
+      return false;
+    }
+  }
+
+  if (flags.filter_mark) {
+    if (((entry->mark & filters.markmask) == filters.mark)
+        == flags.filter_inv) {
+      return false;
+    }
+  }
+
+  if (flags.filter_netns) {
+    bool match = entry->netns == filters.netns
+      && (!filters.has_zone || entry->zone == filters.zone);
+    if (match == flags.filter_inv)
+      return false;
+  }
+
+  return true;
+}
+
+/*
+ * RATES
+ *
+ * With --rates, the B and P columns show bytes and packets per second
+ * since the last refresh rather than since the state was created. Each
+ * refresh, every state's counters are put in an open-addressing hash table
+ * keyed by a hash of its tuple, and looked up in the one from the refresh
+ * before. The two tables are swapped each time, so we never keep more than
+ * two snapshots' worth of counters around.
+ */
+
+// Hash everything that identifies a connection. 0 means an empty slot.
+uint64_t tuple_hash(const tentry_t *entry)
+{
+  // always the original tuple, even if we're showing the translated one
+  const bool swapped = entry->nat && entry->nat->swapped;
+  const in6_addr &src = swapped ? entry->nat->src : entry->src;
+  const in6_addr &dst = swapped ? entry->nat->dst : entry->dst;
+  uint64_t srcpt = swapped ? entry->nat->srcpt : entry->srcpt;
+  uint64_t dstpt = swapped ? entry->nat->dstpt : entry->dstpt;
+  uint64_t words[4];
+  memcpy(words, src.s6_addr, 16);
+  memcpy(words + 2, dst.s6_addr, 16);
+  uint64_t hash = mix64((uint64_t)entry->family << 56
+                        | (uint64_t)entry->l4proto << 48
+                        | (uint64_t)entry->zone << 32
+                        | srcpt << 16 | dstpt);
+  hash = mix64(hash ^ ((uint64_t)entry->netns << 32
+                       | (uint64_t)entry->icmp_type << 24
+                       | entry->icmp_code << 16 | entry->icmp_id));
+  for (int i = 0; i < 4; i++)
+    hash = mix64(hash ^ words[i]);
+  return hash ? hash : 1;
+}
+
+// Find 'key' in 'table', or the empty slot it would go in
+rate_slot_t &rate_find(vector<rate_slot_t> &table, uint64_t key)
+{
+  size_t mask = table.size() - 1;
+  size_t i = key & mask;
+  while (table[i].key && table[i].key != key)
+    i = (i + 1) & mask;
+  return table[i];
+}
+
+// What the two tables take up, for mem_t
+uint64_t rates_bytes(const rates_t &rates)
+{
+  return (rates.prev.capacity() + rates.next.capacity())
+    * sizeof(rate_slot_t);
+}
+
+/*
+ * Start a new snapshot taken at 'time': what was current becomes the
+ * previous snapshot, and we make a new table big enough for about as many
+ * states as last time.
+ */
+void rates_begin(rates_t &rates, uint64_t time)
+{
+  rates.prev.swap(rates.next);
+  rates.prev_count = rates.next_count;
+  rates.prev_time = rates.time;
+  rates.time = time;
+
+  size_t size = 64;
+  while (size < rates.prev_count * 2)
+    size <<= 1;
+  rates.next.assign(size, rate_slot_t());
+  rates.next_count = 0;
+  mem.rates = rates_bytes(rates);
+}
+
+// Double the size of the current table
+void rates_grow(rates_t &rates)
+{
+  vector<rate_slot_t> old(rates.next.size() * 2, rate_slot_t());
+  old.swap(rates.next);
+  for (const rate_slot_t &slot : old)
+    if (slot.key)
+      rate_find(rates.next, slot.key) = slot;
+  mem.rates = rates_bytes(rates);
+}
+
+/*
+ * Work out the rates for 'entry', and remember its counters for next
+ * time. A state we didn't see last time is assumed to have started since.
+ */
+void rate_entry(rates_t &rates, tentry_t *entry)
+{
+  entry->byte_rate = entry->packet_rate = 0;
+
+  if ((rates.next_count + 1) * 2 > rates.next.size())
+    rates_grow(rates);
+  uint64_t key = tuple_hash(entry);
+  rate_slot_t &slot = rate_find(rates.next, key);
+  if (!slot.key)
+    rates.next_count++;
+  slot.key = key;
+  slot.bytes = entry->bytes;
+  slot.packets = entry->packets;
+
+  if (!rates.prev_time || rates.time <= rates.prev_time)
+    return;
+  uint64_t bytes = entry->bytes, packets = entry->packets;
+  if (rates.prev_count) {
+    const rate_slot_t &prev = rate_find(rates.prev, key);
+    // if the counters went backwards, it's a new state with the same tuple
+    if (prev.key && prev.bytes <= bytes && prev.packets <= packets) {
+      bytes -= prev.bytes;
+      packets -= prev.packets;
+    }
+  }
+  double secs = (rates.time - rates.prev_time) / 1000000.0;
+  entry->byte_rate = bytes / secs + 0.5;
+  entry->packet_rate = packets / secs + 0.5;
+}
+
+/*
+ * CHANGES
+ *
+ * With --changes (or 'n'), each refresh is diffed against the one before
+ * it, so states that have opened since are highlighted, and ones that have
+ * closed stay on the screen, dimmed, for GHOST_REFRESHES refreshes. Like
+ * the rates tables, every state's tuple_hash() goes in an open-addressing
+ * set as it's read and is looked up in last refresh's, so the diff is a
+ * single pass over the table.
+ */
+
+// Find 'key' in 'set', or the empty slot it would go in
+uint64_t &change_find(vector<uint64_t> &set, uint64_t key)
+{
+  size_t mask = set.size() - 1;
+  size_t i = key & mask;
+  while (set[i] && set[i] != key)
+    i = (i + 1) & mask;
+  return set[i];
+}
+
+// What the two key sets take up, for mem_t
+uint64_t changes_bytes(const changes_t &changes)
+{
+  return (changes.prev.capacity() + changes.next.capacity())
+    * sizeof(uint64_t);
+}
+
+// Like rates_begin()
+void changes_begin(changes_t &changes, uint64_t time)
+{
+  changes.prev.swap(changes.next);
+  changes.prev_count = changes.next_count;
+  changes.prev_time = changes.time;
+  changes.time = time;
+
+  size_t size = 64;
+  while (size < changes.prev_count * 2)
+    size <<= 1;
+  changes.next.assign(size, 0);
+  changes.next_count = changes.kept = 0;
+  mem.changes = changes_bytes(changes);
+}
+
+void changes_grow(changes_t &changes)
+{
+  vector<uint64_t> old(changes.next.size() * 2, 0);
+  old.swap(changes.next);
+  for (uint64_t key : old)
+    if (key)
+      change_find(changes.next, key) = key;
+  mem.changes = changes_bytes(changes);
+}
+
+/*
+ * Remember we've seen 'entry', and mark it fresh if we didn't see it last
+ * time. The first time round there's nothing to compare with, so nothing is.
+ */
+void change_entry(changes_t &changes, tentry_t *entry)
+{
+  if ((changes.next_count + 1) * 2 > changes.next.size())
+    changes_grow(changes);
+  uint64_t key = tuple_hash(entry);
+  uint64_t &slot = change_find(changes.next, key);
+  if (slot)
+    return;
+  slot = key;
+  changes.next_count++;
+
+  if (!changes.prev_time)
+    return;
+  if (changes.prev_count && change_find(changes.prev, key))
+    changes.kept++;
+  else
+    entry->fresh = true;
+}
+
+/*
+ * Once all the states are in: how many opened and closed per second, and
+ * which of last refresh's rows in 'old' should stay as ghosts. Those are
+ * added to 'stable' and the rest deleted.
+ */
+void changes_finish(changes_t &changes, vector<tentry_t*> &old,
+                    vector<tentry_t*> &stable, counters_t &counts,
+                    max_t &max, const flags_t &flags,
+                    const filters_t &filters)
+{
+  counts.opened = counts.closed = counts.ghosts = 0;
+  if (changes.prev_time && changes.time > changes.prev_time) {
+    double secs = (changes.time - changes.prev_time) / 1000000.0;
+    counts.opened = (changes.next_count - changes.kept) / secs + 0.5;
+    counts.closed = (changes.prev_count - changes.kept) / secs + 0.5;
+  }
+
+  counters_t scratch;
+  for (tentry_t *entry : old) {
+    if (entry->ghost == 1 || change_find(changes.next, tuple_hash(entry))
+        || !filter_entry(entry, flags, filters)) {
+      delete entry;
+      continue;
+    }
+    entry->ghost = entry->ghost ? entry->ghost - 1 : GHOST_REFRESHES;
+    entry->fresh = false;
+    entry->byte_rate = entry->packet_rate = 0;
+    // the filters may have changed, and the column widths with them
+    describe_entry(entry, max, scratch, flags.rates);
+    stringify_entry(entry, max, flags);
+    stable.push_back(entry);
+    mem.table += entry_bytes(entry);
+    counts.ghosts++;
+  }
+  old.clear();
+  mem.slots = stable.capacity() * sizeof(tentry_t*);
+}
+
+/*
+ * SYN FLOOD DETECTION
+ *
+ * With --syn-alert, half-open TCP states (SYN_SENT and SYN_RECV) are
+ * counted per destination as they come in, in an open-addressing table
+ * like the ones for rates, and last refresh's counts are kept to see how
+ * fast each one is growing. Checking the thresholds only looks at the
+ * destinations that have half-open states, never at the table again, so
+ * it keeps up however big the flood gets.
+ */
+
+// Find 'dst' in 'table', or the empty slot it would go in
+syn_slot_t &syn_find(vector<syn_slot_t> &table, uint8_t family,
+                     const in6_addr &dst)
+{
+  size_t mask = table.size() - 1;
+  size_t i = addr_hash(family, dst) & mask;
+  while (table[i].count
+         && (table[i].family != family
+             || memcmp(&table[i].dst, &dst, sizeof(dst))))
+    i = (i + 1) & mask;
+  return table[i];
+}
+
+// Like rates_begin()
+void syn_begin(uint64_t time)
+{
+  synflood.prev.swap(synflood.next);
+  synflood.prev_count = synflood.next_count;
+  synflood.prev_time = synflood.time;
+  synflood.time = time;
+
+  size_t size = 64;
+  while (size < synflood.prev_count * 2)
+    size <<= 1;
+  synflood.next.assign(size, syn_slot_t());
+  synflood.next_count = 0;
+}
+
+void syn_grow()
+{
+  vector<syn_slot_t> old(synflood.next.size() * 2, syn_slot_t());
+  old.swap(synflood.next);
+  for (const syn_slot_t &slot : old)
+    if (slot.count)
+      syn_find(synflood.next, slot.family, slot.dst) = slot;
+}
+
+// Count 'entry' if it's half-open, see process_entry()
+void syn_entry(const tentry_t *entry)
+{
+  if (entry->l4proto != IPPROTO_TCP
+      || (entry->tcpstate != STATE_SYN_SENT
+          && entry->tcpstate != STATE_SYN_RECV))
+    return;
+
+  if ((synflood.next_count + 1) * 2 > synflood.next.size())
+    syn_grow();
+  syn_slot_t &slot = syn_find(synflood.next, entry->family, entry->dst);
+  if (!slot.count) {
+    slot.family = entry->family;
+    slot.dst = entry->dst;
+    synflood.next_count++;
+  }
+  slot.count++;
+}
+
+/*
+ * Say that a destination has started (or stopped) being flooded: a line on
+ * stderr when there's no screen to show it on, and --alert-cmd if given.
+ */
+void syn_alert(const syn_slot_t &slot, bool start, const flags_t &flags)
+{
+  char addr[NAMELEN], count[24], growth[24];
+  addr[fmt_ip(addr, slot.family, slot.dst)] = '\0';
+  snprintf(count, sizeof(count), "%u", slot.count);
+  snprintf(growth, sizeof(growth), "%" PRId64, slot.growth);
+
+  if (flags.single) {
+    char when[32];
+    time_t now = time(NULL);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    if (start)
+      fprintf(stderr, "%s SYN flood: %s has %s half-open states (%+"
+              PRId64 "/s)\n", when, addr, count, slot.growth);
+    else
+      fprintf(stderr, "%s SYN flood over: %s has %s half-open states\n",
+              when, addr, count);
+  }
+
+  if (synflood.command.empty())
+    return;
+
+  /*
+   * The child can only do async-signal-safe things before exec - with
+   * --netns's threads about, another thread may hold the malloc lock - so
+   * its environment is put together here.
+   */
+  vector<string> vars;
+  vars.push_back(string("IPTSTATE_EVENT=") + (start ? "flood" : "over"));
+  vars.push_back(string("IPTSTATE_DST=") + addr);
+  vars.push_back(string("IPTSTATE_HALFOPEN=") + count);
+  vars.push_back(string("IPTSTATE_GROWTH=") + growth);
+  vector<char*> env;
+  for (char **var = environ; *var; var++)
+    if (strncmp(*var, "IPTSTATE_", 9))
+      env.push_back(*var);
+  for (string &var : vars)
+    env.push_back(&var[0]);
+  env.push_back(NULL);
+  int null = flags.single ? -1 : open("/dev/null", O_RDWR | O_CLOEXEC);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    synflood.error = string("couldn't run --alert-cmd: ") + strerror(errno);
+    if (flags.single)
+      fprintf(stderr, "SYN flood: %s\n", synflood.error.c_str());
+  } else if (pid == 0) {
+    // don't draw over the screen
+    if (null >= 0) {
+      dup2(null, STDIN_FILENO);
+      dup2(null, STDOUT_FILENO);
+      dup2(null, STDERR_FILENO);
+    }
+    execle("/bin/sh", "sh", "-c", synflood.command.c_str(), (char *)NULL,
+           &env[0]);
+    _exit(127);
+  } else {
+    synflood.error.clear();
+  }
+  if (null >= 0)
+    close(null);
+}
+
+/*
+ * At the end of a refresh, work out how fast each destination is growing,
+ * which are over the thresholds, and alert on any that changed.
+ */
+void syn_finish(const flags_t &flags)
+{
+  // reap any --alert-cmd that's finished
+  while (waitpid(-1, NULL, WNOHANG) > 0)
+    ;
+
+  double secs = 0;
+  if (synflood.prev_time && synflood.time > synflood.prev_time)
+    secs = (synflood.time - synflood.prev_time) / 1000000.0;
+
+  synflood.alerts.clear();
+  for (syn_slot_t &slot : synflood.next) {
+    if (!slot.count)
+      continue;
+    const syn_slot_t *prev = NULL;
+    if (synflood.prev_count) {
+      prev = &syn_find(synflood.prev, slot.family, slot.dst);
+      if (!prev->count)
+        prev = NULL;
+    }
+    slot.growth = 0;
+    if (secs)
+      slot.growth = ((int64_t)slot.count - (prev ? prev->count : 0)) / secs;
+    slot.flagged = (synflood.threshold && slot.count >= synflood.threshold)
+      || (synflood.growth && slot.growth >= synflood.growth);
+    if (!slot.flagged)
+      continue;
+    synflood.alerts.push_back(slot);
+    if (!prev || !prev->flagged)
+      syn_alert(slot, true, flags);
+  }
+
+  // ... and the ones that have calmed down
+  for (const syn_slot_t &prev : synflood.prev) {
+    if (!prev.count || !prev.flagged)
+      continue;
+    const syn_slot_t &slot = syn_find(synflood.next, prev.family, prev.dst);
+    if (slot.count && slot.flagged)
+      continue;
+    syn_slot_t over = prev;
+    over.count = slot.count;
+    over.growth = slot.growth;
+    syn_alert(over, false, flags);
+  }
+
+  sort(synflood.alerts.begin(), synflood.alerts.end(),
+       [](const syn_slot_t &a, const syn_slot_t &b) {
+         return a.count > b.count;
+       });
+}
+
+// How many lines the alert panel takes, see print_headers()
+unsigned int syn_panel_lines()
+{
+  unsigned int error = synflood.error.empty() ? 0 : 1;
+  if (synflood.alerts.size() > SYN_PANEL_LINES)
+    return SYN_PANEL_LINES + 1 + error;
+  return synflood.alerts.size() + error;
+}
+
+/*
+ * MEMORY BUDGET
+ */
+
+// Heap order for top-K retention, with the fewest bytes on top
+bool fewer_bytes(const tentry_t *one, const tentry_t *two)
+{
+  return one->bytes > two->bytes;
+}
+
+/*
+ * Add 'entry' to the table if it fits in --max-memory, degrading as
+ * described in mem_t if it doesn't. Returns whether we took ownership of
+ * 'entry' - it may have been dropped since.
+ */
+bool retain_entry(vector<tentry_t*> &stable, tentry_t *entry,
+                  const flags_t &flags, counters_t &counts)
+{
+  uint64_t size = entry_bytes(entry);
+  mem.candidates++;
+
+  if (mem.level < MEM_TOPK) {
+    // the next push_back() may have to grow the array
+    uint64_t grow = 0;
+    if (stable.size() == stable.capacity())
+      grow = max(stable.capacity(), (size_t)8) * 2 * sizeof(tentry_t*);
+    if (mem_used() + size + grow > mem.budget && mem.caches) {
+      names_clear();
+      mem.level = MEM_NOCACHE;
+    }
+    if (mem_used() + size + grow <= mem.budget) {
+      stable.push_back(entry);
+      mem.table += size;
+      mem.slots = stable.capacity() * sizeof(tentry_t*);
+      return true;
+    }
+    // The table can't grow any more, from now on we replace entries
+    mem.level = flags.counters ? MEM_TOPK : MEM_SAMPLE;
+    if (mem.level == MEM_TOPK)
+      make_heap(stable.begin(), stable.end(), fewer_bytes);
+  }
+
+  counts.dropped++;
+  tentry_t *victim;
+  if (mem.level == MEM_TOPK) {
+    if (stable.empty() || entry->bytes <= stable.front()->bytes)
+      return false;
+    pop_heap(stable.begin(), stable.end(), fewer_bytes);
+    victim = stable.back();
+    stable.back() = entry;
+    push_heap(stable.begin(), stable.end(), fewer_bytes);
+  } else {
+    // reservoir sampling: every state so far is equally likely to be kept
+    uint64_t slot = random() % mem.candidates;
+    if (slot >= stable.size())
+      return false;
+    victim = stable[slot];
+    stable[slot] = entry;
+  }
+  mem.table += size;
+  mem.table -= entry_bytes(victim);
+  delete victim;
+
+  // 'entry' may have been bigger than what it replaced
+  while (mem_used() > mem.budget && !stable.empty()) {
+    if (mem.level == MEM_TOPK)
+      pop_heap(stable.begin(), stable.end(), fewer_bytes);
+    mem.table -= entry_bytes(stable.back());
+    delete stable.back();
+    stable.pop_back();
+    counts.dropped++;
+  }
+  return true;
+}
+
+/*
+ * Take a normalized entry from one of the sources, build the strings we
+ * display, apply filters, and add it to the table - or if we're streaming,
+ * write it out. Takes ownership of 'entry'.
+ */
+void process_entry(hook_data &data, tentry_t *entry)
+{
+  unique_ptr<tentry_t> owned(data.stream ? NULL : entry);
+  uint64_t start = stats.detail ? now_usec() : 0;
+  stats.seen++;
+
+  // Recording is before filtering, so a replay can use different filters
+  if (data.record)
+    write_bin(*data.record, entry, BIN_ENTRY);
+
+  // Rates are before filtering too, so changing filters doesn't lose them
+  if (data.rates)
+    rate_entry(*data.rates, entry);
+  entry->fresh = false;
+  entry->ghost = 0;
+  if (data.changes)
+    change_entry(*data.changes, entry);
+  if (synflood.enabled && !data.past)
+    syn_entry(entry);
+  if (history.budget && !data.past)
+    hist_entry(entry);
+  if (data.hidden) {
+    if (stats.detail)
+      stats_time(PHASE_PROCESS, start);
+    return;
+  }
+
+  // ... and from here on, with --nat, we want the translated side
+  if (data.flags->nat && entry->nat)
+    nat_swap(entry);
+
+  describe_entry(entry, *data.max, *data.counts, data.flags->rates);
+
+  if (!filter_entry(entry, *data.flags, *data.filters)) {
+    data.counts->skipped++;
+    stats.filtered++;
+    if (stats.detail)
+      stats_time(PHASE_PROCESS, start);
+    return;
+  }
+  // Top talkers don't need names, so there's nothing more to do
+  if (data.stream && data.stream->talkers) {
+    talkers_add(*data.stream->talkers, entry, *data.flags);
+    if (stats.detail)
+      stats_time(PHASE_PROCESS, start);
+    return;
+  }
+  if (stats.detail)
+    stats_time(PHASE_PROCESS, start);
+
+  /*
+   * RESOLVE
+   */
+
+  // Resolve names - if necessary - or generate strings of address,
+  // and calculate max sizes
+  stringify_entry(entry, *data.max, *data.flags);
+  if (stats.detail)
+    stats_time(PHASE_RESOLVE, start);
+
+  /*
+   * Add this to the array, or if we're streaming, write it out now
+   */
+  if (data.stream) {
+    stream_entry(*data.stream, entry, *data.flags);
+  } else if (mem.budget) {
+    if (retain_entry(*data.stable, entry, *data.flags, *data.counts))
+      owned.release();
+  } else {
+    // no budget to keep to, but --stats still wants to know the size
+    mem.table += entry_bytes(entry);
+    data.stable->push_back(owned.release());
+    mem.slots = data.stable->capacity() * sizeof(tentry_t*);
+  }
+}
+
+/*
+ * NETLINK
+ *
+ * The live conntrack table, through libnetfilter_conntrack.
+ */
+
+/*
+ * Fill in a normalized entry from a conntrack object
+ */
+void entry_from_ct(struct nf_conntrack *ct, tentry_t *entry)
+{
+  /*
+   * First, we read stuff into the array that's always the
+   * same regardless of protocol
+   */
+  entry->family = nfct_get_attr_u8(ct, ATTR_ORIG_L3PROTO);
+  entry->l4proto = nfct_get_attr_u8(ct, ATTR_ORIG_L4PROTO);
+  entry->timeout = nfct_get_attr_u32(ct, ATTR_TIMEOUT);
+  entry->mark = nfct_get_attr_u32(ct, ATTR_MARK);
+  entry->zone = nfct_get_attr_u16(ct, ATTR_ZONE);
+  entry->netns = 0;
+  entry->srcpt = entry->dstpt = 0;
+  entry->tcpstate = entry->icmp_type = entry->icmp_code = 0;
+  entry->icmp_id = 0;
+
+  // Everything has addresses
+  memset(&entry->src, 0, sizeof(entry->src));
+  memset(&entry->dst, 0, sizeof(entry->dst));
+  if (entry->family == AF_INET) {
+    memcpy(entry->src.s6_addr, nfct_get_attr(ct, ATTR_ORIG_IPV4_SRC),
+           sizeof(in_addr));
+    memcpy(entry->dst.s6_addr, nfct_get_attr(ct, ATTR_ORIG_IPV4_DST),
+           sizeof(in_addr));
+  } else if (entry->family == AF_INET6) {
+    memcpy(entry->src.s6_addr, nfct_get_attr(ct, ATTR_ORIG_IPV6_SRC),
+           sizeof(in6_addr));
+    memcpy(entry->dst.s6_addr, nfct_get_attr(ct, ATTR_ORIG_IPV6_DST),
+           sizeof(in6_addr));
+  } else {
+    fprintf(stderr, "UNKNOWN FAMILY!\n");
+    exit(1);
+  }
+
+  // Counters (summary, in + out). These are 64-bit in the kernel.
+  entry->bytes = nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_BYTES) +
+          nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_BYTES);
+  entry->packets = nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_PACKETS) +
+          nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_PACKETS);
+
+  // OK, proto dependent stuff
+  switch (entry->l4proto) {
+    case IPPROTO_TCP:
+      entry->tcpstate = nfct_get_attr_u8(ct, ATTR_TCP_STATE);
+      // fall through
+    case IPPROTO_UDP:
+      entry->srcpt = htons(nfct_get_attr_u16(ct, ATTR_ORIG_PORT_SRC));
+      entry->dstpt = htons(nfct_get_attr_u16(ct, ATTR_ORIG_PORT_DST));
+      break;
+    case IPPROTO_ICMP:
+    case IPPROTO_ICMPV6:
+      entry->icmp_type = nfct_get_attr_u8(ct, ATTR_ICMP_TYPE);
+      entry->icmp_code = nfct_get_attr_u8(ct, ATTR_ICMP_CODE);
+      entry->icmp_id = nfct_get_attr_u16(ct, ATTR_ICMP_ID);
+      break;
+  }
+
+  // The reply tuple, which is just the original backwards unless it's NATed
+  in6_addr rsrc, rdst;
+  unsigned long rsrcpt = 0, rdstpt = 0;
+  memset(&rsrc, 0, sizeof(rsrc));
+  memset(&rdst, 0, sizeof(rdst));
+  if (entry->family == AF_INET) {
+    memcpy(rsrc.s6_addr, nfct_get_attr(ct, ATTR_REPL_IPV4_SRC),
+           sizeof(in_addr));
+    memcpy(rdst.s6_addr, nfct_get_attr(ct, ATTR_REPL_IPV4_DST),
+           sizeof(in_addr));
+  } else {
+    memcpy(rsrc.s6_addr, nfct_get_attr(ct, ATTR_REPL_IPV6_SRC),
+           sizeof(in6_addr));
+    memcpy(rdst.s6_addr, nfct_get_attr(ct, ATTR_REPL_IPV6_DST),
+           sizeof(in6_addr));
+  }
+  if (entry->l4proto == IPPROTO_TCP || entry->l4proto == IPPROTO_UDP) {
+    rsrcpt = htons(nfct_get_attr_u16(ct, ATTR_REPL_PORT_SRC));
+    rdstpt = htons(nfct_get_attr_u16(ct, ATTR_REPL_PORT_DST));
+  }
+  set_nat(entry, rsrc, rdst, rsrcpt, rdstpt);
+}
+
+/*
+ * Callback for conntrack
+ */
+int conntrack_hook(enum nf_conntrack_msg_type nf_type, struct nf_conntrack *ct,
+                   void *tmp)
+{
+  /*
+   * start by getting our struct back
+   */
+  hook_data *data = static_cast<hook_data *>(tmp);
+  tentry_t *entry = new_entry(*data);
+
+  entry_from_ct(ct, entry);
+  process_entry(*data, entry);
+  return NFCT_CB_CONTINUE;
+}
+
+// Ask for the whole table on 'cth', whose callback does the rest
+int netlink_query(struct nfct_handle *cth, const hook_data &hook)
+{
+  int res;
+  u_int8_t family = AF_UNSPEC;
+
+  /*
+   * Have the kernel filter by mark, so on a big table the states we don't
+   * want never cross netlink. It can't invert the filter, so then we do it
+   * all in filter_entry() as usual - as we still do otherwise, for kernels
+   * that don't know how to filter.
+   */
+  if (hook.flags->filter_mark && !hook.flags->filter_inv) {
+    struct nfct_filter_dump *filter = nfct_filter_dump_create();
+    struct nfct_filter_dump_mark mark;
+    mark.val = hook.filters->mark;
+    mark.mask = hook.filters->markmask;
+    nfct_filter_dump_set_attr(filter, NFCT_FILTER_DUMP_MARK, &mark);
+    res = nfct_query(cth, NFCT_Q_DUMP_FILTER, filter);
+    nfct_filter_dump_destroy(filter);
+  } else {
+    res = nfct_query(cth, NFCT_Q_DUMP, &family);
+  }
+  return res;
+}
+
+void netlink_dump(source_t &source, hook_data &hook)
+{
+  int res=0;
+  static struct nfct_handle *cth;
+
+  if (netns.enabled) {
+    netns_dump(hook);
+    return;
+  }
+
+  cth = nfct_open(CONNTRACK, 0);
+  if (!cth) {
+    end_curses();
+    printf("ERROR: couldn't establish conntrack connection\n");
+    exit(2);
+  }
+  nfct_callback_register(cth, NFCT_T_ALL, conntrack_hook, (void *)&hook);
+  res = netlink_query(cth, hook);
+  if (res < 0) {
+    end_curses();
+    printf("ERROR: Couldn't retreive conntrack table: %s\n", strerror(errno));
+    exit(2);
+  }
+  nfct_close(cth);
+}
+
+/*
+ * NETWORK NAMESPACES
+ *
+ * With --netns, we dump the conntrack tables of several network namespaces
+ * at once. A netlink socket stays in the namespace it was opened in, so we
+ * open one in each namespace (setns() in and straight back out) and keep
+ * it. Each refresh, every socket gets a collector thread that dumps its
+ * table and turns the states into entries, in batches, while this thread
+ * takes the batches as they come and does everything else with them as
+ * usual - so nothing past conntrack_hook() has to know about threads.
+ */
+
+// The index of namespace 'name' in netns.spaces, or -1 if we don't know it
+int netns_find(const string &name)
+{
+  auto it = netns.index.find(name);
+  return it == netns.index.end() ? -1 : it->second;
+}
+
+/*
+ * Add namespace 'name' to netns.spaces, in the slot of one that's gone if
+ * there is one, and return its index - or -1 if all NETNS_MAX are taken.
+ * A namespace keeps its index for as long as it's around (and for a few
+ * refreshes after, see netns_scan()), so states and filters just keep that.
+ */
+int netns_add(const string &name)
+{
+  size_t i;
+  if (!netns.free.empty()) {
+    i = netns.free.back();
+    netns.free.pop_back();
+  } else if (netns.spaces.size() < NETNS_MAX) {
+    i = netns.spaces.size();
+    netns.spaces.emplace_back();
+  } else {
+    return -1;
+  }
+  netns_space_t &space = netns.spaces[i];
+  space.name = name;
+  space.cth = NULL;
+  space.seen = false;
+  space.gone = 0;
+  space.last = 0;
+  netns.index[name] = i;
+  return i;
+}
+
+/*
+ * Open a conntrack socket in the namespace 'space' - "." is the one we're
+ * running in, anything else is under NETNS_DIR. Sets errno on failure.
+ */
+bool netns_open(netns_space_t &space)
+{
+  if (space.name == ".") {
+    space.cth = nfct_open(CONNTRACK, 0);
+    return space.cth != NULL;
+  }
+
+  string path = string(NETNS_DIR) + "/" + space.name;
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  if (setns(fd, CLONE_NEWNET) < 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return false;
+  }
+  close(fd);
+  space.cth = nfct_open(CONNTRACK, 0);
+  int err = errno;
+  // we were just there, so this can't really fail - but if it does, we
+  // can't carry on in the wrong namespace
+  if (setns(netns.self, CLONE_NEWNET) < 0) {
+    end_curses();
+    printf("ERROR: couldn't return to our network namespace: %s\n",
+           strerror(errno));
+    exit(2);
+  }
+  errno = err;
+  return space.cth != NULL;
+}
+
+/*
+ * Set up --netns: 'arg' is "all", or a comma-separated list of names under
+ * NETNS_DIR, and "." for the namespace we're running in. Exits if any of
+ * them can't be opened.
+ */
+void netns_setup(const string &arg)
+{
+  netns.enabled = true;
+  netns.self = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+  if (netns.self < 0) {
+    cerr << "Couldn't open our network namespace: " << strerror(errno)
+         << endl;
+    exit(2);
+  }
+
+  vector<string> names;
+  if (arg == "all") {
+    // the rest are found each refresh, see netns_scan()
+    netns.all = true;
+    names.push_back(".");
+  } else {
+    // not splita(), there can be more than MAXFIELDS of them
+    size_t start = 0, comma;
+    do {
+      comma = arg.find(',', start);
+      names.push_back(arg.substr(start, comma - start));
+      start = comma + 1;
+    } while (comma != string::npos);
+  }
+  for (const string &name : names) {
+    if (name.empty() || name == ".." || name.find('/') != string::npos) {
+      cerr << "Invalid network namespace: " << name << endl;
+      exit(1);
+    }
+    int ns = netns_find(name);
+    if (ns < 0)
+      ns = netns_add(name);
+    if (ns < 0) {
+      cerr << "Too many network namespaces, at most " << NETNS_MAX
+           << " can be watched" << endl;
+      exit(1);
+    }
+    netns_space_t &space = netns.spaces[ns];
+    if (space.cth)
+      continue;
+    if (!netns_open(space)) {
+      cerr << "Couldn't open conntrack in network namespace " << name
+           << ": " << strerror(errno) << endl;
+      exit(2);
+    }
+  }
+}
+
+/*
+ * For --netns all: open sockets in namespaces that have appeared under
+ * NETNS_DIR since last time, and close the ones in namespaces that have
+ * gone (our socket would otherwise keep them alive). Once one has been gone
+ * for NETNS_KEEP refreshes, nothing on the screen refers to it any more, so
+ * its slot can go to a new one - unless we're filtering on it, or --history
+ * still has a snapshot from before it went.
+ */
+void netns_scan(const flags_t &flags, const filters_t &filters)
+{
+  for (netns_space_t &space : netns.spaces)
+    space.seen = false;
+  netns.spaces[0].seen = true;
+
+  DIR *dir = opendir(NETNS_DIR);
+  // no directory just means no named namespaces
+  if (dir) {
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+      if (ent->d_name[0] == '.')
+        continue;
+      int ns = netns_find(ent->d_name);
+      if (ns < 0)
+        ns = netns_add(ent->d_name);
+      // no room for it until one that's gone frees up its slot
+      if (ns < 0)
+        continue;
+      netns_space_t &space = netns.spaces[ns];
+      space.seen = true;
+      // if we can't get in (yet), we'll try again next time
+      if (!space.cth)
+        netns_open(space);
+    }
+    closedir(dir);
+  }
+
+  uint64_t now = now_usec(CLOCK_REALTIME);
+  // the oldest snapshot --history can still go back to
+  uint64_t oldest = history.deltas.empty() ? history.latest_time
+                                           : history.deltas.back().time;
+  for (size_t i = 0; i < netns.spaces.size(); i++) {
+    netns_space_t &space = netns.spaces[i];
+    if (space.seen) {
+      space.gone = 0;
+      space.last = now;
+      continue;
+    }
+    if (space.cth) {
+      nfct_close(space.cth);
+      space.cth = NULL;
+    }
+    // already free, or still wanted
+    if (space.gone > NETNS_KEEP
+        || (flags.filter_netns && filters.netns == i))
+      continue;
+    if (space.gone < NETNS_KEEP)
+      space.gone++;
+    if (space.gone == NETNS_KEEP
+        && (!history.budget || !oldest || oldest > space.last)) {
+      netns.index.erase(space.name);
+      netns.free.push_back(i);
+      space.gone++;
+    }
+  }
+}
+
+/*
+ * Write the Netns column for a state: the namespace, and the zone if it
+ * isn't the default. Long names are cut short to fit in NETNS_WIDTH.
+ */
+size_t fmt_netns(char *buf, uint16_t ns, uint16_t zone)
+{
+  char tail[8];
+  size_t tlen = 0;
+  if (zone) {
+    tail[0] = '/';
+    tlen = 1 + fmt_uint(tail + 1, zone);
+  }
+  const string &name = netns.spaces[ns].name;
+  size_t len = min(name.size(), (size_t)NETNS_WIDTH - tlen);
+  memcpy(buf, name.data(), len);
+  memcpy(buf + len, tail, tlen);
+  return len + tlen;
+}
+
+/*
+ * Hand a batch of entries over to netns_dump(), waiting if it's too far
+ * behind. Leaves 'batch' empty.
+ */
+void netns_push(vector<tentry_t*> &batch)
+{
+  unique_lock<mutex> lock(netns.lock);
+  netns.room.wait(lock, [] { return netns.batches.size() < NETNS_QUEUE; });
+  netns.batches.emplace_back();
+  netns.batches.back().swap(batch);
+  netns.ready.notify_one();
+}
+
+// A collector's own state, see netns_collect()
+struct collector_t {
+  uint16_t netns;
+  struct nfct_handle *cth;
+  hook_data *hook;
+  vector<tentry_t*> batch;
+  // errno if the dump failed
+  int err;
+};
+
+/*
+ * Callback for conntrack in a collector thread. Only fills in the entry:
+ * everything else is up to netns_dump(), in the main thread.
+ */
+int netns_hook(enum nf_conntrack_msg_type nf_type, struct nf_conntrack *ct,
+               void *tmp)
+{
+  collector_t *collector = static_cast<collector_t *>(tmp);
+  tentry_t *entry = new tentry_t;
+  entry_from_ct(ct, entry);
+  entry->netns = collector->netns;
+  collector->batch.push_back(entry);
+  if (collector->batch.size() >= NETNS_BATCH)
+    netns_push(collector->batch);
+  return NFCT_CB_CONTINUE;
+}
+
+// The body of a collector thread
+void netns_collect(collector_t *collector)
+{
+  nfct_callback_register(collector->cth, NFCT_T_ALL, netns_hook, collector);
+  if (netlink_query(collector->cth, *collector->hook) < 0)
+    collector->err = errno;
+  if (!collector->batch.empty())
+    netns_push(collector->batch);
+
+  lock_guard<mutex> lock(netns.lock);
+  netns.running--;
+  netns.ready.notify_one();
+}
+
+/*
+ * The netlink source with --netns: dump every namespace in parallel, and
+ * process the states as they come in.
+ */
+void netns_dump(hook_data &hook)
+{
+  if (netns.all)
+    netns_scan(*hook.flags, *hook.filters);
+
+  // a filter on one namespace means we needn't even dump the others
+  int only = -1;
+  if (hook.flags->filter_netns && !hook.flags->filter_inv)
+    only = hook.filters->netns;
+
+  vector<collector_t> collectors;
+  for (size_t i = 0; i < netns.spaces.size(); i++) {
+    if (!netns.spaces[i].cth || (only >= 0 && (int)i != only))
+      continue;
+    collectors.emplace_back();
+    collector_t &collector = collectors.back();
+    collector.netns = i;
+    collector.cth = netns.spaces[i].cth;
+    collector.hook = &hook;
+    collector.err = 0;
+    collector.batch.reserve(NETNS_BATCH);
+  }
+
+  netns.running = collectors.size();
+  vector<thread> threads;
+  for (collector_t &collector : collectors)
+    threads.emplace_back(netns_collect, &collector);
+
+  unique_lock<mutex> lock(netns.lock);
+  while (true) {
+    netns.ready.wait(lock, [] {
+      return !netns.batches.empty() || !netns.running;
+    });
+    if (netns.batches.empty())
+      break;
+    vector<tentry_t*> batch;
+    batch.swap(netns.batches.front());
+    netns.batches.pop_front();
+    netns.room.notify_all();
+    lock.unlock();
+
+    stats.allocs += batch.size();
+    for (tentry_t *entry : batch) {
+      process_entry(hook, entry);
+      // when streaming, process_entry() doesn't take the entry
+      if (hook.stream)
+        delete entry;
+    }
+    lock.lock();
+  }
+  lock.unlock();
+  for (thread &t : threads)
+    t.join();
+
+  for (const collector_t &collector : collectors) {
+    if (collector.err) {
+      end_curses();
+      printf("ERROR: Couldn't retreive conntrack table of %s: %s\n",
+             netns.spaces[collector.netns].name.c_str(),
+             strerror(collector.err));
+      exit(2);
+    }
+  }
+}
+
+/*
+ * PROCFS
+ *
+ * The text version of the table the kernel gives us in
+ * /proc/net/nf_conntrack (or a copy of it somewhere else). One state per
+ * line, like:
+ *
+ *   ipv4 2 tcp 6 431999 ESTABLISHED src=10.0.0.1 dst=10.0.0.2 sport=22
+ *     dport=5000 packets=10 bytes=1000 src=10.0.0.2 dst=10.0.0.1 sport=5000
+ *     dport=22 packets=5 bytes=500 [ASSURED] mark=0 zone=0 use=2
+ *
+ * The first set of tuples is the original direction, the second the reply.
+ */
+
+/*
+ * The parser works in place on big read() buffers: no iostreams, no
+ * copying lines out and no NUL-terminating tokens, just a pointer walking
+ * each line and converting fields straight into the entry as it goes.
+ */
+
+// Parse the decimal number at 'p', stopping at 'end' or the first non-digit
+static inline const char *scan_uint(const char *p, const char *end,
+                                    uint64_t &val)
+{
+  val = 0;
+  while (p < end && (unsigned char)(*p - '0') < 10)
+    val = val * 10 + (*p++ - '0');
+  return p;
+}
+
+// Parse the address in [p, end), which isn't NUL-terminated
+bool scan_ip(const char *p, const char *end, uint8_t family, in6_addr *addr)
+{
+  if (family == AF_INET) {
+    uint8_t *octets = (uint8_t *)addr;
+    for (int i = 0; i < 4; i++) {
+      uint64_t val;
+      const char *next = scan_uint(p, end, val);
+      if (next == p || next - p > 3 || val > 255)
+        return false;
+      octets[i] = val;
+      p = next;
+      if (i < 3) {
+        if (p == end || *p != '.')
+          return false;
+        p++;
+      }
+    }
+    return p == end;
+  }
+
+  // IPv6 is rare enough here to not be worth its own parser
+  char buf[INET6_ADDRSTRLEN];
+  if ((size_t)(end - p) >= sizeof(buf))
+    return false;
+  memcpy(buf, p, end - p);
+  buf[end - p] = '\0';
+  return inet_pton(AF_INET6, buf, addr) == 1;
+}
+
+/*
+ * Parse the line in [p, end) into 'entry'. Returns false if it doesn't
+ * look like a state.
+ */
+bool procfs_parse(const char *p, const char *end, tentry_t *entry)
+{
+  int field = 0;
+  bool have_src = false, have_dst = false, have_sport = false,
+       have_dport = false, have_type = false, have_code = false,
+       have_id = false;
+  uint64_t val;
+  // the reply tuple, for set_nat()
+  in6_addr rsrc, rdst;
+  unsigned long rsrcpt = 0, rdstpt = 0;
+  bool have_rsrc = false, have_rdst = false, have_rsport = false,
+       have_rdport = false;
+  memset(&rsrc, 0, sizeof(rsrc));
+  memset(&rdst, 0, sizeof(rdst));
+
+  entry->srcpt = entry->dstpt = 0;
+  entry->tcpstate = entry->icmp_type = entry->icmp_code = 0;
+  entry->icmp_id = entry->zone = entry->netns = 0;
+  entry->timeout = entry->mark = 0;
+  entry->bytes = entry->packets = 0;
+  memset(&entry->src, 0, sizeof(entry->src));
+  memset(&entry->dst, 0, sizeof(entry->dst));
+
+  /*
+   * Each pass looks at one token, and leaves 'p' somewhere inside or at the
+   * end of it: we only look at the bytes of a value as we convert it, and
+   * skip whatever's left (usually nothing) at the bottom of the loop.
+   */
+  for (;; field++) {
+    while (p < end && (*p == ' ' || *p == '\t'))
+      p++;
+    if (p == end)
+      break;
+    const char *tok = p;
+
+    // l3 name, l3 number, l4 name, l4 number, timeout
+    switch (field) {
+      case 1:
+        p = scan_uint(p, end, val);
+        entry->family = val;
+        if (entry->family != AF_INET && entry->family != AF_INET6)
+          return false;
+        break;
+      case 3:
+        p = scan_uint(p, end, val);
+        entry->l4proto = val;
+        break;
+      case 4:
+        p = scan_uint(p, end, val);
+        entry->timeout = val;
+        break;
+    }
+    if (field < 5) {
+      while (p < end && *p != ' ' && *p != '\t')
+        p++;
+      continue;
+    }
+
+    while (p < end && *p != '=' && *p != ' ' && *p != '\t')
+      p++;
+    size_t klen = p - tok;
+
+    if (p == end || *p != '=') {
+      // The TCP state is the only bare word we care about
+      if (field == 5 && entry->l4proto == IPPROTO_TCP) {
+        for (unsigned int i = 0; i < sizeof(states) / sizeof(states[0]); i++) {
+          if (strlen(states[i]) == klen && !memcmp(tok, states[i], klen)) {
+            entry->tcpstate = i;
+            break;
+          }
+        }
+      }
+      continue;
+    }
+    p++;
+
+#define KEY(name) (klen == sizeof(name) - 1 && !memcmp(tok, name, klen))
+    // The first of each of these is the original direction, then the reply
+    if (KEY("src") || KEY("dst")) {
+      const char *vp = p;
+      while (p < end && *p != ' ' && *p != '\t')
+        p++;
+      if (tok[0] == 's' && !have_src)
+        have_src = scan_ip(vp, p, entry->family, &entry->src);
+      else if (tok[0] == 'd' && !have_dst)
+        have_dst = scan_ip(vp, p, entry->family, &entry->dst);
+      else if (tok[0] == 's' && !have_rsrc)
+        have_rsrc = scan_ip(vp, p, entry->family, &rsrc);
+      else if (tok[0] == 'd' && !have_rdst)
+        have_rdst = scan_ip(vp, p, entry->family, &rdst);
+    } else if (KEY("sport")) {
+      p = scan_uint(p, end, val);
+      if (!have_sport) {
+        entry->srcpt = val;
+        have_sport = true;
+      } else if (!have_rsport) {
+        rsrcpt = val;
+        have_rsport = true;
+      }
+    } else if (KEY("dport")) {
+      p = scan_uint(p, end, val);
+      if (!have_dport) {
+        entry->dstpt = val;
+        have_dport = true;
+      } else if (!have_rdport) {
+        rdstpt = val;
+        have_rdport = true;
+      }
+    // (only the original direction's ICMP fields count)
+    } else if (KEY("type")) {
+      p = scan_uint(p, end, val);
+      if (!have_type) {
+        entry->icmp_type = val;
+        have_type = true;
+      }
+    } else if (KEY("code")) {
+      p = scan_uint(p, end, val);
+      if (!have_code) {
+        entry->icmp_code = val;
+        have_code = true;
+      }
+    } else if (KEY("id")) {
+      // netlink gives us this in network byte order, so match that
+      p = scan_uint(p, end, val);
+      if (!have_id) {
+        entry->icmp_id = htons(val);
+        have_id = true;
+      }
+    // but counters are summed across both directions
+    } else if (KEY("packets")) {
+      p = scan_uint(p, end, val);
+      entry->packets += val;
+    } else if (KEY("bytes")) {
+      p = scan_uint(p, end, val);
+      entry->bytes += val;
+    } else if (KEY("mark")) {
+      p = scan_uint(p, end, val);
+      entry->mark = val;
+    } else if (KEY("zone")) {
+      p = scan_uint(p, end, val);
+      entry->zone = val;
+    }
+#undef KEY
+    while (p < end && *p != ' ' && *p != '\t')
+      p++;
+  }
+
+  // without a reply tuple, there's nothing to say it's NATed
+  if (have_rsrc && have_rdst)
+    set_nat(entry, rsrc, rdst, rsrcpt, rdstpt);
+  else
+    entry->nat.reset();
+  return have_src && have_dst;
+}
+
+void procfs_dump(source_t &source, hook_data &hook)
+{
+  int fd = open(source.path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    end_curses();
+    printf("ERROR: Couldn't open %s: %s\n", source.path.c_str(),
+           strerror(errno));
+    exit(2);
+  }
+
+  /*
+   * Read as much as we can at a time, parse every complete line in the
+   * buffer, and move whatever partial line is left over to the front
+   * before the next read. The buffer only grows if a single line doesn't
+   * fit in it, which a sane file never does.
+   */
+  static vector<char> buf(PROCFS_BUF_SIZE);
+  size_t used = 0;
+  tentry_t *entry = NULL;
+  bool eof = false;
+  while (!eof) {
+    if (used == buf.size())
+      buf.resize(buf.size() * 2);
+    ssize_t got = read(fd, &buf[used], buf.size() - used);
+    if (got < 0) {
+      if (errno == EINTR)
+        continue;
+      end_curses();
+      printf("ERROR: Couldn't read %s: %s\n", source.path.c_str(),
+             strerror(errno));
+      exit(2);
+    }
+    used += got;
+    eof = (got == 0);
+
+    const char *p = &buf[0];
+    const char *end = p + used;
+    while (p < end) {
+      const char *nl = (const char *)memchr(p, '\n', end - p);
+      if (nl == NULL) {
+        // the last line may not have a newline
+        if (!eof)
+          break;
+        nl = end;
+      }
+      if (entry == NULL)
+        entry = new_entry(hook);
+      if (procfs_parse(p, nl, entry)) {
+        process_entry(hook, entry);
+        entry = NULL;
+      }
+      p = (nl < end) ? nl + 1 : end;
+    }
+    used = end - p;
+    if (used)
+      memmove(&buf[0], p, used);
+  }
+  if (entry && !hook.stream)
+    delete entry;
+  close(fd);
+}
+
+/*
+ * REPLAY
+ *
+ * Reads back what --output bin wrote, one snapshot per refresh, starting
+ * again from the top when we run out.
+ */
+
+// Any record, see bin_snap_t and bin_entry_t
+union bin_record_t {
+  bin_snap_t snap;
+  bin_entry_t entry;
+  char raw[256];
+};
+
+/*
+ * Read the next record. Returns false at the end of the file, and bails
+ * out if the file is corrupt. We only read as much of a record as we know
+ * about, so newer versions can make records longer.
+ */
+bool replay_read(source_t &source, bin_record_t &rec)
+{
+  memset(&rec, 0, sizeof(rec));
+  if (fread(&rec, 4, 1, source.file) != 1)
+    return false;
+
+  size_t len = rec.entry.len;
+  size_t want = (len < sizeof(rec) ? len : sizeof(rec));
+  if (len < 4 ||
+      (want > 4 && fread(rec.raw + 4, want - 4, 1, source.file) != 1) ||
+      (len > want && fseek(source.file, len - want, SEEK_CUR) != 0)) {
+    end_curses();
+    printf("ERROR: %s is truncated or corrupt\n", source.path.c_str());
+    exit(2);
+  }
+  return true;
+}
+
+// The reverse of write_bin()
+void entry_from_bin(const bin_entry_t &rec, tentry_t *entry)
+{
+  entry->family = rec.family;
+  entry->l4proto = rec.l4proto;
+  entry->tcpstate = rec.tcpstate;
+  entry->icmp_type = rec.icmp_type;
+  entry->icmp_code = rec.icmp_code;
+  entry->srcpt = rec.sport;
+  entry->dstpt = rec.dport;
+  entry->icmp_id = rec.icmp_id;
+  entry->zone = rec.zone;
+  entry->netns = 0;
+  entry->timeout = rec.ttl;
+  entry->mark = rec.mark;
+  entry->bytes = rec.bytes;
+  entry->packets = rec.packets;
+  entry->byte_rate = entry->packet_rate = 0;
+  memcpy(entry->src.s6_addr, rec.src, 16);
+  memcpy(entry->dst.s6_addr, rec.dst, 16);
+  // captures don't have the reply tuple
+  entry->nat.reset();
+}
+
+void replay_dump(source_t &source, hook_data &hook)
+{
+  if (source.file == NULL) {
+    source.file = fopen(source.path.c_str(), "r");
+    if (source.file == NULL) {
+      end_curses();
+      printf("ERROR: Couldn't open %s: %s\n", source.path.c_str(),
+             strerror(errno));
+      exit(2);
+    }
+  }
+
+  bin_record_t rec;
+  bool rewound = false;
+
+  // Find the start of the next snapshot, going back to the top at the end
+  while (!source.have_snap) {
+    if (!replay_read(source, rec)) {
+      if (rewound)
+        return;
+      rewind(source.file);
+      rewound = true;
+      continue;
+    }
+    source.have_snap = (rec.snap.type == BIN_SNAPSHOT);
+    source.next_snap_time = rec.snap.time;
+  }
+  source.have_snap = false;
+  source.snap_time = source.next_snap_time;
+
+  /*
+   * Then everything up to the next one. We don't trust the count, since
+   * --stream doesn't know it when it writes the snapshot.
+   */
+  while (replay_read(source, rec)) {
+    if (rec.snap.type == BIN_SNAPSHOT) {
+      source.have_snap = true;
+      source.next_snap_time = rec.snap.time;
+      break;
+    }
+    if (rec.entry.type != BIN_ENTRY)
+      continue;
+
+    tentry_t *entry = new_entry(hook);
+    entry_from_bin(rec.entry, entry);
+    process_entry(hook, entry);
+  }
+}
+
+/*
+ * HISTORY
+ *
+ * With --history, every refresh's states are kept for rewinding with '['
+ * and ']'. Only the latest snapshot is kept in full, as an array sorted by
+ * tuple_hash(); each older one is a delta that turns the snapshot after it
+ * back into it: the states that went away or changed, as they were (just
+ * their counters and TTL if that's all that changed, which is by far the
+ * most common), and the keys of the ones that are new. TTLs are kept as
+ * the time the state expires, so a state nothing happened to is the same
+ * from one refresh to the next and costs nothing. Everything is sorted by
+ * key, so making and applying deltas are single merges. Going back
+ * rebuilds the snapshot and feeds it through process_entry(), so sorting,
+ * filtering and drawing all work as usual.
+ */
+
+bool hist_less(const hist_slot_t &one, const hist_slot_t &two)
+{
+  return one.key < two.key;
+}
+
+// What a delta costs us, for --history's budget
+uint64_t hist_bytes(const hist_delta_t &delta)
+{
+  return sizeof(delta) + delta.changed.capacity() * sizeof(hist_slot_t)
+    + delta.counters.capacity() * sizeof(hist_counters_t)
+    + delta.added.capacity() * sizeof(uint64_t) + 3 * MEM_OVERHEAD;
+}
+
+// Start recording a snapshot taken at 'time' (usec since the epoch)
+void hist_begin(uint64_t time)
+{
+  history.next.clear();
+  history.next.reserve(history.latest.size());
+  history.next_time = time;
+}
+
+// Record one state, see process_entry()
+void hist_entry(const tentry_t *entry)
+{
+  history.next.push_back(hist_slot_t());
+  hist_slot_t &slot = history.next.back();
+  slot.key = tuple_hash(entry);
+  bin_from_entry(entry, BIN_ENTRY, slot.rec);
+  slot.rec.ttl += history.next_time / 1000000;
+  slot.netns = entry->netns;
+}
+
+/*
+ * Whether a state is the same in two snapshots, apart from its counters.
+ * Expiry times can be a second apart without anything having happened,
+ * from rounding.
+ */
+bool hist_same(const bin_entry_t &one, const bin_entry_t &two)
+{
+  if (one.ttl > two.ttl + 1 || two.ttl > one.ttl + 1)
+    return false;
+  bin_entry_t tmp = two;
+  tmp.ttl = one.ttl;
+  tmp.bytes = one.bytes;
+  tmp.packets = one.packets;
+  return !memcmp(&one, &tmp, sizeof(one));
+}
+
+/*
+ * Make the delta from the snapshot we just recorded back to the one before
+ * it, make the new one the latest, and drop the oldest deltas until we fit
+ * in the budget.
+ */
+void hist_finish()
+{
+  vector<hist_slot_t> &next = history.next, &latest = history.latest;
+
+  sort(next.begin(), next.end(), hist_less);
+  // two states with the same hash are rare enough to just keep one
+  next.erase(unique(next.begin(), next.end(),
+                    [](const hist_slot_t &one, const hist_slot_t &two) {
+                      return one.key == two.key;
+                    }),
+             next.end());
+
+  if (history.latest_time) {
+    hist_delta_t delta;
+    delta.time = history.latest_time;
+    size_t i = 0, j = 0;
+    while (i < latest.size() || j < next.size()) {
+      if (j == next.size()
+          || (i < latest.size() && latest[i].key < next[j].key)) {
+        delta.changed.push_back(latest[i++]);
+      } else if (i == latest.size() || next[j].key < latest[i].key) {
+        delta.added.push_back(next[j++].key);
+      } else {
+        const bin_entry_t &old = latest[i].rec, &now = next[j].rec;
+        if (!hist_same(old, now)) {
+          delta.changed.push_back(latest[i]);
+        } else if (old.bytes != now.bytes || old.packets != now.packets) {
+          hist_counters_t counters;
+          counters.key = latest[i].key;
+          counters.ttl = old.ttl;
+          counters.bytes = old.bytes;
+          counters.packets = old.packets;
+          delta.counters.push_back(counters);
+        }
+        i++;
+        j++;
+      }
+    }
+    delta.changed.shrink_to_fit();
+    delta.counters.shrink_to_fit();
+    delta.added.shrink_to_fit();
+    history.bytes += hist_bytes(delta);
+    history.deltas.push_front(move(delta));
+    // so that a snapshot we're looking back at stays put
+    if (history.offset)
+      history.offset++;
+  }
+
+  latest.swap(next);
+  history.latest_time = history.next_time;
+  vector<hist_slot_t>().swap(next);
+
+  uint64_t size = latest.capacity() * sizeof(hist_slot_t);
+  while (!history.deltas.empty() && history.bytes + size > history.budget) {
+    history.bytes -= hist_bytes(history.deltas.back());
+    history.deltas.pop_back();
+  }
+  if (history.offset > history.deltas.size())
+    history.offset = history.deltas.size();
+}
+
+// Turn 'table' into the snapshot before it, see hist_finish()
+void hist_apply(const vector<hist_slot_t> &table, const hist_delta_t &delta,
+                vector<hist_slot_t> &out)
+{
+  size_t added = 0, changed = 0, counters = 0;
+
+  out.clear();
+  out.reserve(table.size() + delta.changed.size());
+  for (const hist_slot_t &slot : table) {
+    // states that have gone since come in between
+    while (changed < delta.changed.size()
+           && delta.changed[changed].key < slot.key)
+      out.push_back(delta.changed[changed++]);
+    while (added < delta.added.size() && delta.added[added] < slot.key)
+      added++;
+    if (added < delta.added.size() && delta.added[added] == slot.key)
+      continue;
+    if (changed < delta.changed.size()
+        && delta.changed[changed].key == slot.key) {
+      out.push_back(delta.changed[changed++]);
+      continue;
+    }
+    out.push_back(slot);
+    while (counters < delta.counters.size()
+           && delta.counters[counters].key < slot.key)
+      counters++;
+    if (counters < delta.counters.size()
+        && delta.counters[counters].key == slot.key) {
+      const hist_counters_t &old = delta.counters[counters];
+      out.back().rec.ttl = old.ttl;
+      out.back().rec.bytes = old.bytes;
+      out.back().rec.packets = old.packets;
+    }
+  }
+  while (changed < delta.changed.size())
+    out.push_back(delta.changed[changed++]);
+}
+
+/*
+ * Rebuild the snapshot 'history.offset' refreshes back, and feed it through
+ * process_entry() in place of the live table, see build_table()
+ */
+void hist_dump(hook_data &hook)
+{
+  vector<hist_slot_t> table, older;
+
+  hist_apply(history.latest, history.deltas[0], table);
+  for (unsigned int i = 1; i < history.offset; i++) {
+    hist_apply(table, history.deltas[i], older);
+    table.swap(older);
+  }
+
+  uint32_t now = history.deltas[history.offset - 1].time / 1000000;
+  for (const hist_slot_t &slot : table) {
+    tentry_t *entry = new_entry(hook);
+    entry_from_bin(slot.rec, entry);
+    entry->netns = slot.netns;
+    entry->timeout = slot.rec.ttl > now ? slot.rec.ttl - now : 0;
+    process_entry(hook, entry);
+  }
+}
+
+/*
+ * SYNTHETIC
+ *
+ * Makes up 'count' states, shaped by a synth_t (see parse_synth()). State i
+ * is always the same connection, so things stay put from one refresh to
+ * the next, but its counters go up and its TTL goes down each time.
+ */
+
+// splitmix64, a cheap way to get well-mixed bits from a counter
+uint64_t mix64(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// Fill in state 'i' as of the 'generation'th time we've been read
+void synthetic_entry(const synth_t &synth, uint64_t generation,
+                     unsigned long i, tentry_t *entry)
+{
+  uint64_t r = mix64(i);
+  uint64_t r2 = mix64(r);
+  uint64_t r3 = mix64(r2);
+
+  entry->nat.reset();
+
+  entry->family = (r % 100 < synth.v6) ? AF_INET6 : AF_INET;
+
+  unsigned int total = synth.tcp + synth.udp + synth.icmp + synth.other;
+  unsigned int kind = total ? (r >> 8) % total : 0;
+  if (kind < synth.tcp)
+    entry->l4proto = IPPROTO_TCP;
+  else if (kind < synth.tcp + synth.udp)
+    entry->l4proto = IPPROTO_UDP;
+  else if (kind < synth.tcp + synth.udp + synth.icmp && entry->family == AF_INET)
+    entry->l4proto = IPPROTO_ICMP;
+  else if (kind < synth.tcp + synth.udp + synth.icmp)
+    entry->l4proto = IPPROTO_ICMPV6;
+  else
+    entry->l4proto = IPPROTO_GRE;
+
+  /*
+   * 10.x.x.x (or fd00::/8) talking to 192.168.x.x (or fd01::/8), except
+   * that 'hot' percent of states go to one of only 'hot_dsts' destinations.
+   */
+  uint32_t dst = (r2 >> 24) & 0xffff;
+  if (synth.hot_dsts && (r3 % 100) < synth.hot)
+    dst = 1 + (r3 >> 8) % synth.hot_dsts;
+  memset(&entry->src, 0, sizeof(entry->src));
+  memset(&entry->dst, 0, sizeof(entry->dst));
+  if (entry->family == AF_INET) {
+    uint32_t addr = htonl(0x0a000000 | (r2 & 0xffffff));
+    memcpy(entry->src.s6_addr, &addr, 4);
+    addr = htonl(0xc0a80000 | dst);
+    memcpy(entry->dst.s6_addr, &addr, 4);
+  } else {
+    entry->src.s6_addr[0] = entry->dst.s6_addr[0] = 0xfd;
+    entry->dst.s6_addr[1] = 0x01;
+    memcpy(entry->src.s6_addr + 8, &r2, 8);
+    entry->dst.s6_addr[14] = dst >> 8;
+    entry->dst.s6_addr[15] = dst & 0xff;
+  }
+
+  entry->srcpt = entry->dstpt = 0;
+  entry->tcpstate = entry->icmp_type = entry->icmp_code = 0;
+  entry->icmp_id = 0;
+  switch (entry->l4proto) {
+    case IPPROTO_TCP:
+      // mostly ESTABLISHED, like most real tables
+      entry->tcpstate = (r >> 16) % 10 < 8 ? 3 : 1 + (r >> 20) % 8;
+      // fall through
+    case IPPROTO_UDP:
+      {
+        static const unsigned int ports[] = {443, 80, 53, 22, 123, 8080};
+        entry->srcpt = 1024 + (r2 >> 40) % 64512;
+        entry->dstpt = ports[(r >> 24) % 6];
+      }
+      break;
+    case IPPROTO_ICMP:
+    case IPPROTO_ICMPV6:
+      entry->icmp_type = 8;
+      entry->icmp_id = r2 >> 48;
+      break;
+  }
+
+  unsigned int ttl = 1 + (r >> 32) % synth.ttl;
+  entry->timeout = ttl - generation % ttl;
+  entry->mark = entry->zone = entry->netns = 0;
+
+  /*
+   * Counters are heavy-tailed: the number of digits is uniform, so there
+   * are as many states with 10-99 packets as with 10000-99999.
+   */
+  uint64_t magnitude = 1;
+  for (unsigned int d = (r3 >> 16) % digits(synth.packets); d > 0; d--)
+    magnitude *= 10;
+  entry->packets = magnitude + (r3 >> 24) % (magnitude * 9)
+    + generation * ((r >> 48) % 50);
+  entry->bytes = entry->packets * (64 + (r2 >> 52) % 1400);
+}
+
+void synthetic_dump(source_t &source, hook_data &hook)
+{
+  for (unsigned long i = 0; i < source.count; i++) {
+    tentry_t *entry = new_entry(hook);
+    synthetic_entry(source.synth, source.generation, i, entry);
+    process_entry(hook, entry);
+  }
+}
+
+/*
+ * Parse the options to the synthetic source, a comma-separated list of
+ * a count and/or any of:
+ *
+ *   proto=TCP/UDP/ICMP/OTHER   relative weights of each protocol
+ *   v6=PCT                     percentage of states that are IPv6
+ *   hot=PCT/N                  PCT% of states go to just N destinations
+ *   ttl=SECS                   TTLs are spread evenly up to SECS
+ *   counters=N                 packet counters go up to about N
+ */
+bool parse_synth(const string &param, source_t &source)
+{
+  synth_t &synth = source.synth;
+  vector<string> opts(MAXFIELDS);
+  splita(',', param, opts);
+
+  for (const string &opt : opts) {
+    if (opt.empty())
+      continue;
+    string key, val;
+    if (opt.find('=') == string::npos) {
+      key = "count";
+      val = opt;
+    } else {
+      split('=', opt, key, val);
+    }
+
+    unsigned long nums[4] = {0, 0, 0, 0};
+    unsigned int n = 0;
+    const char *p = val.c_str();
+    char *end;
+    while (n < 4) {
+      if (!isdigit(*p))
+        return false;
+      nums[n++] = strtoul(p, &end, 10);
+      if (*end != '/')
+        break;
+      p = end + 1;
+    }
+    if (*end != '\0')
+      return false;
+
+    if (key == "count" && n == 1) {
+      source.count = nums[0];
+    } else if (key == "proto" && n == 4) {
+      synth.tcp = nums[0];
+      synth.udp = nums[1];
+      synth.icmp = nums[2];
+      synth.other = nums[3];
+    } else if (key == "v6" && n == 1 && nums[0] <= 100) {
+      synth.v6 = nums[0];
+    } else if (key == "hot" && n == 2 && nums[0] <= 100) {
+      synth.hot = nums[0];
+      synth.hot_dsts = nums[1];
+    } else if (key == "ttl" && n == 1 && nums[0] > 0) {
+      synth.ttl = nums[0];
+    } else if (key == "counters" && n == 1 && nums[0] > 0) {
+      synth.packets = nums[0];
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+typedef void (*dump_fn_t)(source_t &, hook_data &);
+struct backend_t {
+  const char *name;
+  dump_fn_t dump;
+};
+
+// Indexed by SOURCE_*
+static const backend_t backends[SOURCE_MAX+1] = {
+  {"netlink", netlink_dump},
+  {"procfs", procfs_dump},
+  {"replay", replay_dump},
+  {"synthetic", synthetic_dump},
+};
+
+/*
+ * How long (in ms) until the next refresh. That's the refresh rate, unless
+ * we're replaying a capture at some speed, in which case it's however long
+ * it was until the next snapshot when it was recorded.
+ */
+unsigned int refresh_interval(const source_t &source, unsigned int rate)
+{
+  if (source.type != SOURCE_REPLAY || source.speed <= 0 || !source.have_snap
+      || source.next_snap_time < source.snap_time)
+    return rate;
+
+  double interval = (source.next_snap_time - source.snap_time) / 1000.0
+    / source.speed;
+  if (interval > MAX_RATE)
+    return MAX_RATE;
+  return (unsigned int)interval;
+}
+
+/*
+ * Parse the argument to --source, e.g. "procfs:/tmp/table"
+ */
+bool parse_source(const char *arg, source_t &source)
+{
+  string name = arg, param;
+  size_t colon = name.find(':');
+  if (colon != string::npos) {
+    param = name.substr(colon + 1);
+    name = name.substr(0, colon);
+  }
+
+  for (int i = 0; i <= SOURCE_MAX; i++) {
+    if (name != backends[i].name)
+      continue;
+    source.type = i;
+    switch (i) {
+      case SOURCE_NETLINK:
+        return colon == string::npos;
+      case SOURCE_PROCFS:
+        source.path = param.empty() ? PROCFS_PATH : param;
+        return true;
+      case SOURCE_REPLAY:
+        source.path = param;
+        return !param.empty();
+      case SOURCE_SYNTHETIC:
+        source.count = DEFAULT_SYNTHETIC;
+        return parse_synth(param, source);
+    }
+  }
+  return false;
+}
+
+/**
+ * Nuke the tentry_t's we made before deleting the vector of pointers
+ */
+void clear_table(vector<tentry_t*> &stable)
+{
+  for (tentry_t* entry: stable) {
+    delete entry;
+  }
+  stable.clear();
+}
+
+
+/*
+ * This is the core of this program - build a table of states.
+ *
+ * The actual reading of states is up to the source, see DATA SOURCES.
+ */
+void build_table(flags_t &flags, const filters_t &filters, vector<tentry_t*>
+                 &stable, counters_t &counts, max_t &max, source_t &source,
+                 stream_t *stream = NULL)
+{
+  /*
+   * This is the ugly struct for the source, that holds pointers to
+   * all of the things process_entry() will need to fill our table
+   */
+  struct hook_data hook;
+  hook.stable = &stable;
+  hook.flags = &flags;
+  hook.max = &max;
+  hook.counts = &counts;
+  hook.filters = &filters;
+  hook.stream = stream;
+  hook.record = source.record;
+  hook.rates = source.rates;
+  hook.changes = flags.changes ? source.changes : NULL;
+  hook.past = false;
+  /*
+   * While we're looking back at --history, the live table is still read
+   * every refresh so that everything that watches it keeps up, but it's
+   * the snapshot that goes in the table.
+   */
+  bool live = !history.offset;
+  hook.hidden = !live;
+  struct hook_data past = hook;
+  past.record = NULL;
+  past.rates = NULL;
+  past.changes = NULL;
+  past.past = true;
+  past.hidden = false;
+
+  /*
+   * Initialization
+   */
+  // last refresh's states, some of which may stay on as ghosts
+  vector<tentry_t*> old;
+  if (live && hook.changes && hook.changes->table)
+    old.swap(stable);
+  else
+    clear_table(stable);
+
+  counts.tcp = counts.udp = counts.icmp = counts.other = counts.skipped = 0;
+  counts.dropped = 0;
+
+  mem.table = 0;
+  mem.slots = stable.capacity() * sizeof(tentry_t*);
+  mem.level = MEM_OK;
+  mem.candidates = 0;
+  // rate and change tracking may have been turned off since last time
+  mem.rates = source.rates ? rates_bytes(*source.rates) : 0;
+  mem.changes = source.changes ? changes_bytes(*source.changes) : 0;
+  // so an unchanged table gets the same sample every refresh
+  srandom(1);
+  if (now_usec() >= names.expires)
+    names_clear();
+
+  if (source.rates)
+    rates_begin(*source.rates, source.type == SOURCE_REPLAY
+                                 ? source.snap_time : now_usec());
+  if (hook.changes)
+    changes_begin(*source.changes, source.type == SOURCE_REPLAY
+                                     ? source.snap_time : now_usec());
+  counts.opened = counts.closed = counts.ghosts = 0;
+  if (synflood.enabled)
+    syn_begin(source.type == SOURCE_REPLAY ? source.snap_time : now_usec());
+  if (history.budget)
+    hist_begin(source.type == SOURCE_REPLAY ? source.snap_time
+                                            : now_usec(CLOCK_REALTIME));
+
+  // we only know how many states there are once we've read them all
+  if (hook.record)
+    write_bin_snap(*source.record, BIN_COUNT_UNKNOWN,
+                   now_usec(CLOCK_REALTIME));
+
+  /*
+   * The dump includes calling process_entry() for every state, so take out
+   * what we timed in there.
+   */
+  uint64_t start = now_usec();
+  uint64_t inner = stats.usec[PHASE_PROCESS] + stats.usec[PHASE_RESOLVE];
+  if (!live)
+    hist_dump(past);
+  backends[source.type].dump(source, hook);
+  source.generation++;
+  stats_time(PHASE_DUMP, start);
+  stats.usec[PHASE_DUMP] -= stats.usec[PHASE_PROCESS]
+    + stats.usec[PHASE_RESOLVE] - inner;
+
+  if (hook.changes) {
+    changes_finish(*source.changes, old, stable, counts, max, flags, filters);
+    // grouping replaces the states, so there'd be nothing to compare with,
+    // and neither would a --history snapshot
+    source.changes->table = live && !flags.group && !stream;
+  } else if (source.changes) {
+    source.changes->table = false;
+  }
+  if (synflood.enabled)
+    syn_finish(flags);
+  if (history.budget) {
+    uint64_t phase = now_usec();
+    hist_finish();
+    stats_time(PHASE_PROCESS, phase);
+  }
+  if (hook.record)
+    out_flush(*source.record);
+}
+
+/*
+ * This sorts the table based on the current sorting preference
+ */
+void sort_table(const int &sortby, const bool &lookup, const bool &reverse,
+                vector<tentry_t*> &stable, string &sorting,
+                bool grouped = false, bool rates = false)
+{
+  if (sortby < 0 || sortby > SORT_MAX) {
+    //we should never get here
+    sorting = "??unknown??";
+    return;
+  }
+
+  const sorter_t &sorter = rates && sortby >= SORT_BYTES
+    ? rate_sorters[sortby - SORT_BYTES]
+    : sorters[sortby][grouped ? 2 : lookup];
+  sorter.sort[reverse](stable);
+  sorting = sorter.name;
+
+  if (reverse)
+    sorting = sorting + " reverse";
+
+}
+
+/*
+ * GROUPING
+ *
+ * --group (or 'g') replaces the table of states with a table of groups of
+ * them - per source, destination, port and so on - so that a flood of
+ * thousands of near-identical states shows up as a single line. Each group
+ * is itself a tentry_t, so it's sorted and drawn like any other state: the
+ * Source column says what the group is, the Destination column how many
+ * states are in it (which is also in dstpt, so it sorts), and the rest are
+ * summed, the longest TTL, or a breakdown of TCP states.
+ */
+
+// Short names for the TCP states, for group breakdowns
+static const char *state_abbrevs[] = {
+  "NO", "SS", "SR", "ES", "FW", "CW", "LA", "TW", "CL", "LI"
+};
+
+/*
+ * Parse what to group by: src, dst, dport, proto or state, and for src
+ * and dst an optional prefix length for IPv4 and then IPv6 (src/24/64).
+ */
+bool parse_group(const string &arg, grouping_t &grouping)
+{
+  size_t slash = arg.find('/');
+  string name = arg.substr(0, slash);
+
+  grouping.prefix4 = 32;
+  grouping.prefix6 = 128;
+  if (name == "" || name == "none") {
+    grouping.by = GROUP_NONE;
+  } else if (name == "src") {
+    grouping.by = GROUP_SRC;
+  } else if (name == "dst") {
+    grouping.by = GROUP_DST;
+  } else if (name == "dport") {
+    grouping.by = GROUP_DPORT;
+  } else if (name == "proto") {
+    grouping.by = GROUP_PROTO;
+  } else if (name == "state") {
+    grouping.by = GROUP_STATE;
+  } else if (name == "dst:dport") {
+    grouping.by = GROUP_SERVICE;
+  } else if (name == "mark") {
+    grouping.by = GROUP_MARK;
+  } else if (name == "netns") {
+    grouping.by = GROUP_NETNS;
   } else {
-    // delete pad
-    delwin(mainwin);
-    mainwin = stdscr;
-    keypad(mainwin,1);
-    halfdelay(1);
+    return false;
+  }
+  if (slash == string::npos)
+    return true;
+  if (grouping.by != GROUP_SRC && grouping.by != GROUP_DST)
+    return false;
+
+  const char *p = arg.c_str() + slash + 1;
+  char *end;
+  unsigned long prefix = strtoul(p, &end, 10);
+  if (end == p || prefix > 32)
+    return false;
+  grouping.prefix4 = prefix;
+  grouping.prefix6 = 64;
+  if (*end == '/') {
+    p = end + 1;
+    prefix = strtoul(p, &end, 10);
+    if (end == p || prefix > 128)
+      return false;
+    grouping.prefix6 = prefix;
+  }
+  return *end == '\0';
+}
+
+// Zero all but the first 'prefix' bits of 'addr'
+void mask_addr(in6_addr &addr, unsigned int prefix)
+{
+  for (unsigned int i = 0; i < 16; i++) {
+    if (prefix >= 8) {
+      prefix -= 8;
+    } else {
+      addr.s6_addr[i] &= 0xff << (8 - prefix);
+      prefix = 0;
+    }
+  }
+}
+
+/*
+ * Fill in the key of the group 'entry' belongs to: an address, or a
+ * number in the first four bytes (big-endian, so it sorts like one).
+ */
+void group_of(const tentry_t *entry, const grouping_t &grouping,
+              group_slot_t &slot)
+{
+  uint32_t num = 0;
+
+  memset(&slot.key, 0, sizeof(slot.key));
+  slot.family = AF_INET;
+  slot.port = 0;
+  switch (grouping.by) {
+    case GROUP_SRC:
+    case GROUP_DST:
+      slot.family = entry->family;
+      slot.key = grouping.by == GROUP_SRC ? entry->src : entry->dst;
+      mask_addr(slot.key, entry->family == AF_INET ? grouping.prefix4
+                                                   : grouping.prefix6);
+      return;
+    case GROUP_SERVICE:
+      slot.family = entry->family;
+      slot.key = entry->dst;
+      slot.port = entry->l4proto << 16 | entry->dstpt;
+      return;
+    case GROUP_DPORT:
+      num = entry->l4proto << 16 | entry->dstpt;
+      break;
+    case GROUP_PROTO:
+      num = entry->l4proto;
+      break;
+    case GROUP_MARK:
+      num = entry->mark;
+      break;
+    case GROUP_NETNS:
+      num = (uint32_t)entry->netns << 16 | entry->zone;
+      break;
+    case GROUP_STATE:
+      // other protocols are grouped by protocol, after all the TCP states
+      if (entry->l4proto == IPPROTO_TCP)
+        num = entry->tcpstate;
+      else
+        num = 0x100 | entry->l4proto;
+      break;
+  }
+  num = htonl(num);
+  memcpy(slot.key.s6_addr, &num, sizeof(num));
+}
+
+uint64_t addr_hash(uint8_t family, const in6_addr &addr)
+{
+  uint64_t lo, hi;
+  memcpy(&lo, addr.s6_addr, sizeof(lo));
+  memcpy(&hi, addr.s6_addr + 8, sizeof(hi));
+  return mix64(lo ^ mix64(hi + family));
+}
+
+/*
+ * The hash sketches use for an address. The synthetic source makes its
+ * addresses with mix64() too, which leaves just enough pattern in
+ * addr_hash() to throw estimates off by several percent, so this mixes
+ * again with MurmurHash3's finalizer.
+ */
+uint64_t hll_hash(uint8_t family, const in6_addr &addr)
+{
+  uint64_t hash = addr_hash(family, addr);
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  return hash ^ (hash >> 33);
+}
+
+/*
+ * Add a hash to a HyperLogLog sketch: the first HLL_BITS bits pick a
+ * register, which keeps the most leading zeros (plus one) seen in the rest.
+ */
+void hll_add(uint8_t *registers, uint64_t hash)
+{
+  uint64_t rest = hash << HLL_BITS;
+  uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - HLL_BITS + 1;
+  uint8_t &reg = registers[hash >> (64 - HLL_BITS)];
+  if (rank > reg)
+    reg = rank;
+}
+
+// Estimate how many distinct hashes went into a sketch
+uint32_t hll_count(const uint8_t *registers)
+{
+  const double m = HLL_REGISTERS;
+  double sum = 0;
+  unsigned int zeros = 0;
+
+  for (unsigned int i = 0; i < HLL_REGISTERS; i++) {
+    sum += ldexp(1.0, -registers[i]);
+    if (!registers[i])
+      zeros++;
   }
+  double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+  // small counts are better estimated from how many registers are empty
+  if (estimate <= 2.5 * m && zeros)
+    estimate = m * log(m / zeros);
+  return estimate + 0.5;
+}
 
-  flags.noscroll = !flags.noscroll;
+/*
+ * Count a source towards a group's distinct sources. The first few are
+ * kept exactly; past that, the group gets a sketch in 'registers', so a
+ * group never takes more than HLL_REGISTERS bytes however many sources it
+ * has, and most groups - with only a handful - don't need one at all.
+ */
+void group_src(group_slot_t &slot, vector<uint8_t> &registers, uint64_t hash)
+{
+  if (!slot.sketch) {
+    for (unsigned int i = 0; i < slot.srcs; i++)
+      if (slot.src_hashes[i] == hash)
+        return;
+    if (slot.srcs < GROUP_SPARSE) {
+      slot.src_hashes[slot.srcs++] = hash;
+      return;
+    }
+    registers.resize(registers.size() + HLL_REGISTERS, 0);
+    slot.sketch = registers.size() / HLL_REGISTERS;
+    for (unsigned int i = 0; i < slot.srcs; i++)
+      hll_add(&registers[(slot.sketch - 1) * HLL_REGISTERS],
+              slot.src_hashes[i]);
+  }
+  hll_add(&registers[(slot.sketch - 1) * HLL_REGISTERS], hash);
+}
+
+// Turn an aggregated group into a row of the table
+tentry_t *group_row(const group_slot_t &slot, const grouping_t &grouping,
+                    const flags_t &flags)
+{
+  tentry_t *row = new tentry_t;
+  char buf[NAMELEN];
+  size_t len;
+
+  row->family = slot.family;
+  row->src = slot.key;
+  memset(&row->dst, 0, sizeof(row->dst));
+  row->srcpt = slot.srcs;
+  row->dstpt = slot.conns;
+  row->l4proto = slot.mixed ? 0 : slot.l4proto;
+  row->tcpstate = row->icmp_type = row->icmp_code = 0;
+  row->icmp_id = row->zone = row->netns = 0;
+  row->mark = 0;
+  row->timeout = slot.ttl;
+  row->bytes = slot.bytes;
+  row->packets = slot.packets;
+  row->byte_rate = slot.byte_rate;
+  row->packet_rate = slot.packet_rate;
+  row->fresh = false;
+  row->ghost = 0;
+
+  // What the group is
+  uint32_t num;
+  memcpy(&num, slot.key.s6_addr, sizeof(num));
+  num = ntohl(num);
+  switch (grouping.by) {
+    case GROUP_SRC:
+    case GROUP_DST: {
+      unsigned int prefix = slot.family == AF_INET ? grouping.prefix4
+                                                   : grouping.prefix6;
+      if (prefix == (slot.family == AF_INET ? 32u : 128u)) {
+        if (flags.lookup)
+          resolve_host(slot.family, slot.key, row->sname);
+        else
+          row->sname.assign(buf, fmt_ip(buf, slot.family, slot.key));
+      } else {
+        len = fmt_ip(buf, slot.family, slot.key);
+        buf[len++] = '/';
+        len += fmt_uint(buf + len, prefix);
+        row->sname.assign(buf, len);
+      }
+      break;
+    }
+    case GROUP_SERVICE:
+      if (flags.lookup)
+        resolve_host(slot.family, slot.key, row->sname);
+      else
+        row->sname.assign(buf, fmt_ip(buf, slot.family, slot.key));
+      if (slot.l4proto == IPPROTO_TCP || slot.l4proto == IPPROTO_UDP) {
+        row->sname += ',';
+        row->sname.append(buf, fmt_uint(buf, slot.port & 0xffff));
+      }
+      break;
+    case GROUP_DPORT:
+      if (slot.l4proto == IPPROTO_TCP || slot.l4proto == IPPROTO_UDP) {
+        if (flags.lookup)
+          resolve_port(num & 0xffff, row->sname, proto_name(slot.l4proto));
+        else
+          row->sname.assign(buf, fmt_uint(buf, num & 0xffff));
+        row->sname += '/';
+        row->sname += proto_name(slot.l4proto);
+      } else {
+        row->sname = proto_name(slot.l4proto);
+      }
+      break;
+    case GROUP_PROTO:
+      row->sname = proto_name(slot.l4proto);
+      break;
+    case GROUP_STATE:
+      if (num < sizeof(states) / sizeof(states[0]))
+        row->sname = states[num];
+      else
+        row->sname = proto_name(slot.l4proto);
+      break;
+    case GROUP_MARK:
+      row->mark = num;
+      row->sname = "mark ";
+      row->sname.append(buf, fmt_uint(buf, num));
+      break;
+    case GROUP_NETNS:
+      row->netns = num >> 16;
+      row->zone = num & 0xffff;
+      row->sname.assign(buf, fmt_netns(buf, row->netns, row->zone));
+      break;
+  }
+  len = fmt_uint(buf, slot.conns);
+  buf[len++] = '/';
+  len += fmt_uint(buf + len, slot.srcs);
+  row->dname.assign(buf, len);
+  row->spname = row->dpname = "";
+
+  row->proto = slot.mixed ? "*" : proto_name(slot.l4proto);
+  row->ttl.assign(buf, fmt_ttl(buf, slot.ttl));
+
+  // The most common TCP states, most common first
+  const size_t nstates = sizeof(states) / sizeof(states[0]);
+  unsigned int order[nstates];
+  for (unsigned int i = 0; i < nstates; i++)
+    order[i] = i;
+  partial_sort(order, order + GROUP_STATES, order + nstates,
+               [&slot](unsigned int a, unsigned int b) {
+                 return slot.tcpstates[a] > slot.tcpstates[b];
+               });
+  row->state.clear();
+  for (unsigned int i = 0; i < GROUP_STATES; i++) {
+    if (!slot.tcpstates[order[i]])
+      break;
+    if (i)
+      row->state += ' ';
+    row->state += state_abbrevs[order[i]];
+    row->state += ':';
+    row->state.append(buf, fmt_uint(buf, slot.tcpstates[order[i]]));
+  }
+  return row;
 }
 
 /*
- * Prompt the user for something, and get an answer.
+ * Replace the states in 'stable' with one row per group, in a single pass
+ * over the table. Groups are found with a flat open-addressing hash table
+ * of indexes into 'groups', sized so it's never more than half full.
  */
-void get_input(WINDOW *win, string &input, const string &prompt,
-               const flags_t &flags)
+void group_table(vector<tentry_t*> &stable, const grouping_t &grouping,
+                 max_t &max, flags_t &flags)
+{
+  size_t size = 64;
+  while (size < stable.size() * 2)
+    size <<= 1;
+  vector<uint32_t> index(size, 0);
+  vector<group_slot_t> groups;
+  vector<uint8_t> registers;
+  group_slot_t probe;
+
+  for (const tentry_t *entry : stable) {
+    group_of(entry, grouping, probe);
+    size_t i = mix64(addr_hash(probe.family, probe.key) + probe.port)
+      & (size - 1);
+    while (index[i]) {
+      const group_slot_t &slot = groups[index[i] - 1];
+      if (slot.family == probe.family && slot.port == probe.port
+          && !memcmp(&slot.key, &probe.key, sizeof(probe.key)))
+        break;
+      i = (i + 1) & (size - 1);
+    }
+    if (!index[i]) {
+      group_slot_t slot;
+      memset(&slot, 0, sizeof(slot));
+      slot.family = probe.family;
+      slot.key = probe.key;
+      slot.port = probe.port;
+      slot.l4proto = entry->l4proto;
+      groups.push_back(slot);
+      index[i] = groups.size();
+    }
+
+    group_slot_t &slot = groups[index[i] - 1];
+    slot.conns++;
+    group_src(slot, registers, hll_hash(entry->family, entry->src));
+    if (entry->l4proto != slot.l4proto)
+      slot.mixed = true;
+    if (entry->l4proto == IPPROTO_TCP
+        && entry->tcpstate < sizeof(states) / sizeof(states[0]))
+      slot.tcpstates[entry->tcpstate]++;
+    if (entry->timeout > slot.ttl)
+      slot.ttl = entry->timeout;
+    slot.bytes += entry->bytes;
+    slot.packets += entry->packets;
+    if (flags.rates) {
+      slot.byte_rate += entry->byte_rate;
+      slot.packet_rate += entry->packet_rate;
+    }
+  }
+
+  clear_table(stable);
+  initialize_maxes(max, flags);
+  for (group_slot_t &slot : groups) {
+    // there can't be more sources than states, whatever the estimate says
+    if (slot.sketch)
+      slot.srcs = min(slot.conns,
+                      hll_count(&registers[(slot.sketch - 1) * HLL_REGISTERS]));
+    tentry_t *row = group_row(slot, grouping, flags);
+    if (row->sname.size() > max.src)
+      max.src = row->sname.size();
+    if (row->dname.size() > max.dst)
+      max.dst = row->dname.size();
+    if (row->proto.size() > max.proto)
+      max.proto = row->proto.size();
+    if (row->state.size() > max.state)
+      max.state = row->state.size();
+    uint64_t bytes = flags.rates ? row->byte_rate : row->bytes;
+    uint64_t packets = flags.rates ? row->packet_rate : row->packets;
+    if (digits(bytes) > max.bytes)
+      max.bytes = digits(bytes);
+    if (digits(packets) > max.packets)
+      max.packets = digits(packets);
+    stable.push_back(row);
+  }
+}
+
+void print_headers(const flags_t &flags, const string &format,
+                   const rowfmt_t &rowfmt,
+                   const string &sorting, const filters_t &filters,
+                   const counters_t &counts, const screensize_t &ssize,
+                   int table_size, WINDOW *mainwin)
 {
+  if (flags.single) {
+    out_write(stdout_buf, "IP Tables State Top -- Sort by: " + sorting + "\n");
+  } else {
+    wmove(mainwin, 0, 0);
+    wclrtoeol(mainwin);
+    wmove(mainwin,0, ssize.x/2-15);
+    wattron(mainwin, A_BOLD);
+    wprintw(mainwin, "IPTState - IPTables State Top\n");
+  
+    wprintw(mainwin, "Version: ");
+    wattroff(mainwin, A_BOLD);
+    wprintw(mainwin, "%-13s", VERSION);
+  
+    wattron(mainwin, A_BOLD);
+    wprintw(mainwin, "Sort: ");
+    wattroff(mainwin, A_BOLD);
+    wprintw(mainwin, "%-16s", sorting.c_str());
+    
+    wattron(mainwin, A_BOLD);
+    wprintw(mainwin, "b");
+    wattroff(mainwin, A_BOLD);
+    wprintw(mainwin, "%-19s", ": change sorting");
+
+    wattron(mainwin, A_BOLD);
+    wprintw(mainwin, "h");
+    wattroff(mainwin, A_BOLD);
+    wprintw(mainwin, "%-s\n", ": help");
+  }
 
   /*
-   * This function is here so that we can prompt and get an answer
-   * and the user can get an echo of what they're inputting. This is
-   * already a non-straight-forward thing to do in cbreak() mode, but
-   * it turns out that using pads makes it even more difficult.
-   *
-   * It's worth noting that I tried doin a simple waddch() and then
-   * prefresh as one would expect, but it didn't echo the chars.
-   * Because we're using pads I have to do a waddchar() and then
-   * a prefresh().
-   *
-   * Note, that the documentation says that if we're using waddchar()
-   * we shouldn't need any refresh, but it doesn't echo without it.
-   * This is probably because waddch() calls wrefresh() instead of
-   * prefresh().
+   * If enabled, print totals
    */
-  
-  input = "";
-  [[maybe_unused]] int x, y;
-  getmaxyx(stdscr, y, x);
-  WINDOW *cmd = subpad(win, 1, x, 0, 0);
-  if (!flags.nocolor)
-    wattron(cmd, COLOR_PAIR(4));
-  keypad(cmd, true);
-  wprintw(cmd, "%s", prompt.c_str());
-  wclrtoeol(cmd);
-  prefresh(cmd, 0, 0, 0, 0, 0, x);
+  if (flags.totals) {
+    if (flags.single)
+      out_printf(stdout_buf, TOTALS_FORMAT,
+                 table_size+counts.skipped+counts.dropped,
+                 counts.tcp, counts.udp, counts.icmp, counts.other,
+                 counts.skipped);
+    else if (!flags.changes)
+      wprintw(mainwin, TOTALS_FORMAT, table_size+counts.skipped+counts.dropped,
+              counts.tcp, counts.udp, counts.icmp, counts.other,
+              counts.skipped);
+    else {
+      // ghosts aren't states any more, and it all has to fit on one line
+      char line[256];
+      int len = snprintf(line, sizeof(line), TOTALS_FORMAT,
+                         table_size - counts.ghosts + counts.skipped
+                           + counts.dropped,
+                         counts.tcp, counts.udp, counts.icmp, counts.other,
+                         counts.skipped);
+      snprintf(line + len - 1, sizeof(line) - len + 1, CHANGES_FORMAT,
+               counts.opened, counts.closed);
+      len = strlen(line);
+      if (len > (int)ssize.x) {
+        line[ssize.x - 1] = '\n';
+        line[ssize.x] = '\0';
+      }
+      waddstr(mainwin, line);
+    }
+  }
 
+  /*
+   * If enabled, the performance status line (see stats_t)
+   */
+  if (flags.stats && !flags.single) {
+    string status;
+    stats_text(status);
+    if (status.size() >= ssize.x)
+      status.resize(ssize.x - 1);
+    wattron(mainwin, A_DIM);
+    wprintw(mainwin, "%s\n", status.c_str());
+    wattroff(mainwin, A_DIM);
+  }
 
-  int ch;
-  int charcount = 0;
-  echo();
-  nodelay(cmd,0);
+  /*
+   * If the table didn't fit in --max-memory, say what we're showing instead
+   */
+  if (mem.level >= MEM_TOPK) {
+    char notice[128];
+    if (mem.level == MEM_TOPK)
+      snprintf(notice, sizeof(notice), "Memory limit: showing the top %d "
+               "states by bytes, %u dropped\n", table_size, counts.dropped);
+    else
+      snprintf(notice, sizeof(notice), "Memory limit: showing a sample of %d "
+               "states, %u dropped\n", table_size, counts.dropped);
+    if (flags.single) {
+      out_write(stdout_buf, notice, strlen(notice));
+    } else {
+      wattron(mainwin, A_BOLD);
+      waddstr(mainwin, notice);
+      wattroff(mainwin, A_BOLD);
+    }
+  }
 
-  while (1) {
-    ch = wgetch(cmd);
-    switch (ch) {
-      case '\n':
-      // 7 is ^G
-      case 7:
-        if (ch == 7)
-          input = "";
-        if (!flags.nocolor)
-          wattroff(cmd, COLOR_PAIR(4));
-        delwin(cmd);
-        noecho();
-        wmove(win, 0, 0);
-        return;
-        break;
-      // on most platforms KEY_BACKSPACE will catch
-      // all backspaces...
-      case KEY_BACKSPACE:
-      // but on some platforms ncurses fails, so ensure we catch both 8 (0x8) and 127 (0x7e)
-      // which are the two valid backspace keycodes
-      case 8:
-      case 127:
-        if (charcount > 0) {
-          input = input.substr(0, input.size()-1);
-          wechochar(cmd, '\b');
-          wechochar(cmd, ' ');
-          wechochar(cmd, '\b');
-          charcount--;
-        }
-        break;
-      case ERR:
-        continue;
+  /*
+   * If we're looking back in --history, say when at
+   */
+  if (history.offset && !flags.single) {
+    char notice[128], when[16];
+    time_t time = history.deltas[history.offset - 1].time / 1000000;
+    strftime(when, sizeof(when), "%H:%M:%S", localtime(&time));
+    snprintf(notice, sizeof(notice), "History: %s, %u of %u snapshots back "
+             "('[' older, ']' newer)\n", when, history.offset,
+             (unsigned int)history.deltas.size());
+    wattron(mainwin, A_BOLD);
+    waddstr(mainwin, notice);
+    wattroff(mainwin, A_BOLD);
+  }
+
+  /*
+   * Destinations over the --syn-alert thresholds. Without a screen, these
+   * go to stderr instead, see syn_alert().
+   */
+  if (!flags.single) {
+    char notice[128], addr[NAMELEN];
+    for (unsigned int i = 0; i < synflood.alerts.size(); i++) {
+      const syn_slot_t &slot = synflood.alerts[i];
+      if (i == SYN_PANEL_LINES) {
+        snprintf(notice, sizeof(notice), "SYN flood: ... and %u more\n",
+                 (unsigned int)(synflood.alerts.size() - i));
+      } else {
+        addr[fmt_ip(addr, slot.family, slot.dst)] = '\0';
+        snprintf(notice, sizeof(notice), "SYN flood: %s has %u half-open "
+                 "states (%+" PRId64 "/s)\n", addr, slot.count, slot.growth);
+      }
+      wattron(mainwin, A_BOLD | A_REVERSE);
+      waddstr(mainwin, notice);
+      wattroff(mainwin, A_BOLD | A_REVERSE);
+      if (i == SYN_PANEL_LINES)
         break;
-      default:
-        input += ch;
-        charcount++;
-        wechochar(cmd, ch);
     }
-    prefresh(cmd, 0, 0, 0, 0, 0, x);
-  }
-}
-
-/*
- * Create a window with noticable colors (if colors are enabled)
- * and print a warning. Means curses_warning.
- */
-void c_warn(WINDOW *win, const string &warning, const flags_t &flags)
-{
-
-  /*
-   * This function is here so that we can warn a user in curses,
-   * usually about bad input.
-   */
-  
-  int x, y;
-  getmaxyx(stdscr, y, x);
-  WINDOW *warn = subpad(win, 1, x, 0, 0);
-  if (!flags.nocolor)
-    wattron(warn, COLOR_PAIR(4));
-  wprintw(warn, "%s", warning.c_str());
-  wprintw(warn, " Press any key to continue...");
-  wclrtoeol(warn);
-  prefresh(warn, 0, 0, 0, 0, 0, x);
-  while ((y = getch())) {
-    if (y != ERR) {
-      break;
+    if (!synflood.error.empty()) {
+      snprintf(notice, sizeof(notice), "SYN flood: %s\n",
+               synflood.error.c_str());
+      wattron(mainwin, A_BOLD | A_REVERSE);
+      waddstr(mainwin, notice);
+      wattroff(mainwin, A_BOLD | A_REVERSE);
+    }
+  }
+
+  /*
+   * The --churn panel, a line at a time so none of them wrap
+   */
+  if (churn.enabled && !flags.single) {
+    vector<string> lines;
+    churn_panel(lines);
+    for (string &line : lines) {
+      if (line.size() >= ssize.x)
+        line.resize(ssize.x - 1);
+      line += '\n';
+      if (&line == &lines[0])
+        wattron(mainwin, A_BOLD);
+      waddstr(mainwin, line.c_str());
+      wattroff(mainwin, A_BOLD);
+    }
+  }
+
+  /*
+   * If any, print filters
+   */
+  char tmp[NAMELEN];
+  if (flags.filter_src || flags.filter_dst || flags.filter_srcpt
+      || flags.filter_dstpt || flags.filter_mark || flags.filter_netns) {
+
+    if (flags.single) {
+      out_printf(stdout_buf, "Filters: ");
+    } else {
+      wattron(mainwin, A_BOLD);
+      wprintw(mainwin, "Filters: ");
+      wattroff(mainwin, A_BOLD);
+    }
+
+    bool printed_a_filter = false;
+
+    if (flags.filter_src) {
+      inet_ntop(filters.srcfam, &filters.src, tmp, NAMELEN-1);
+      if (flags.single)
+        out_printf(stdout_buf, "src: %s", tmp);
+      else
+        wprintw(mainwin, "src: %s", tmp);
+      if (filters.has_srcnet) {
+        if (flags.single)
+          out_printf(stdout_buf, "/%" PRIu8, filters.srcnet);
+        else
+          wprintw(mainwin, "/%" PRIu8, filters.srcnet);
+      }
+      printed_a_filter = true;
+    }
+    if (flags.filter_srcpt) {
+      if (printed_a_filter) {
+        if (flags.single)
+          out_printf(stdout_buf, ", ");
+        else
+          waddstr(mainwin, ", ");
+      }
+      if (flags.single)
+        out_printf(stdout_buf, "sport: %lu", filters.srcpt);
+      else
+        wprintw(mainwin, "sport: %lu", filters.srcpt);
+      printed_a_filter = true;
+    }
+    if (flags.filter_dst) {
+      if (printed_a_filter) {
+        if (flags.single)
+          out_printf(stdout_buf, ", ");
+        else
+          waddstr(mainwin, ", ");
+      }
+      inet_ntop(filters.dstfam, &filters.dst, tmp, NAMELEN-1);
+      if (flags.single)
+        out_printf(stdout_buf, "dst: %s", tmp);
+      else
+        wprintw(mainwin, "dst: %s", tmp);
+      if (filters.has_dstnet) {
+        if (flags.single)
+          out_printf(stdout_buf, "/%" PRIu8, filters.dstnet);
+        else
+          wprintw(mainwin, "/%" PRIu8, filters.dstnet);
+      }
+      printed_a_filter = true;
+    }
+    if (flags.filter_dstpt) {
+      if (printed_a_filter) {
+        if (flags.single)
+          out_printf(stdout_buf, ", ");
+        else
+          waddstr(mainwin, ", ");
+      }
+      if (flags.single)
+        out_printf(stdout_buf, "dport: %lu", filters.dstpt);
+      else
+        wprintw(mainwin, "dport: %lu", filters.dstpt);
+      printed_a_filter = true;
+    }
+    if (flags.filter_mark) {
+      if (printed_a_filter) {
+        if (flags.single)
+          out_printf(stdout_buf, ", ");
+        else
+          waddstr(mainwin, ", ");
+      }
+      if (flags.single)
+        out_printf(stdout_buf, "mark: 0x%x/0x%x", filters.mark,
+                   filters.markmask);
+      else
+        wprintw(mainwin, "mark: 0x%x/0x%x", filters.mark, filters.markmask);
+      printed_a_filter = true;
+    }
+    if (flags.filter_netns) {
+      if (printed_a_filter) {
+        if (flags.single)
+          out_printf(stdout_buf, ", ");
+        else
+          waddstr(mainwin, ", ");
+      }
+      const char *name = netns.spaces[filters.netns].name.c_str();
+      if (flags.single)
+        out_printf(stdout_buf, "netns: %s", name);
+      else
+        wprintw(mainwin, "netns: %s", name);
+      if (filters.has_zone) {
+        if (flags.single)
+          out_printf(stdout_buf, "/%u", filters.zone);
+        else
+          wprintw(mainwin, "/%u", filters.zone);
+      }
+      printed_a_filter = true;
+    }
+    if (flags.filter_inv) {
+      if (flags.single) {
+        out_printf(stdout_buf, " (Inverted)");
+      } else {
+        wprintw(mainwin, " (Inverted)");
+      }
     }
-    prefresh(warn, 0, 0, 0, 0, 0, x);
+    if (flags.single)
+      out_printf(stdout_buf, "\n");
+    else
+      wprintw(mainwin, "\n");
   }
-  if (!flags.nocolor)
-    wattroff(warn, COLOR_PAIR(4));
-  delwin(warn);
-  noecho();
-  wmove(win, 0, 0);
-  return;
-}
 
-/*
- * Initialize the max_t structure with some sane defaults. We'll grow
- * them later as needed.
- */
-void initialize_maxes(max_t &max, flags_t &flags)
-{
   /*
-   * For NO lookup:
-   * src/dst IP can be no bigger than 21 chars:
-   *    IP (max of 15) + colon (1) + port (max of 5) = 21
-   *
-   * For lookup:
-   * if it's a name, we start with the width of the header, and we can
-   * grow from there as needed.
+   * Print column headers - like printline(), the optional columns go on
+   * the end
    */
-  if (flags.lookup) {
-    max.src = 6;
-    max.dst = 11;
+  const char *names[9] = {
+    flags.group ? "Group" : flags.nat ? "Source (NAT)" : "Source",
+    flags.group ? "Conns/Srcs" : flags.nat ? "Destination (NAT)"
+                                           : "Destination",
+    "Prt", flags.group ? "States" : "State", "TTL", "", "", "", ""};
+  int n = 5;
+  if (show_netns(flags))
+    names[n++] = "Netns";
+  if (show_mark(flags))
+    names[n++] = "Mark";
+  // rowfmt has no fields for B and P if counters are off
+  names[n++] = flags.rates ? "B/s" : "B";
+  names[n++] = flags.rates ? "P/s" : "P";
+
+  if (flags.single) {
+    size_t lens[9];
+    for (int i = 0; i < 9; i++)
+      lens[i] = strlen(names[i]);
+    out_row(stdout_buf, rowfmt, names, lens);
   } else {
-    max.src = max.dst = 21;
+    wattron(mainwin, A_BOLD);
+    wprintw(mainwin, format.c_str(), names[0], names[1], names[2], names[3],
+            names[4], names[5], names[6], names[7], names[8]);
+    wattroff(mainwin, A_BOLD);
   }
-  /*
-   * The proto starts at 3, since tcp/udp are the most common, but will
-   * grow if we see bigger proto strings such as "ICMP".
-   */
-  max.proto = 3;
-  /*
-   * "ESTABLISHED" is generally the longest state, we almost always have
-   * several, so we'll start with this. It also looks really bad if state
-   * is changing size a lot, so we start with a common minumum.
-   */
-  max.state = 11;
-  // TTL we statically make 7: xxx:xx:xx
-  max.ttl = 9;
 
-  // Start with something sane
-  max.bytes = 2;
-  max.packets = 2;
 }
 
-/*
- * The actual work of handling a resize.
- */
-void handle_resize(WINDOW *&win, const flags_t &flags, screensize_t &ssize)
-{
-  if (flags.noscroll) {
-    endwin();
-    refresh();
-    return;
-  }
-
-  /*
-   * OK, the above case without pads is easy. But pads is tricker.
-   * In order to properly handle SIGWINCH we need to:
-   * 
-   *    - Tear down the pad (delwin)
-   *    - Reset the terminal settings to non-visual mode (endwin)
-   *    - Return to visual mode (refresh)
-   *    - Get the new size (getmaxyx)
-   *    - Rebuild the pad
-   *
-   * Note that we don't get the new size without the endwin/refresh
-   * and thus the new pad doesn't get built right, and everything wraps.
-   *
-   * This order must be preserved.
-   */
 
-  /*
-   * Tear down...
-   */
-  delwin(win);
-  endwin();
-  /*
-   * Start up...
-   */
-  refresh();
-  getmaxyx(stdscr, ssize.y, ssize.x);
-  win = newpad(NLINES, ssize.x);
-  keypad(win, true);
-  wmove(win, 0, 0);
+void truncate(string &string, int length, bool mark, char direction)
+{
+  int s = (direction == 'f') ? string.size() - length : 0;
 
-  return;
+  string = string.substr(s, length);
+  if (mark) {
+    int m = (direction == 'f') ? 0 : string.size() - 1;
+    string[m] = '+';
+  }
 }
 
 /*
- * Take in a 'curr' value, and delete a given conntrack
+ * Based on the format pre-chosen, truncate src/dst as needed, and then
+ * generate the host:port strings and drop them off in the src/dst string
+ * objects passed in.
  */
-void delete_state(WINDOW *&win, const tentry_t *entry, const flags_t &flags)
+void format_src_dst(tentry_t *table, string &src, string &dst,
+                      const flags_t &flags, const max_t &max)
 {
-  struct nfct_handle *cth;
-  struct nf_conntrack *ct;
-  cth = nfct_open(CONNTRACK, 0);
-  ct = nfct_new();
-  int ret;
-  string response;
-  char str[NAMELEN];
-  string src, dst;
-  src = inet_ntop(entry->family, (void *)&(entry->src), str, NAMELEN-1);
-  dst = inet_ntop(entry->family, (void *)&(entry->dst), str, NAMELEN-1);
+  // groups keep everything in sname and dname
+  bool have_port = !flags.group
+    && (table->proto == "tcp" || table->proto == "udp");
+  char direction;
+  unsigned int length;
 
-  ostringstream msg;
-  msg.str("");
-  msg << "Deleting state: ";
-  if (entry->proto == "tcp" || entry->proto == "udp") {
-    msg << src << ":" << entry->srcpt << " -> " << dst << ":" << entry->dstpt;
-  } else {
-    msg << src << " -> " << dst;
-  }
-  msg << " -- Are you sure? (y/n)";
-  get_input(win, response, msg.str(), flags);
+  // What length would we currently use?
+  length = table->sname.size();
+  if (have_port)
+    length += table->spname.size() + 1;
 
-  if (response != "y" && response != "Y" && response != "yes" &&
-    response != "YES" && response != "Yes") {
-    c_warn(win, "NOT deleting state.", flags);
-    return;
+  // If it's too long, figure out how room we have and truncate it
+  if (length > max.src) {
+    length = max.src;
+    if (have_port)
+      length -= 1 + table->spname.size();
+    direction = (flags.lookup) ? 'e' : 'f';
+    truncate(table->sname, length, flags.tag_truncate, direction);
   }
 
-  nfct_set_attr_u8(ct, ATTR_ORIG_L3PROTO, entry->family);
-
-  if (entry->family == AF_INET) {
-    nfct_set_attr(ct, ATTR_ORIG_IPV4_SRC, (void *)&(entry->src.s6_addr));
-    nfct_set_attr(ct, ATTR_ORIG_IPV4_DST, (void *)&(entry->dst.s6_addr));
-  } else if (entry->family == AF_INET6) {
-    nfct_set_attr(ct, ATTR_ORIG_IPV6_SRC, (void *)&(entry->src.s6_addr));
-    nfct_set_attr(ct, ATTR_ORIG_IPV6_DST, (void *)&(entry->dst.s6_addr));
+  // ... and repeat
+  length = table->dname.size();
+  if (have_port)
+    length += table->dpname.size() + 1;
+  if (length > max.dst) {
+    length = max.dst;
+    if (have_port)
+      length -= 1 + table->dpname.size();
+    direction = (flags.lookup) ? 'f' : 'e';
+    truncate(table->dname, length, flags.tag_truncate, direction);
   }
 
-  // undo our space optimization so the kernel can find the state.
-  protoent *pn;
-  if (entry->proto == "icmp6")
-    pn = getprotobyname("ipv6-icmp");
-  else
-    pn = getprotobyname(entry->proto.c_str());
-
-  nfct_set_attr_u8(ct, ATTR_ORIG_L4PROTO, pn->p_proto);
-
-  if (entry->proto == "tcp" || entry->proto == "udp") {
-    nfct_set_attr_u16(ct, ATTR_ORIG_PORT_SRC, htons(entry->srcpt));
-    nfct_set_attr_u16(ct, ATTR_ORIG_PORT_DST, htons(entry->dstpt));
-  } else if (entry->proto == "icmp" || entry->proto == "icmp6") {
-    string type, code, id, tmp;
-    split('/', entry->state, type, tmp);
-    split(' ', tmp, code, tmp);
-    split('(', tmp, tmp, id);
-    split(')', id, id, tmp);
-
-    nfct_set_attr_u8(ct, ATTR_ICMP_TYPE, atoi(type.c_str()));
-    nfct_set_attr_u8(ct, ATTR_ICMP_CODE, atoi(code.c_str()));
-    nfct_set_attr_u16(ct, ATTR_ICMP_ID, atoi(id.c_str()));
+  src = table->sname;
+  if (have_port) {
+    src += ':';
+    src += table->spname;
   }
-
-  ret = nfct_query(cth, NFCT_Q_DESTROY, ct);
-  if (ret < 0) {
-    string msg = "Failed to delete state: ";
-    msg += strerror(errno);
-    c_warn(win, msg, flags);
+  dst = table->dname;
+  if (have_port) {
+    dst += ':';
+    dst += table->dpname;
   }
-
 }
 
-
-/*
- * CORE FUNCTIONS
- */
-
 /*
- * Callback for conntrack
+ * Write a line for single-run mode into stdout_buf. See out_write().
  */
-int conntrack_hook(enum nf_conntrack_msg_type nf_type, struct nf_conntrack *ct,
-                   void *tmp)
+void write_line(tentry_t *table, const flags_t &flags, const rowfmt_t &rowfmt,
+                const max_t &max)
 {
+  string src, dst;
+  char b[20], p[20], m[20], ns[NETNS_WIDTH];
 
-  /*
-   * start by getting our struct back
-   */
-  struct hook_data *data = static_cast<struct hook_data *>(tmp);
-
-  /*
-   * and pull out the pieces
-   */
-  vector<tentry_t*> *stable = data->stable;
-  flags_t *flags = data->flags;
-  max_t *max = data->max;
-  counters_t *counts = data->counts;
-  const filters_t *filters = data->filters;
-
-  // our table entry
-  unique_ptr<tentry_t> entry(new tentry_t);
-
-  // some vars
-  struct protoent* pe = NULL;
-  unsigned int seconds, minutes, hours;
-  char ttlc[16];
-  ostringstream buffer;
-
-  /*
-   * Clear the entry
-   */
-  entry->sname = "";
-  entry->dname = "";
-  entry->srcpt = 0;
-  entry->dstpt = 0;
-  entry->proto = "";
-  entry->ttl = "";
-  entry->state = "";
-
-  /*
-   * First, we read stuff into the array that's always the
-   * same regardless of protocol
-   */
-
-  short int pr = nfct_get_attr_u8(ct, ATTR_ORIG_L4PROTO);
-  pe = getprotobynumber(pr);
-  if (pe == NULL) {
-    buffer << pr;
-    entry->proto = buffer.str();
-    buffer.str("");
-  } else {
-    entry->proto = pe->p_name;
-    /* 
-     * if proto is "ipv6-icmp" we can just say "icmp6" to save space...
-     * it's more common/standard anyway
-     */
-    if (entry->proto == "ipv6-icmp")
-      entry->proto = "icmp6";
-  }
-
-  // ttl
-  seconds = nfct_get_attr_u32(ct, ATTR_TIMEOUT);
-  minutes = seconds/60;
-  hours = minutes/60;
-  minutes = minutes%60;
-  seconds = seconds%60;
-  // Format it with snprintf and store it in the table
-  snprintf(ttlc, sizeof(ttlc), "%3u:%02u:%02u", hours, minutes, seconds);
-  entry->ttl = ttlc;
+  format_src_dst(table, src, dst, flags, max);
 
-  entry->family = nfct_get_attr_u8(ct, ATTR_ORIG_L3PROTO);
-  // Everything has addresses
-  if (entry->family == AF_INET) {
-    memcpy(entry->src.s6_addr, nfct_get_attr(ct, ATTR_ORIG_IPV4_SRC),
-           sizeof(uint8_t[16]));
-    memcpy(entry->dst.s6_addr, nfct_get_attr(ct, ATTR_ORIG_IPV4_DST),
-           sizeof(uint8_t[16]));
-  } else if (entry->family == AF_INET6) {
-    memcpy(entry->src.s6_addr, nfct_get_attr(ct, ATTR_ORIG_IPV6_SRC),
-           sizeof(uint8_t[16]));
-    memcpy(entry->dst.s6_addr, nfct_get_attr(ct, ATTR_ORIG_IPV6_DST),
-           sizeof(uint8_t[16]));
-  } else {
-    fprintf(stderr, "UNKNOWN FAMILY!\n");
-    exit(1);
+  // the optional columns go on the end, in the order of the format
+  const char *fields[9] = {src.c_str(), dst.c_str(), table->proto.c_str(),
+                           table->state.c_str(), table->ttl.c_str()};
+  size_t lens[9] = {src.size(), dst.size(), table->proto.size(),
+                    table->state.size(), table->ttl.size()};
+  int n = 5;
+  if (show_netns(flags)) {
+    fields[n] = ns;
+    lens[n++] = fmt_netns(ns, table->netns, table->zone);
   }
-
-  // Counters (summary, in + out)
-  entry->bytes = nfct_get_attr_u32(ct, ATTR_ORIG_COUNTER_BYTES) +
-          nfct_get_attr_u32(ct, ATTR_REPL_COUNTER_BYTES);
-  entry->packets = nfct_get_attr_u32(ct, ATTR_ORIG_COUNTER_PACKETS) +
-          nfct_get_attr_u32(ct, ATTR_REPL_COUNTER_PACKETS);
-
-  if (digits(entry->bytes) > max->bytes) {
-    max->bytes = digits(entry->bytes);
+  if (show_mark(flags)) {
+    fields[n] = m;
+    lens[n++] = fmt_uint(m, table->mark);
   }
-  if (digits(entry->packets) > max->packets) {
-    max->packets = digits(entry->packets);
+  if (flags.counters) {
+    fields[n] = b;
+    lens[n++] = fmt_uint(b, flags.rates ? table->byte_rate : table->bytes);
+    fields[n] = p;
+    lens[n++] = fmt_uint(p, flags.rates ? table->packet_rate : table->packets);
   }
+  out_row(stdout_buf, rowfmt, fields, lens);
+}
 
-  if (entry->proto.size() > max->proto)
-    max->proto = entry->proto.size();
-
-  // OK, proto dependent stuff
-  if (entry->proto == "tcp" || entry->proto == "udp") {
-    entry->srcpt = htons(nfct_get_attr_u16(ct, ATTR_ORIG_PORT_SRC));
-    entry->dstpt = htons(nfct_get_attr_u16(ct, ATTR_ORIG_PORT_DST));
-  }
+/*
+ * MACHINE-READABLE OUTPUT
+ *
+ * For --output json/csv/tsv/bin. Unlike the text output these are never
+ * truncated, don't depend on the screen size, and have raw numeric values
+ * rather than names, so scripts don't have to parse them back.
+ */
 
-  if (entry->proto == "tcp") {
-    entry->state = states[nfct_get_attr_u8(ct, ATTR_TCP_STATE)];
-    counts->tcp++;
-  } else if (entry->proto == "udp") {
-    entry->state = "";
-    counts->udp++;
-  } else if (entry->proto == "icmp" || entry->proto == "icmp6") {
-    buffer.str("");
-    buffer << (int)nfct_get_attr_u8(ct, ATTR_ICMP_TYPE) << "/"
-        << (int)nfct_get_attr_u8(ct, ATTR_ICMP_CODE) << " ("
-        << nfct_get_attr_u16(ct, ATTR_ICMP_ID) << ")";
-    entry->state = buffer.str();
-    counts->icmp++;
-    if (entry->state.size() > max->state)
-      max->state = entry->state.size();
-  } else {
-    counts->other++;
+/*
+ * Parse the argument to --output
+ */
+bool parse_output(const char *arg, int &output)
+{
+  static const char *names[] = {"text", "json", "csv", "tsv", "bin"};
+  for (int i = OUTPUT_TEXT; i <= OUTPUT_BIN; i++) {
+    if (!strcmp(arg, names[i])) {
+      output = i;
+      return true;
+    }
   }
+  return false;
+}
 
-  /*
-   * FILTERING
-   */
+void out_uint(outbuf_t &ob, uint64_t val)
+{
+  char tmp[20];
+  out_write(ob, tmp, fmt_uint(tmp, val));
+}
 
-  /*
-   * FIXME: Filtering needs to be pulled into it's own function.
-   */
-  struct in_addr lb;
-  struct in6_addr lb6;
-  inet_pton(AF_INET, "127.0.0.1", &lb);
-  inet_pton(AF_INET6, "::1", &lb6);
-  size_t entrysize = entry->family == AF_INET
-    ? sizeof(in_addr)
-    : sizeof(in6_addr);
-  if (flags->skiplb && (entry->family == AF_INET
-                        ? !memcmp(&(entry->src), &lb, sizeof(in_addr))
-                        : !memcmp(&(entry->src), &lb6, sizeof(in6_addr)))) {
-    counts->skipped++;
-    return NFCT_CB_CONTINUE;
-  }
+void out_addr(outbuf_t &ob, uint8_t family, const in6_addr &addr)
+{
+  char tmp[NAMELEN];
+  out_write(ob, tmp, fmt_ip(tmp, family, addr));
+}
 
-  if (flags->skipdns && (entry->dstpt == 53)) {
-    counts->skipped++;
-    return NFCT_CB_CONTINUE;
-  }
+// time in usec since the epoch as seconds with millisecond precision
+void out_time(outbuf_t &ob, uint64_t time)
+{
+  char tmp[8];
+  out_uint(ob, time / 1000000);
+  snprintf(tmp, sizeof(tmp), ".%03u", (unsigned int)(time / 1000 % 1000));
+  out_write(ob, tmp, 4);
+}
 
-  if (flags->filter_src && !filters->has_srcnet) {
-    if ((flags->filter_inv && !memcmp(&(entry->src), &(filters->src), entrysize)) || 
-        (!flags->filter_inv && memcmp(&(entry->src), &(filters->src), entrysize))) {
-      counts->skipped++;
-      return NFCT_CB_CONTINUE;
-    }
+void write_json(outbuf_t &ob, const tentry_t *entry, uint64_t time)
+{
+  out_write(ob, "{\"time\":");
+  out_time(ob, time);
+  out_write(ob, ",\"family\":");
+  out_uint(ob, entry->family == AF_INET ? 4 : 6);
+  out_write(ob, ",\"proto\":");
+  out_uint(ob, entry->l4proto);
+  out_write(ob, ",\"src\":\"");
+  out_addr(ob, entry->family, entry->src);
+  out_write(ob, "\",\"dst\":\"");
+  out_addr(ob, entry->family, entry->dst);
+  out_write(ob, "\"");
+  if (entry->proto == "tcp" || entry->proto == "udp") {
+    out_write(ob, ",\"sport\":");
+    out_uint(ob, entry->srcpt);
+    out_write(ob, ",\"dport\":");
+    out_uint(ob, entry->dstpt);
   }
-
-  if (flags->filter_src && filters->has_srcnet) {
-    if ((flags->filter_inv && match_netmask(entry->family, entry->src, filters->src, filters->srcnet)) || 
-        (!flags->filter_inv && !match_netmask(entry->family, entry->src, filters->src, filters->srcnet))) {
-      counts->skipped++;
-      return NFCT_CB_CONTINUE;
+  // the other side of a NATed state, translated or (with --nat) original
+  if (entry->nat) {
+    out_write(ob, entry->nat->swapped ? ",\"orig\":{\"src\":\""
+                                      : ",\"nat\":{\"src\":\"");
+    out_addr(ob, entry->family, entry->nat->src);
+    out_write(ob, "\",\"dst\":\"");
+    out_addr(ob, entry->family, entry->nat->dst);
+    out_write(ob, "\"");
+    if (entry->proto == "tcp" || entry->proto == "udp") {
+      out_write(ob, ",\"sport\":");
+      out_uint(ob, entry->nat->srcpt);
+      out_write(ob, ",\"dport\":");
+      out_uint(ob, entry->nat->dstpt);
     }
+    out_write(ob, "}");
   }
-
-  if (flags->filter_srcpt) {
-    if ((flags->filter_inv && entry->srcpt == filters->srcpt) || 
-        (!flags->filter_inv && entry->srcpt != filters->srcpt)) {
-      counts->skipped++;
-      return NFCT_CB_CONTINUE;
-    }
+  if (entry->proto == "tcp") {
+    out_write(ob, ",\"tcp_state\":");
+    out_uint(ob, entry->tcpstate);
+  } else if (entry->proto == "icmp" || entry->proto == "icmp6") {
+    out_write(ob, ",\"icmp_type\":");
+    out_uint(ob, entry->icmp_type);
+    out_write(ob, ",\"icmp_code\":");
+    out_uint(ob, entry->icmp_code);
+    out_write(ob, ",\"icmp_id\":");
+    out_uint(ob, entry->icmp_id);
   }
-
-  if (flags->filter_dst && !filters->has_dstnet) {
-    if ((flags->filter_inv && !memcmp(&(entry->dst), &(filters->dst), entrysize)) || 
-        (!flags->filter_inv && memcmp(&(entry->dst), &(filters->dst), entrysize))) {
-      counts->skipped++;
-      return NFCT_CB_CONTINUE;
+  out_write(ob, ",\"ttl\":");
+  out_uint(ob, entry->timeout);
+  out_write(ob, ",\"bytes\":");
+  out_uint(ob, entry->bytes);
+  out_write(ob, ",\"packets\":");
+  out_uint(ob, entry->packets);
+  out_write(ob, ",\"mark\":");
+  out_uint(ob, entry->mark);
+  out_write(ob, ",\"zone\":");
+  out_uint(ob, entry->zone);
+  if (netns.enabled) {
+    out_write(ob, ",\"netns\":\"");
+    for (char c : netns.spaces[entry->netns].name) {
+      if (c == '"' || c == '\\')
+        out_write(ob, "\\", 1);
+      out_write(ob, &c, 1);
     }
+    out_write(ob, "\"");
   }
+  out_write(ob, "}\n");
+}
 
-  if (flags->filter_dst && filters->has_dstnet) {
-    if ((flags->filter_inv && match_netmask(entry->family, entry->dst, filters->dst, filters->dstnet)) || 
-        (!flags->filter_inv && !match_netmask(entry->family, entry->dst, filters->dst, filters->dstnet))) {
-      counts->skipped++;
-      return NFCT_CB_CONTINUE;
-    }
-  }
+/*
+ * CSV and TSV share a layout, only the separator differs. Fields that
+ * don't apply to an entry's protocol are left empty. With --netns, there's
+ * a netns column at the end, like JSON's netns field.
+ */
+#define CSV_HEADER "time,family,proto,src,sport,dst,dport,tcp_state," \
+  "icmp_type,icmp_code,icmp_id,ttl,bytes,packets,mark,zone"
 
-  if (flags->filter_dstpt) {
-    if ((flags->filter_inv && entry->dstpt == filters->dstpt) || 
-        (!flags->filter_inv && entry->dstpt != filters->dstpt)) {
-      counts->skipped++;
-      return NFCT_CB_CONTINUE;
+void write_csv_header(outbuf_t &ob, char sep)
+{
+  string header = CSV_HEADER;
+  if (netns.enabled)
+    header += ",netns";
+  header += "\n";
+  replace(header.begin(), header.end(), ',', sep);
+  out_write(ob, header);
+}
+
+void write_csv(outbuf_t &ob, const tentry_t *entry, uint64_t time, char sep)
+{
+  bool have_port = entry->proto == "tcp" || entry->proto == "udp";
+  bool icmp = entry->proto == "icmp" || entry->proto == "icmp6";
+
+  out_time(ob, time);
+  out_write(ob, &sep, 1);
+  out_uint(ob, entry->family == AF_INET ? 4 : 6);
+  out_write(ob, &sep, 1);
+  out_uint(ob, entry->l4proto);
+  out_write(ob, &sep, 1);
+  out_addr(ob, entry->family, entry->src);
+  out_write(ob, &sep, 1);
+  if (have_port)
+    out_uint(ob, entry->srcpt);
+  out_write(ob, &sep, 1);
+  out_addr(ob, entry->family, entry->dst);
+  out_write(ob, &sep, 1);
+  if (have_port)
+    out_uint(ob, entry->dstpt);
+  out_write(ob, &sep, 1);
+  if (entry->proto == "tcp")
+    out_uint(ob, entry->tcpstate);
+  out_write(ob, &sep, 1);
+  if (icmp)
+    out_uint(ob, entry->icmp_type);
+  out_write(ob, &sep, 1);
+  if (icmp)
+    out_uint(ob, entry->icmp_code);
+  out_write(ob, &sep, 1);
+  if (icmp)
+    out_uint(ob, entry->icmp_id);
+  out_write(ob, &sep, 1);
+  out_uint(ob, entry->timeout);
+  out_write(ob, &sep, 1);
+  out_uint(ob, entry->bytes);
+  out_write(ob, &sep, 1);
+  out_uint(ob, entry->packets);
+  out_write(ob, &sep, 1);
+  out_uint(ob, entry->mark);
+  out_write(ob, &sep, 1);
+  out_uint(ob, entry->zone);
+  if (netns.enabled) {
+    out_write(ob, &sep, 1);
+    // namespace names can have anything but '/' in them, so quote if needed
+    const string &name = netns.spaces[entry->netns].name;
+    if (name.find_first_of(string(1, sep) + "\"\n") == string::npos) {
+      out_write(ob, name);
+    } else {
+      out_write(ob, "\"", 1);
+      for (char c : name) {
+        if (c == '"')
+          out_write(ob, "\"", 1);
+        out_write(ob, &c, 1);
+      }
+      out_write(ob, "\"", 1);
     }
   }
+  out_write(ob, "\n", 1);
+}
 
-  /*
-   * RESOLVE
-   */
-
-  // Resolve names - if necessary - or generate strings of address,
-  // and calculate max sizes
-  stringify_entry(entry.get(), *max, *flags);
+void write_bin_snap(outbuf_t &ob, uint32_t count, uint64_t time)
+{
+  bin_snap_t rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.len = sizeof(rec);
+  rec.type = BIN_SNAPSHOT;
+  rec.version = BIN_VERSION;
+  rec.count = count;
+  rec.time = time;
+  out_write(ob, (const char *)&rec, sizeof(rec));
+}
 
-  /*
-   * Add this to the array
-   */
-  stable->push_back(entry.release());
+void bin_from_entry(const tentry_t *entry, uint8_t type, bin_entry_t &rec)
+{
+  memset(&rec, 0, sizeof(rec));
+  rec.len = sizeof(rec);
+  rec.type = type;
+  rec.family = entry->family;
+  rec.l4proto = entry->l4proto;
+  rec.tcpstate = entry->tcpstate;
+  rec.icmp_type = entry->icmp_type;
+  rec.icmp_code = entry->icmp_code;
+  rec.sport = entry->srcpt;
+  rec.dport = entry->dstpt;
+  rec.icmp_id = entry->icmp_id;
+  rec.zone = entry->zone;
+  rec.ttl = entry->timeout;
+  rec.mark = entry->mark;
+  rec.bytes = entry->bytes;
+  rec.packets = entry->packets;
+  memcpy(rec.src, entry->src.s6_addr, 16);
+  memcpy(rec.dst, entry->dst.s6_addr, 16);
+}
 
-  return NFCT_CB_CONTINUE;
+void write_bin(outbuf_t &ob, const tentry_t *entry, uint8_t type)
+{
+  bin_entry_t rec;
+  bin_from_entry(entry, type, rec);
+  out_write(ob, (const char *)&rec, sizeof(rec));
 }
 
-/**
- * Nuke the tentry_t's we made before deleting the vector of pointers
+/*
+ * Write out a whole table in one of the machine-readable formats. 'first'
+ * is whether this is the first table we're writing, so we know whether
+ * the CSV/TSV header is needed.
  */
-void clear_table(vector<tentry_t*> &stable)
+void write_table(outbuf_t &ob, const vector<tentry_t*> &stable, int output,
+                 bool first)
 {
-  for (tentry_t* entry: stable) {
-    delete entry;
+  uint64_t time = now_usec(CLOCK_REALTIME);
+
+  switch (output) {
+    case OUTPUT_JSON:
+      for (const tentry_t *entry : stable)
+        write_json(ob, entry, time);
+      break;
+    case OUTPUT_CSV:
+    case OUTPUT_TSV:
+      {
+        char sep = (output == OUTPUT_CSV) ? ',' : '\t';
+        if (first)
+          write_csv_header(ob, sep);
+        for (const tentry_t *entry : stable)
+          write_csv(ob, entry, time, sep);
+      }
+      break;
+    case OUTPUT_BIN:
+      write_bin_snap(ob, stable.size(), time);
+      for (const tentry_t *entry : stable)
+        write_bin(ob, entry, BIN_ENTRY);
+      break;
   }
-  stable.clear();
+  out_flush(ob);
 }
 
-
 /*
- * This is the core of this program - build a table of states.
+ * TOP TALKERS
  *
- * For the new libnetfilter_conntrack code, the bulk of build_table was moved
- * to the conntrack callback function.
+ * --top answers "who has the most states" (and bytes) without keeping the
+ * table: like --stream, each state is looked at once as it's read and then
+ * forgotten, and all we keep is a Space-Saving summary per key. Each one
+ * is a fixed number of counters; a key that isn't counted yet takes over
+ * the smallest counter and inherits its count as possible error. So memory
+ * and the work per state stay the same however big the table gets, counts
+ * are never too low and at most 'error' too high, and anything with more
+ * than total / counters is guaranteed to be in there.
  */
-void build_table(flags_t &flags, const filters_t &filters, vector<tentry_t*>
-                 &stable, counters_t &counts, max_t &max)
-{
-  /*
-   * Variables
-   */
-  int res=0;
-  vector<string> fields(MAXFIELDS);
-  static struct nfct_handle *cth;
-  u_int8_t family = AF_UNSPEC;
 
-  /*
-   * This is the ugly struct for the nfct hook, that holds pointers to
-   * all of the things the callback will need to fill our table
-   */
-  struct hook_data hook;
-  hook.stable = &stable;
-  hook.flags = &flags;
-  hook.max = &max;
-  hook.counts = &counts;
-  hook.filters = &filters;
+static const char *top_names[TOP_KEYS] = {"src", "dst", "dport"};
+static const char *top_titles[TOP_KEYS] = {"Sources", "Destinations",
+                                           "Destination ports"};
 
-  /*
-   * Initialization
-   */
-  clear_table(stable);
+// Empty 'sum', keeping room for 'counters' keys
+void summary_init(summary_t &sum, size_t counters)
+{
+  size_t size = 64;
+  while (size < counters * 2)
+    size <<= 1;
+  sum.counters = counters;
+  sum.heap.clear();
+  sum.heap.reserve(counters);
+  sum.index.assign(size, 0);
+  sum.total = 0;
+}
 
-  counts.tcp = counts.udp = counts.icmp = counts.other = counts.skipped = 0;
+// Swap two counters in the heap, keeping the index pointing at them
+void summary_swap(summary_t &sum, size_t a, size_t b)
+{
+  swap(sum.heap[a], sum.heap[b]);
+  sum.index[sum.heap[a].slot] = a + 1;
+  sum.index[sum.heap[b].slot] = b + 1;
+}
 
-  cth = nfct_open(CONNTRACK, 0);
-  if (!cth) {
-    end_curses();
-    printf("ERROR: couldn't establish conntrack connection\n");
-    exit(2);
-  }
-  nfct_callback_register(cth, NFCT_T_ALL, conntrack_hook, (void *)&hook);
-  res = nfct_query(cth, NFCT_Q_DUMP, &family);
-  if (res < 0) {
-    end_curses();
-    printf("ERROR: Couldn't retreive conntrack table: %s\n", strerror(errno));
-    exit(2);
+void summary_down(summary_t &sum, size_t i)
+{
+  size_t n = sum.heap.size();
+  while (1) {
+    size_t least = i, left = 2 * i + 1, right = left + 1;
+    if (left < n && sum.heap[left].count < sum.heap[least].count)
+      least = left;
+    if (right < n && sum.heap[right].count < sum.heap[least].count)
+      least = right;
+    if (least == i)
+      return;
+    summary_swap(sum, i, least);
+    i = least;
   }
-  nfct_close(cth);
 }
 
-/*
- * This sorts the table based on the current sorting preference
- */
-void sort_table(const int &sortby, const bool &lookup, const int &sort_factor,
-                vector<tentry_t*> &stable, string &sorting)
+void summary_up(summary_t &sum, size_t i)
 {
-  switch (sortby) {
-    case SORT_SRC:
-      if (lookup) {
-        std::sort(stable.begin(), stable.end(), srcname_sort);
-        sorting = "SrcName";
-      } else {
-        std::sort(stable.begin(), stable.end(), src_sort);
-        sorting = "SrcIP";
-      }
-      break;
-
-    case SORT_SRC_PT:
-      std::sort(stable.begin(), stable.end(), srcpt_sort);
-      sorting = "SrcPort";
-      break;
-
-    case SORT_DST:
-      if (lookup) {
-        std::sort(stable.begin(), stable.end(), dstname_sort);
-        sorting = "DstName";
-      } else {
-        std::sort(stable.begin(), stable.end(), dst_sort);
-        sorting = "DstIP";
-      }
-      break;
+  while (i) {
+    size_t parent = (i - 1) / 2;
+    if (sum.heap[parent].count <= sum.heap[i].count)
+      return;
+    summary_swap(sum, i, parent);
+    i = parent;
+  }
+}
 
-    case SORT_DST_PT:
-      std::sort(stable.begin(), stable.end(), dstpt_sort);
-      sorting = "DstPort";
+// Find the index slot of a key, or the empty slot it would go in
+size_t summary_find(const summary_t &sum, uint8_t family, const in6_addr &key)
+{
+  size_t mask = sum.index.size() - 1;
+  size_t i = addr_hash(family, key) & mask;
+  while (sum.index[i]) {
+    const top_counter_t &counter = sum.heap[sum.index[i] - 1];
+    if (counter.family == family
+        && !memcmp(&counter.key, &key, sizeof(key)))
       break;
+    i = (i + 1) & mask;
+  }
+  return i;
+}
 
-    case SORT_PROTO:
-      std::sort(stable.begin(), stable.end(), proto_sort);
-      sorting = "Prt";
-      break;
+/*
+ * Empty index slot 'i', moving back whatever comes after it that would
+ * otherwise no longer be found - there are no tombstones, since keys come
+ * and go all the time.
+ */
+void summary_unindex(summary_t &sum, size_t i)
+{
+  size_t mask = sum.index.size() - 1;
+  sum.index[i] = 0;
+  for (size_t j = (i + 1) & mask; sum.index[j]; j = (j + 1) & mask) {
+    top_counter_t &counter = sum.heap[sum.index[j] - 1];
+    size_t home = addr_hash(counter.family, counter.key) & mask;
+    // it can move unless its home is between the hole and where it is
+    bool between = i < j ? (home > i && home <= j) : (home > i || home <= j);
+    if (between)
+      continue;
+    sum.index[i] = sum.index[j];
+    sum.index[j] = 0;
+    counter.slot = i;
+    i = j;
+  }
+}
 
-    case SORT_STATE:
-      std::sort(stable.begin(), stable.end(), state_sort);
-      sorting = "State";
-      break;
+void summary_add(summary_t &sum, uint8_t family, const in6_addr &key,
+                 uint64_t weight)
+{
+  if (!weight)
+    return;
+  sum.total += weight;
 
-    case SORT_TTL:
-      std::sort(stable.begin(), stable.end(), ttl_sort);
-      sorting = "TTL";
-      break;
+  size_t i = summary_find(sum, family, key);
+  if (sum.index[i]) {
+    size_t pos = sum.index[i] - 1;
+    sum.heap[pos].count += weight;
+    summary_down(sum, pos);
+    return;
+  }
 
-    case SORT_BYTES:
-      std::sort(stable.begin(), stable.end(), bytes_sort);
-      sorting = "Bytes";
-      break;
+  top_counter_t counter;
+  counter.family = family;
+  counter.key = key;
+  counter.count = weight;
+  counter.error = 0;
+  if (sum.heap.size() < sum.counters) {
+    counter.slot = i;
+    sum.heap.push_back(counter);
+    sum.index[i] = sum.heap.size();
+    summary_up(sum, sum.heap.size() - 1);
+    return;
+  }
 
-    case SORT_PACKETS:
-      std::sort(stable.begin(), stable.end(), packets_sort);
-      sorting = "Packets";
-      break;
+  // Full, so take over the smallest counter
+  counter.error = sum.heap[0].count;
+  counter.count += counter.error;
+  summary_unindex(sum, sum.heap[0].slot);
+  counter.slot = summary_find(sum, family, key);
+  sum.heap[0] = counter;
+  sum.index[counter.slot] = 1;
+  summary_down(sum, 0);
+}
 
-    default:
-      //we should never get here
-      sorting = "??unknown??";
-      break;
+// Start over for a new refresh
+void talkers_begin(talkers_t &talkers, const flags_t &flags)
+{
+  size_t counters = max((size_t)TOP_MIN_COUNTERS,
+                         (size_t)talkers.k * TOP_COUNTERS);
+  talkers.bytes = flags.counters;
+  talkers.states_seen = 0;
+  for (int i = 0; i < TOP_KEYS; i++) {
+    summary_init(talkers.states[i], counters);
+    summary_init(talkers.byte_counts[i],
+                 talkers.bytes ? counters : 0);
+  }
+}
 
-  } //switch
+// Count one state, see process_entry()
+void talkers_add(talkers_t &talkers, const tentry_t *entry,
+                 const flags_t &flags)
+{
+  in6_addr port;
+  memset(&port, 0, sizeof(port));
+  uint32_t num = htonl(entry->l4proto << 16 | entry->dstpt);
+  memcpy(port.s6_addr, &num, sizeof(num));
+
+  talkers.states_seen++;
+  summary_add(talkers.states[TOP_SRC], entry->family, entry->src, 1);
+  summary_add(talkers.states[TOP_DST], entry->family, entry->dst, 1);
+  summary_add(talkers.states[TOP_DPORT], 0, port, 1);
+  if (!talkers.bytes)
+    return;
+  uint64_t bytes = flags.rates ? entry->byte_rate : entry->bytes;
+  summary_add(talkers.byte_counts[TOP_SRC], entry->family, entry->src, bytes);
+  summary_add(talkers.byte_counts[TOP_DST], entry->family, entry->dst, bytes);
+  summary_add(talkers.byte_counts[TOP_DPORT], 0, port, bytes);
+}
 
-  if (sort_factor == -1)
-    sorting = sorting + " reverse";
+// The name to show for a counter's key
+void talker_name(const top_counter_t &counter, const flags_t &flags,
+                 string &name)
+{
+  char buf[NAMELEN];
 
+  if (counter.family) {
+    if (flags.lookup)
+      resolve_host(counter.family, counter.key, name);
+    else
+      name.assign(buf, fmt_ip(buf, counter.family, counter.key));
+    return;
+  }
+  uint32_t num;
+  memcpy(&num, counter.key.s6_addr, sizeof(num));
+  num = ntohl(num);
+  string proto = proto_name(num >> 16);
+  if (num >> 16 != IPPROTO_TCP && num >> 16 != IPPROTO_UDP) {
+    name = proto;
+    return;
+  }
+  if (flags.lookup)
+    resolve_port(num & 0xffff, name, proto);
+  else
+    name.assign(buf, fmt_uint(buf, num & 0xffff));
+  name += '/';
+  name += proto;
 }
 
-void print_headers(const flags_t &flags, const string &format,
-                   const string &sorting, const filters_t &filters,
-                   const counters_t &counts, const screensize_t &ssize,
-                   int table_size, WINDOW *mainwin)
+// The top 'k' counters of 'sum', biggest first
+void summary_top(const summary_t &sum, size_t k,
+                 vector<top_counter_t> &top)
 {
-  if (flags.single) {
-    cout << "IP Tables State Top -- Sort by: " << sorting << endl;
-  } else {
-    wmove(mainwin, 0, 0);
-    wclrtoeol(mainwin);
-    wmove(mainwin,0, ssize.x/2-15);
-    wattron(mainwin, A_BOLD);
-    wprintw(mainwin, "IPTState - IPTables State Top\n");
-  
-    wprintw(mainwin, "Version: ");
-    wattroff(mainwin, A_BOLD);
-    wprintw(mainwin, "%-13s", VERSION);
-  
-    wattron(mainwin, A_BOLD);
-    wprintw(mainwin, "Sort: ");
-    wattroff(mainwin, A_BOLD);
-    wprintw(mainwin, "%-16s", sorting.c_str());
-    
-    wattron(mainwin, A_BOLD);
-    wprintw(mainwin, "b");
-    wattroff(mainwin, A_BOLD);
-    wprintw(mainwin, "%-19s", ": change sorting");
+  top = sum.heap;
+  k = min(k, top.size());
+  partial_sort(top.begin(), top.begin() + k, top.end(),
+               [](const top_counter_t &a, const top_counter_t &b) {
+                 return a.count > b.count;
+               });
+  top.resize(k);
+}
 
-    wattron(mainwin, A_BOLD);
-    wprintw(mainwin, "h");
-    wattroff(mainwin, A_BOLD);
-    wprintw(mainwin, "%-s\n", ": help");
+void write_talkers_text(outbuf_t &ob, const talkers_t &talkers,
+                        const summary_t &sum, int key, const char *metric,
+                        const flags_t &flags)
+{
+  vector<top_counter_t> top;
+  string name;
+
+  summary_top(sum, talkers.k, top);
+  out_printf(ob, "%s by %s (total %" PRIu64 ", estimates at most %" PRIu64
+             " over):\n", top_titles[key], metric, sum.total,
+             sum.total / sum.counters);
+  out_printf(ob, "%-39s %15s %15s\n", "", "Estimate", "At least");
+  for (const top_counter_t &counter : top) {
+    talker_name(counter, flags, name);
+    out_printf(ob, "%-39s %15" PRIu64 " %15" PRIu64 "\n", name.c_str(),
+               counter.count, counter.count - counter.error);
   }
+  out_write(ob, "\n");
+}
 
-  /*
-   * If enabled, print totals
-   */
-  if (flags.totals) {
-    if (flags.single)
-      printf(TOTALS_FORMAT, table_size+counts.skipped, counts.tcp, counts.udp,
-             counts.icmp, counts.other, counts.skipped);
-    else
-      wprintw(mainwin, TOTALS_FORMAT, table_size+counts.skipped, counts.tcp,
-              counts.udp, counts.icmp, counts.other, counts.skipped);
+void write_talkers_json(outbuf_t &ob, const talkers_t &talkers,
+                        const summary_t &sum, const flags_t &flags)
+{
+  vector<top_counter_t> top;
+  string name;
+
+  summary_top(sum, talkers.k, top);
+  out_write(ob, "{\"total\":");
+  out_uint(ob, sum.total);
+  out_write(ob, ",\"items\":[");
+  for (size_t i = 0; i < top.size(); i++) {
+    talker_name(top[i], flags, name);
+    out_write(ob, i ? ",{\"key\":\"" : "{\"key\":\"");
+    out_write(ob, name);
+    out_write(ob, "\",\"count\":");
+    out_uint(ob, top[i].count);
+    out_write(ob, ",\"error\":");
+    out_uint(ob, top[i].error);
+    out_write(ob, "}");
   }
+  out_write(ob, "]}");
+}
 
-  /*
-   * If any, print filters
-   */
-  char tmp[NAMELEN];
-  if (flags.filter_src || flags.filter_dst || flags.filter_srcpt
-      || flags.filter_dstpt) {
-
-    if (flags.single) {
-      printf("Filters: ");
-    } else {
-      wattron(mainwin, A_BOLD);
-      wprintw(mainwin, "Filters: ");
-      wattroff(mainwin, A_BOLD);
+// Write out what we've found this refresh, see stream_table()
+void write_talkers(outbuf_t &ob, const talkers_t &talkers, int output,
+                   const flags_t &flags, uint64_t time)
+{
+  const char *metric = flags.rates ? "bytes/s" : "bytes";
+
+  if (output == OUTPUT_JSON) {
+    out_write(ob, "{\"time\":");
+    out_time(ob, time);
+    out_write(ob, ",\"states\":");
+    out_uint(ob, talkers.states_seen);
+    for (int i = 0; i < TOP_KEYS; i++) {
+      out_write(ob, ",\"");
+      out_write(ob, top_names[i]);
+      out_write(ob, "\":{\"states\":");
+      write_talkers_json(ob, talkers, talkers.states[i], flags);
+      if (talkers.bytes) {
+        out_write(ob, flags.rates ? ",\"byte_rate\":" : ",\"bytes\":");
+        write_talkers_json(ob, talkers, talkers.byte_counts[i], flags);
+      }
+      out_write(ob, "}");
     }
+    out_write(ob, "}\n");
+    return;
+  }
 
-    bool printed_a_filter = false;
+  for (int i = 0; i < TOP_KEYS; i++)
+    write_talkers_text(ob, talkers, talkers.states[i], i, "states", flags);
+  if (!talkers.bytes)
+    return;
+  for (int i = 0; i < TOP_KEYS; i++)
+    write_talkers_text(ob, talkers, talkers.byte_counts[i], i, metric, flags);
+}
 
-    if (flags.filter_src) {
-      inet_ntop(filters.srcfam, &filters.src, tmp, NAMELEN-1);
-      if (flags.single)
-        printf("src: %s", tmp);
-      else
-        wprintw(mainwin, "src: %s", tmp);
-      if (filters.has_srcnet) {
-        if (flags.single)
-          printf("/%" PRIu8, filters.srcnet);
-        else
-          wprintw(mainwin, "/%" PRIu8, filters.srcnet);
-      }
-      printed_a_filter = true;
-    }
-    if (flags.filter_srcpt) {
-      if (printed_a_filter) {
-        if (flags.single)
-          printf(", ");
-        else
-          waddstr(mainwin, ", ");
-      }
-      if (flags.single)
-        printf("sport: %lu", filters.srcpt);
-      else
-        wprintw(mainwin, "sport: %lu", filters.srcpt);
-      printed_a_filter = true;
-    }
-    if (flags.filter_dst) {
-      if (printed_a_filter) {
-        if (flags.single)
-          printf(", ");
-        else
-          waddstr(mainwin, ", ");
-      }
-      inet_ntop(filters.dstfam, &filters.dst, tmp, NAMELEN-1);
-      if (flags.single)
-        printf("dst: %s", tmp);
-      else
-        wprintw(mainwin, "dst: %s", tmp);
-      if (filters.has_dstnet) {
-        if (flags.single)
-          printf("/%" PRIu8, filters.dstnet);
-        else
-          wprintw(mainwin, "/%" PRIu8, filters.dstnet);
-      }
-      printed_a_filter = true;
-    }
-    if (flags.filter_dstpt) {
-      if (printed_a_filter) {
-        if (flags.single)
-          printf(", ");
-        else
-          waddstr(mainwin, ", ");
-      }
-      if (flags.single)
-        printf("dport: %lu", filters.dstpt);
-      else
-        wprintw(mainwin, "dport: %lu", filters.dstpt);
-      printed_a_filter = true;
+/*
+ * CHURN
+ *
+ * --churn watches states being created and destroyed as it happens, from
+ * conntrack's event stream rather than the table: it's usually churn, not
+ * the size of the table, that hurts a firewall. Each event is a handful of
+ * counter increments and a Space-Saving update for its destination, so the
+ * cost doesn't depend on the size of the table. Once a second the counts
+ * are folded into exponentially-weighted moving averages over about 1, 10
+ * and 60 seconds, like the load average.
+ */
+
+static const char *churn_protos[CHURN_PROTOS] = {"TCP", "UDP", "ICMP",
+                                                  "Other"};
+// time constants of the averages, in seconds
+static const double churn_periods[CHURN_AVERAGES] = {1, 10, 60};
+
+// Which of churn_t's per-protocol counters 'l4proto' goes in
+int churn_proto(uint8_t l4proto)
+{
+  switch (l4proto) {
+    case IPPROTO_TCP:
+      return 0;
+    case IPPROTO_UDP:
+      return 1;
+    case IPPROTO_ICMP:
+    case IPPROTO_ICMPV6:
+      return 2;
+  }
+  return 3;
+}
+
+/*
+ * Catch up to 'now': fold each second that's gone by into the averages,
+ * and start a new per-destination window every CHURN_WINDOW seconds.
+ */
+void churn_tick(uint64_t now)
+{
+  if (!churn.second) {
+    churn.second = churn.window = now;
+    return;
+  }
+  for (unsigned int n = 0; now >= churn.second + 1000000; n++) {
+    // after a long pause, the averages have long since decayed to nothing
+    if (n == CHURN_CATCHUP) {
+      memset(churn.avg, 0, sizeof(churn.avg));
+      churn.second = now;
+      break;
     }
-    if (flags.filter_inv) {
-      if (flags.single) {
-        printf(" (Inverted)");
-      } else {
-        wprintw(mainwin, " (Inverted)");
+    for (int kind = 0; kind < 2; kind++) {
+      for (int i = 0; i <= CHURN_PROTOS; i++) {
+        double count = churn.count[kind][i];
+        for (int j = 0; j < CHURN_AVERAGES; j++) {
+          double &avg = churn.avg[kind][i][j];
+          // start from the first second, rather than ramping up from 0
+          if (!churn.primed)
+            avg = count;
+          else
+            avg += (count - avg) * (1 - exp(-1 / churn_periods[j]));
+        }
       }
     }
-    if (flags.single)
-      printf("\n");
-    else
-      wprintw(mainwin, "\n");
+    memset(churn.count, 0, sizeof(churn.count));
+    churn.primed = true;
+    churn.second += 1000000;
   }
 
-  /*
-   * Print column headers
-   */
-  if (flags.single) {
-    if (flags.counters) 
-      printf(format.c_str(), "Source", "Destination", "Prt", "State", "TTL",
-             "B", "P");
-    else
-      printf(format.c_str(), "Source", "Destination", "Prt", "State", "TTL");
-  } else {
-    wattron(mainwin, A_BOLD);
-    if (flags.counters)
-      wprintw(mainwin, format.c_str(), "Source", "Destination", "Prt",
-              "State", "TTL", "B", "P");
-    else
-      wprintw(mainwin, format.c_str(), "Source", "Destination", "Prt",
-              "State", "TTL");
-    wattroff(mainwin, A_BOLD);
+  uint64_t window = CHURN_WINDOW * 1000000ULL;
+  if (now < churn.window + window)
+    return;
+  for (int kind = 0; kind < 2; kind++) {
+    swap(churn.last_dsts[kind], churn.dsts[kind]);
+    summary_init(churn.dsts[kind], CHURN_COUNTERS);
   }
-
+  // if no events woke us for a whole window, the last one is empty
+  if (now >= churn.window + 2 * window)
+    for (int kind = 0; kind < 2; kind++)
+      summary_init(churn.last_dsts[kind], CHURN_COUNTERS);
+  churn.window = now - (now - churn.window) % window;
+  churn.have_last = true;
 }
 
+// Callback for conntrack events, see churn_read()
+int churn_hook(enum nf_conntrack_msg_type nf_type, struct nf_conntrack *ct,
+               void *tmp)
+{
+  int kind;
+  if (nf_type == NFCT_T_NEW)
+    kind = CHURN_NEW;
+  else if (nf_type == NFCT_T_DESTROY)
+    kind = CHURN_DESTROY;
+  else
+    return NFCT_CB_CONTINUE;
 
-void truncate(string &string, int length, bool mark, char direction)
+  uint8_t family = nfct_get_attr_u8(ct, ATTR_ORIG_L3PROTO);
+  in6_addr dst;
+  memset(&dst, 0, sizeof(dst));
+  if (family == AF_INET)
+    memcpy(dst.s6_addr, nfct_get_attr(ct, ATTR_ORIG_IPV4_DST),
+           sizeof(in_addr));
+  else if (family == AF_INET6)
+    memcpy(dst.s6_addr, nfct_get_attr(ct, ATTR_ORIG_IPV6_DST),
+           sizeof(in6_addr));
+
+  churn.count[kind][0]++;
+  churn.count[kind][1 + churn_proto(nfct_get_attr_u8(ct, ATTR_ORIG_L4PROTO))]++;
+  summary_add(churn.dsts[kind], family, dst, 1);
+  return NFCT_CB_CONTINUE;
+}
+
+/*
+ * Subscribe to conntrack's NEW and DESTROY events. The socket is
+ * non-blocking so churn_read() can take whatever's there and get back to
+ * the keyboard, and gets a big buffer so a burst doesn't overflow it
+ * between reads.
+ */
+bool churn_open()
 {
-  int s = (direction == 'f') ? string.size() - length : 0;
+  churn.cth = nfct_open(CONNTRACK, NF_NETLINK_CONNTRACK_NEW
+                                     | NF_NETLINK_CONNTRACK_DESTROY);
+  if (!churn.cth)
+    return false;
+  nfct_callback_register(churn.cth,
+                         (nf_conntrack_msg_type)(NFCT_T_NEW | NFCT_T_DESTROY),
+                         churn_hook, NULL);
+  churn.fd = nfct_fd(churn.cth);
+  if (churn.fd < 0)
+    return false;
+  fcntl(churn.fd, F_SETFL, fcntl(churn.fd, F_GETFL) | O_NONBLOCK);
+  int size = CHURN_RCVBUF;
+  // the FORCE version needs CAP_NET_ADMIN, which we usually have
+  if (setsockopt(churn.fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)))
+    setsockopt(churn.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+  for (int kind = 0; kind < 2; kind++) {
+    summary_init(churn.dsts[kind], CHURN_COUNTERS);
+    summary_init(churn.last_dsts[kind], CHURN_COUNTERS);
+  }
+  churn.enabled = true;
+  return true;
+}
 
-  string = string.substr(s, length);
-  if (mark) {
-    int m = (direction == 'f') ? 0 : string.size() - 1;
-    string[m] = '+';
+// Read all the events that are waiting, see the main loop
+void churn_read()
+{
+  churn_tick(now_usec());
+  while (nfct_catch(churn.cth) < 0) {
+    // the kernel had to drop some, but the socket is still good
+    if (errno == ENOBUFS) {
+      churn.overruns++;
+      continue;
+    }
+    break;
   }
 }
 
+// Format an average, with a decimal place when it's small
+size_t fmt_churn(char *buf, size_t size, double rate)
+{
+  return snprintf(buf, size, rate < 10 ? "%.1f" : "%.0f", rate);
+}
+
 /*
- * Based on the format pre-chosen, truncate src/dst as needed, and then
- * generate the host:port strings and drop them off in the src/dst string
- * objects passed in.
+ * The lines of the churn panel above the table: overall averages, the 10
+ * second averages per protocol, and the destinations with the most new
+ * states in the last complete CHURN_WINDOW.
  */
-void format_src_dst(tentry_t *table, string &src, string &dst,
-                      const flags_t &flags, const max_t &max)
+void churn_panel(vector<string> &lines)
 {
-  ostringstream buffer;
-  bool have_port = table->proto == "tcp" || table->proto == "udp";
-  char direction;
-  unsigned int length;
+  char buf[NAMELEN], a[32], b[32];
+  string line;
+
+  churn_tick(now_usec());
+  lines.clear();
+
+  line = "Churn (new/closed per sec)";
+  for (int j = 0; j < CHURN_AVERAGES; j++) {
+    fmt_churn(a, sizeof(a), churn.avg[CHURN_NEW][0][j]);
+    fmt_churn(b, sizeof(b), churn.avg[CHURN_DESTROY][0][j]);
+    snprintf(buf, sizeof(buf), "  %.0fs: %s/%s", churn_periods[j], a, b);
+    line += buf;
+  }
+  if (churn.overruns) {
+    snprintf(buf, sizeof(buf), "  (%" PRIu64 " overruns)", churn.overruns);
+    line += buf;
+  }
+  lines.push_back(line);
+
+  line = " ";
+  for (int i = 0; i < CHURN_PROTOS; i++) {
+    fmt_churn(a, sizeof(a), churn.avg[CHURN_NEW][i + 1][1]);
+    fmt_churn(b, sizeof(b), churn.avg[CHURN_DESTROY][i + 1][1]);
+    snprintf(buf, sizeof(buf), " %s: %s/%s", churn_protos[i], a, b);
+    line += buf;
+  }
+  lines.push_back(line);
+
+  snprintf(buf, sizeof(buf), "  Top destinations (last %ds):", CHURN_WINDOW);
+  line = buf;
+  vector<top_counter_t> top;
+  summary_top(churn.last_dsts[CHURN_NEW], CHURN_TOP, top);
+  if (!churn.have_last)
+    line += " -";
+  for (const top_counter_t &counter : top) {
+    const summary_t &gone = churn.last_dsts[CHURN_DESTROY];
+    size_t i = summary_find(gone, counter.family, counter.key);
+    uint64_t closed = gone.index[i] ? gone.heap[gone.index[i] - 1].count : 0;
+    line += ' ';
+    line.append(buf, fmt_ip(buf, counter.family, counter.key));
+    fmt_churn(a, sizeof(a), (double)counter.count / CHURN_WINDOW);
+    fmt_churn(b, sizeof(b), (double)closed / CHURN_WINDOW);
+    snprintf(buf, sizeof(buf), " %s/%s", a, b);
+    line += buf;
+  }
+  lines.push_back(line);
+}
 
-  // What length would we currently use?
-  length = table->sname.size();
-  if (have_port)
-    length += table->spname.size() + 1;
+/*
+ * STREAMING
+ *
+ * With --stream we never build a table: every state is written out from
+ * conntrack_hook() as soon as we get it, so memory use doesn't depend on
+ * the size of the table and output starts immediately. The price is that
+ * there's no sorting, text columns are fixed-width, and the totals come
+ * at the end instead of the top.
+ */
 
-  // If it's too long, figure out how room we have and truncate it
-  if (length > max.src) {
-    length = max.src;
-    if (have_port)
-      length -= 1 + table->spname.size();
-    direction = (flags.lookup) ? 'e' : 'f';
-    truncate(table->sname, length, flags.tag_truncate, direction);
+// Write out one state, see conntrack_hook()
+void stream_entry(stream_t &stream, tentry_t *entry, const flags_t &flags)
+{
+  switch (stream.output) {
+    case OUTPUT_TEXT:
+      write_line(entry, flags, stream.rowfmt, stream.max);
+      break;
+    case OUTPUT_JSON:
+      write_json(stdout_buf, entry, stream.time);
+      break;
+    case OUTPUT_CSV:
+      write_csv(stdout_buf, entry, stream.time, ',');
+      break;
+    case OUTPUT_TSV:
+      write_csv(stdout_buf, entry, stream.time, '\t');
+      break;
+    case OUTPUT_BIN:
+      write_bin(stdout_buf, entry, BIN_ENTRY);
+      break;
   }
+}
 
-  // ... and repeat
-  length = table->dname.size();
-  if (have_port)
-    length += table->dpname.size() + 1;
-  if (length > max.dst) {
-    length = max.dst;
-    if (have_port)
-      length -= 1 + table->dpname.size();
-    direction = (flags.lookup) ? 'f' : 'e';
-    truncate(table->dname, length, flags.tag_truncate, direction);
+/*
+ * Like determine_format() with --no-dynamic, but with room for counters,
+ * since we can't look at the table to see how wide they need to be.
+ */
+void stream_format(const flags_t &flags, max_t &max, string &format)
+{
+  max.src = DEFAULT_SRC;
+  max.dst = DEFAULT_DST;
+  max.proto = DEFAULT_PROTO;
+  max.state = DEFAULT_STATE;
+  max.ttl = DEFAULT_TTL;
+  max.bytes = STREAM_BYTES;
+  max.packets = STREAM_PACKETS;
+  // the widest a mark and a namespace can be
+  max.mark = 10;
+  max.netns = NETNS_WIDTH;
+
+  ostringstream buffer;
+  buffer << "\%-" << max.src << "s \%-" << max.dst << "s \%-" << max.proto
+    << "s \%-" << max.state << "s \%-" << max.ttl << "s";
+  if (show_netns(flags))
+    buffer << " \%-" << max.netns << "s";
+  if (show_mark(flags))
+    buffer << " \%-" << max.mark << "s";
+  if (flags.counters)
+    buffer << " \%-" << max.bytes << "s \%-" << max.packets << "s";
+  buffer << "\n";
+  format = buffer.str();
+}
+
+/*
+ * Dump the state table straight to stdout. 'first' is as for
+ * write_table(). With 'talkers' (--top), write out the top talkers instead
+ * of the states.
+ */
+void stream_table(flags_t &flags, const filters_t &filters,
+                  counters_t &counts, source_t &source, int output, bool first,
+                  talkers_t *talkers = NULL)
+{
+  stream_t stream;
+  stream.output = output;
+  stream.time = now_usec(CLOCK_REALTIME);
+  stream.talkers = talkers;
+  if (talkers)
+    talkers_begin(*talkers, flags);
+
+  switch (talkers ? -1 : output) {
+    case OUTPUT_TEXT:
+      {
+        // totals aren't known until the end
+        flags_t hdr_flags = flags;
+        hdr_flags.totals = false;
+        string format;
+        screensize_t ssize = {0, 0};
+        stream_format(flags, stream.max, format);
+        parse_format(format, stream.rowfmt);
+        print_headers(hdr_flags, format, stream.rowfmt, "none (streaming)",
+                      filters, counts, ssize, 0, NULL);
+      }
+      break;
+    case OUTPUT_CSV:
+    case OUTPUT_TSV:
+      if (first)
+        write_csv_header(stdout_buf, output == OUTPUT_CSV ? ',' : '\t');
+      break;
+    case OUTPUT_BIN:
+      write_bin_snap(stdout_buf, BIN_COUNT_UNKNOWN, stream.time);
+      break;
   }
 
-  buffer << table->sname;
-  if (have_port)
-    buffer << ":" << table->spname;
-  src = buffer.str();
-  buffer.str("");
-  buffer << table->dname;
-  if (have_port)
-    buffer << ":" << table->dpname;
-  dst = buffer.str();
-  buffer.str("");
+  /*
+   * conntrack_hook() still wants somewhere to keep track of field sizes
+   * and a table, even though it won't put anything in it.
+   */
+  max_t scratch;
+  vector<tentry_t*> stable;
+  initialize_maxes(scratch, flags);
+  build_table(flags, filters, stable, counts, scratch, source, &stream);
+
+  if (talkers)
+    write_talkers(stdout_buf, *talkers, output, flags, stream.time);
+  if (output == OUTPUT_TEXT && flags.totals)
+    out_printf(stdout_buf, TOTALS_FORMAT,
+               counts.tcp + counts.udp + counts.icmp + counts.other,
+               counts.tcp, counts.udp, counts.icmp, counts.other,
+               counts.skipped);
+  out_flush(stdout_buf);
 }
 
 /*
- * An abstraction of priting a line for both single/curses modes
+ * An abstraction of priting a line for curses mode
  */
 void printline(tentry_t *table, const flags_t &flags, const string &format,
                const max_t &max, WINDOW *mainwin, const bool curr)
 {
-  ostringstream buffer;
-  buffer.str("");
-  string src, dst, b, p;
-  
+  string src, dst;
+  char b[21], p[21], m[21], ns[NETNS_WIDTH + 1];
+
   // Generate strings for src/dest, truncating and marking as necessary
   format_src_dst(table, src, dst, flags, max);
 
+  /*
+   * The optional columns go on the end, in the order of the format. We
+   * always pass all of them - printf() ignores any it doesn't use.
+   */
+  const char *fields[9] = {src.c_str(), dst.c_str(), table->proto.c_str(),
+                           table->state.c_str(), table->ttl.c_str(), "", "",
+                           "", ""};
+  int n = 5;
+  if (show_netns(flags)) {
+    ns[fmt_netns(ns, table->netns, table->zone)] = '\0';
+    fields[n++] = ns;
+  }
+  if (show_mark(flags)) {
+    m[fmt_uint(m, table->mark)] = '\0';
+    fields[n++] = m;
+  }
   if (flags.counters) {
-    buffer << table->bytes;
-    b = buffer.str();
-    buffer.str("");
-    buffer << table->packets;
-    p = buffer.str();
-    buffer.str("");
+    b[fmt_uint(b, flags.rates ? table->byte_rate : table->bytes)] = '\0';
+    p[fmt_uint(p, flags.rates ? table->packet_rate : table->packets)] = '\0';
+    fields[n++] = b;
+    fields[n++] = p;
   }
-    
-  if (flags.single) {
-    if (flags.counters)
-      printf(format.c_str(), src.c_str(), dst.c_str(), table->proto.c_str(),
-             table->state.c_str(), table->ttl.c_str(), b.c_str(), p.c_str());
-    else
-      printf(format.c_str(), src.c_str(), dst.c_str(), table->proto.c_str(),
-             table->state.c_str(), table->ttl.c_str());
-  } else {
-    int color = 0;
-    if (!flags.nocolor) {
-      if (table->proto == "tcp")
-        color = 1;
-      else if (table->proto == "udp")
-        color = 2;
-      else if (table->proto == "icmp" || table->proto == "icmp6")
-        color = 3;
-      if (curr)
-        color += 4;
-      wattron(mainwin, COLOR_PAIR(color));
-    }
-    if (flags.counters)
-      wprintw(mainwin, format.c_str(), src.c_str(), dst.c_str(),
-              table->proto.c_str(), table->state.c_str(), table->ttl.c_str(),
-              b.c_str(), p.c_str());
-    else
-      wprintw(mainwin, format.c_str(), src.c_str(), dst.c_str(),
-              table->proto.c_str(), table->state.c_str(), table->ttl.c_str());
 
-    if (!flags.nocolor && color != 0)
-      wattroff(mainwin, COLOR_PAIR(color));
+  int color = 0;
+  if (!flags.nocolor) {
+    if (table->proto == "tcp")
+      color = 1;
+    else if (table->proto == "udp")
+      color = 2;
+    else if (table->proto == "icmp" || table->proto == "icmp6")
+      color = 3;
+    if (curr)
+      color += 4;
+    else if (table->fresh)
+      color = 8;
+    wattron(mainwin, COLOR_PAIR(color));
+  } else if (table->fresh) {
+    wattron(mainwin, A_BOLD);
   }
+  if (table->ghost)
+    wattron(mainwin, A_DIM);
+  wprintw(mainwin, format.c_str(), fields[0], fields[1], fields[2], fields[3],
+          fields[4], fields[5], fields[6], fields[7], fields[8]);
+
+  if (!flags.nocolor && color != 0)
+    wattroff(mainwin, COLOR_PAIR(color));
+  wattroff(mainwin, A_BOLD | A_DIM);
+}
+
+/*
+ * Fingerprint everything that goes into drawing 'entry' on a line: the
+ * entry's fields, whether it's highlighted, and the layout (format and
+ * widths) it'll be drawn with.
+ */
+uint64_t row_hash(const tentry_t *entry, uint64_t layout, const bool curr)
+{
+  uint64_t hash = fnv_hash(&curr, sizeof(curr), layout);
+  hash = fnv_hash(entry->sname, hash);
+  hash = fnv_hash(entry->spname, hash);
+  hash = fnv_hash(entry->dname, hash);
+  hash = fnv_hash(entry->dpname, hash);
+  hash = fnv_hash(entry->proto, hash);
+  hash = fnv_hash(entry->state, hash);
+  hash = fnv_hash(entry->ttl, hash);
+  hash = fnv_hash(&entry->bytes, sizeof(entry->bytes), hash);
+  hash = fnv_hash(&entry->packets, sizeof(entry->packets), hash);
+  hash = fnv_hash(&entry->byte_rate, sizeof(entry->byte_rate), hash);
+  hash = fnv_hash(&entry->packet_rate, sizeof(entry->packet_rate), hash);
+  hash = fnv_hash(&entry->fresh, sizeof(entry->fresh), hash);
+  hash = fnv_hash(&entry->ghost, sizeof(entry->ghost), hash);
+  hash = fnv_hash(&entry->mark, sizeof(entry->mark), hash);
+  hash = fnv_hash(&entry->netns, sizeof(entry->netns), hash);
+  hash = fnv_hash(&entry->zone, sizeof(entry->zone), hash);
+  return hash;
+}
+
+/*
+ * Forget what's on the screen, so the next print_table() redraws every
+ * line. Needed whenever something other than print_table() draws on
+ * mainwin, or the screen changes size.
+ */
+void invalidate_rows(rowcache_t &cache)
+{
+  cache.top = -1;
+  cache.lines.clear();
 }
 
 /*
  * This does all the work of actually printing the table including
  * various bits of formatting. It handles both curses and non-curses runs.
+ *
+ * In curses mode we only draw the 'rows' entries starting at 'first' - i.e.
+ * what's actually on the screen - so the cost of a redraw depends on the
+ * size of the terminal, not the size of the table. In single mode we print
+ * everything.
+ *
+ * In curses mode we also remember a fingerprint of each line we drew in
+ * 'cache'. If the same line would be drawn again exactly the same way, we
+ * skip it entirely - no formatting and no wprintw(). For the lines we do
+ * redraw, curses only sends the cells that actually changed (usually the TTL
+ * and counters), so a quiet table costs almost nothing to refresh, which
+ * matters a lot over a slow ssh link.
  */
 void print_table(vector<tentry_t*> &stable, const flags_t &flags,
                  const string &format, const string &sorting,
                  const filters_t &filters, const counters_t &counts,
                  const screensize_t &ssize, const max_t &max, WINDOW *mainwin,
-                 unsigned int &curr)
+                 unsigned int first, unsigned int rows,
+                 const unsigned int &curr, rowcache_t *cache)
 {
+  /*
+   * In single mode we parse the format once here, rather than having
+   * printf() do it for every line. See out_row().
+   */
+  rowfmt_t rowfmt;
+  if (flags.single)
+    parse_format(format, rowfmt);
+
   /*
    * Print headers
    */
-  print_headers(flags, format, sorting, filters, counts, ssize, stable.size(),
-                mainwin);
+  print_headers(flags, format, rowfmt, sorting, filters, counts, ssize,
+                stable.size(), mainwin);
 
   /*
    * Print the state table
    */
-  unsigned int limit = (stable.size() < NLINES) ? stable.size() : NLINES;
-  for (unsigned int tmpint=0; tmpint < limit; tmpint++) {
+  unsigned int limit = stable.size();
+  if (flags.single) {
+    for (unsigned int tmpint = 0; tmpint < limit; tmpint++)
+      write_line(stable[tmpint], flags, rowfmt, max);
+    out_flush(stdout_buf);
+    return;
+  }
+  if (first + rows < limit) {
+    limit = first + rows;
+  }
+
+  int top = getcury(mainwin);
+  bool moved = cache->top != top;
+  if (moved) {
+    // the headers changed size, so nothing below them is where it was
+    invalidate_rows(*cache);
+    cache->top = top;
+  }
+
+  uint64_t layout = fnv_hash(format);
+  unsigned int widths[] = { max.src, max.dst };
+  layout = fnv_hash(widths, sizeof(widths), layout);
+  layout = fnv_hash(&flags, sizeof(flags), layout);
+
+  unsigned int line = 0;
+  for (unsigned int tmpint = first; tmpint < limit; tmpint++, line++) {
+    uint64_t hash = row_hash(stable[tmpint], layout, (curr == tmpint));
+    if (line < cache->lines.size() && cache->lines[line] == hash)
+      continue;
+
+    int y = top + line;
+    wmove(mainwin, y, 0);
     printline(stable[tmpint], flags, format, max, mainwin, (curr == tmpint));
-    if (!flags.single && flags.noscroll
-        && (tmpint >= ssize.y-4 || (flags.totals && tmpint >= ssize.y-5)))
-      break;
 
+    if (line < cache->lines.size())
+      cache->lines[line] = hash;
+    else
+      cache->lines.push_back(hash);
+
+    /*
+     * A full-width line leaves us at the start of the next one. If we're
+     * short of that, clear whatever was left from last time, and if we
+     * wrapped onto the next line, we just broke whatever we'd cached there.
+     */
+    if (getcury(mainwin) == y) {
+      wclrtoeol(mainwin);
+    } else if (getcurx(mainwin) != 0 && line + 1 < cache->lines.size()) {
+      cache->lines[line + 1] = 0;
+    }
   }
 
   /*
-   * We don't want to lave things on the screen we didn't draw
-   * this time.
+   * We don't want to leave things on the screen we didn't draw
+   * this time - including, if the headers got shorter, the old bottom.
    */
-  if (!flags.single)
+  if (moved || line < cache->lines.size() || line == 0) {
+    wmove(mainwin, top + line, 0);
     wclrtobot(mainwin);
-  
+    cache->lines.resize(line);
+  }
 }
 
 /*
@@ -1736,6 +6688,10 @@ void determine_format(WINDOW *mainwin, max_t &max, screensize_t &ssize,
    * (one between each of 5 fields)
    */
   unsigned int left = ssize.x - max.ttl - max.state - max.proto - 4;
+  if (show_netns(flags))
+    left -= max.netns + 1;
+  if (show_mark(flags))
+    left -= max.mark + 1;
   if (flags.counters)
     left -= (max.bytes + max.packets + 2);
 
@@ -1819,6 +6775,11 @@ void determine_format(WINDOW *mainwin, max_t &max, screensize_t &ssize,
   buffer << "\%-" << src << "s \%-" << dst << "s \%-" << max.proto << "s \%-"
     << max.state << "s \%-" << max.ttl << "s";
 
+  if (show_netns(flags))
+    buffer << " \%-" << max.netns << "s";
+  if (show_mark(flags))
+    buffer << " \%-" << max.mark << "s";
+
   if (flags.counters)
     buffer << " \%-" << max.bytes << "s \%-" << max.packets << "s";
 
@@ -1835,7 +6796,8 @@ void determine_format(WINDOW *mainwin, max_t &max, screensize_t &ssize,
  * Interactive help
  */
 void interactive_help(const string &sorting, const flags_t &flags,
-                      const filters_t &filters)
+                      const filters_t &filters, const unsigned int &rate,
+                      const bool &adaptive)
 {
 
   /*
@@ -1847,8 +6809,8 @@ void interactive_help(const string &sorting, const flags_t &flags,
    * a "box" around the window and if the pad is huge then 
    * the box will get drawn around that.
    *
-   * So... we have 41 lines of help, plus a top and bottom border,
-   * thus maxrows is 43. We also need to account for the filter settings
+   * So... we have 52 lines of help, plus a top and bottom border,
+   * thus maxrows is 54. We also need to account for the filter settings
    * that are only being displayed when enabled.
    *
    * Our help text is not wider than 80, so we'll set that standard
@@ -1856,11 +6818,12 @@ void interactive_help(const string &sorting, const flags_t &flags,
    *
    * If the screen is bigger than this, we deal with it below.
    */
-  unsigned int maxrows = 43;
+  unsigned int maxrows = 54;
   unsigned int maxcols = 80;
 
   // Acount for dynamic filter settings
-  maxrows += flags.filter_src + flags.filter_srcpt + flags.filter_dst + flags.filter_dstpt;
+  maxrows += flags.filter_src + flags.filter_srcpt + flags.filter_dst + flags.filter_dstpt
+    + flags.filter_mark + flags.filter_netns;
 
   /*
    * The actual screen size
@@ -1942,6 +6905,12 @@ void interactive_help(const string &sorting, const flags_t &flags,
   waddstr(helpwin, sorting.c_str());
   wattroff(helpwin, A_BOLD);
 
+  mvwaddstr(helpwin, y++, x, "  Refresh rate: ");
+  wattron(helpwin, A_BOLD);
+  wprintw(helpwin, "%s%u.%03us", adaptive ? "auto, currently " : "",
+          rate / 1000, rate % 1000);
+  wattroff(helpwin, A_BOLD);
+
   mvwaddstr(helpwin, y++, x, "  Dynamic formatting: ");
   wattron(helpwin, A_BOLD);
   waddstr(helpwin,(!flags.staticsize) ? "yes" : "no");
@@ -2023,6 +6992,20 @@ void interactive_help(const string &sorting, const flags_t &flags,
     wprintw(helpwin, "%lu", filters.dstpt);
     wattroff(helpwin, A_BOLD);
   }
+  if (flags.filter_mark) {
+    mvwaddstr(helpwin, y++, x, "  Mark filter: ");
+    wattron(helpwin, A_BOLD);
+    wprintw(helpwin, "0x%x/0x%x", filters.mark, filters.markmask);
+    wattroff(helpwin, A_BOLD);
+  }
+  if (flags.filter_netns) {
+    mvwaddstr(helpwin, y++, x, "  Namespace filter: ");
+    wattron(helpwin, A_BOLD);
+    waddstr(helpwin, netns.spaces[filters.netns].name.c_str());
+    if (filters.has_zone)
+      wprintw(helpwin, "/%u", filters.zone);
+    wattroff(helpwin, A_BOLD);
+  }
 
   y++;
 
@@ -2074,6 +7057,41 @@ void interactive_help(const string &sorting, const flags_t &flags,
   wattroff(helpwin, A_BOLD);
   waddstr(helpwin, "\tInvert filters to display non-matching results");
 
+  wattron(helpwin, A_BOLD);
+  mvwaddstr(helpwin, y++, x, "  a");
+  wattroff(helpwin, A_BOLD);
+  waddstr(helpwin, "\tToggle rates instead of total counters");
+
+  wattron(helpwin, A_BOLD);
+  mvwaddstr(helpwin, y++, x, "  g");
+  wattroff(helpwin, A_BOLD);
+  waddstr(helpwin, "\tChange grouping");
+
+  wattron(helpwin, A_BOLD);
+  mvwaddstr(helpwin, y++, x, "  n");
+  wattroff(helpwin, A_BOLD);
+  waddstr(helpwin, "\tToggle highlighting new and closed states");
+
+  wattron(helpwin, A_BOLD);
+  mvwaddstr(helpwin, y++, x, "  K");
+  wattroff(helpwin, A_BOLD);
+  waddstr(helpwin, "\tToggle the mark column");
+
+  wattron(helpwin, A_BOLD);
+  mvwaddstr(helpwin, y++, x, "  M");
+  wattroff(helpwin, A_BOLD);
+  waddstr(helpwin, "\tChange mark filter");
+
+  wattron(helpwin, A_BOLD);
+  mvwaddstr(helpwin, y++, x, "  N");
+  wattroff(helpwin, A_BOLD);
+  waddstr(helpwin, "\tToggle showing NATed states' translated side");
+
+  wattron(helpwin, A_BOLD);
+  mvwaddstr(helpwin, y++, x, "  I");
+  wattroff(helpwin, A_BOLD);
+  waddstr(helpwin, "\tToggle the performance status line");
+
   wattron(helpwin, A_BOLD);
   mvwaddstr(helpwin, y++, x, "  l");
   wattroff(helpwin, A_BOLD);
@@ -2134,6 +7152,21 @@ void interactive_help(const string &sorting, const flags_t &flags,
   wattroff(helpwin, A_BOLD);
   waddstr(helpwin, "\tDelete the currently highlighted state from netfilter");
 
+  wattron(helpwin, A_BOLD);
+  mvwaddstr(helpwin, y++, x, "  Z");
+  wattroff(helpwin, A_BOLD);
+  waddstr(helpwin, "\tChange namespace filter");
+
+  wattron(helpwin, A_BOLD);
+  mvwaddstr(helpwin, y++, x, "  [");
+  wattroff(helpwin, A_BOLD);
+  waddstr(helpwin, "\tGo back to the previous snapshot (with --history)");
+
+  wattron(helpwin, A_BOLD);
+  mvwaddstr(helpwin, y++, x, "  ]");
+  wattroff(helpwin, A_BOLD);
+  waddstr(helpwin, "\tGo forward to the next snapshot, and then live again");
+
   y++;
 
   wmove(helpwin, 0, 0);
@@ -2265,11 +7298,225 @@ void interactive_help(const string &sorting, const flags_t &flags,
       goto out;
     }
   }
-out:
-  // once a key is pressed, tear down the help window.
-  delwin(helpwin);
-  refresh();
-  halfdelay(1);
+out:
+  // once a key is pressed, tear down the help window.
+  delwin(helpwin);
+  // stdscr didn't change underneath us, so make curses redraw all of it
+  touchwin(stdscr);
+  refresh();
+  halfdelay(1);
+}
+
+/*
+ * How many states fit on the screen below the headers. We always leave the
+ * last line blank so curses never has to wrap at the bottom-right corner.
+ */
+unsigned int visible_rows(const screensize_t &ssize, int hdrs)
+{
+  int rows = ssize.y - hdrs - 1;
+  return (rows > 0) ? rows : 1;
+}
+
+/*
+ * Keep the cursor inside the table and the view around the cursor, and
+ * don't let the view scroll past the last page of the table.
+ */
+void clamp_view(unsigned int size, unsigned int rows, unsigned int &py,
+                unsigned int &curr)
+{
+  if (size == 0) {
+    py = curr = 0;
+    return;
+  }
+  if (curr >= size)
+    curr = size - 1;
+  if (curr < py)
+    py = curr;
+  else if (curr >= py + rows)
+    py = curr - rows + 1;
+  unsigned int bottom = (size > rows) ? size - rows : 0;
+  if (py > bottom)
+    py = bottom;
+}
+
+/*
+ * BENCHMARK
+ *
+ * --bench runs each stage of the pipeline separately over synthetic tables
+ * of various sizes, and reports how fast each one went. The procfs parser
+ * gets the same states as text, as if read from /proc/net/nf_conntrack. Use the synthetic
+ * source's options (--source synthetic:...) to change what the tables
+ * look like - the count is ignored.
+ */
+
+// Parse a list of sizes like "10k,100k,1M"
+bool parse_bench(const char *arg, vector<unsigned long> &sizes)
+{
+  vector<string> list(MAXFIELDS);
+  splita(',', arg, list);
+  for (const string &item : list) {
+    if (item.empty())
+      continue;
+    char *end;
+    unsigned long size = strtoul(item.c_str(), &end, 10);
+    if (*end == 'k' || *end == 'K') {
+      size *= 1000;
+      end++;
+    } else if (*end == 'm' || *end == 'M') {
+      size *= 1000000;
+      end++;
+    }
+    if (*end != '\0' || size == 0)
+      return false;
+    sizes.push_back(size);
+  }
+  return !sizes.empty();
+}
+
+/*
+ * Write 'entry' out the way /proc/net/nf_conntrack would, so we have
+ * something to feed procfs_parse(). Returns the length.
+ */
+size_t bench_procfs_line(char *buf, const tentry_t *entry)
+{
+  char *p = buf;
+  p += sprintf(p, "%-8s %u %-8s %u %u ",
+               entry->family == AF_INET ? "ipv4" : "ipv6", entry->family,
+               proto_name(entry->l4proto).c_str(), entry->l4proto,
+               entry->timeout);
+  if (entry->l4proto == IPPROTO_TCP)
+    p += sprintf(p, "%s ", states[entry->tcpstate]);
+  // the original direction, then the reply
+  for (int dir = 0; dir < 2; dir++) {
+    const in6_addr &src = dir ? entry->dst : entry->src;
+    const in6_addr &dst = dir ? entry->src : entry->dst;
+    memcpy(p, "src=", 4);
+    p += 4;
+    p += fmt_ip(p, entry->family, src);
+    memcpy(p, " dst=", 5);
+    p += 5;
+    p += fmt_ip(p, entry->family, dst);
+    if (entry->l4proto == IPPROTO_ICMP || entry->l4proto == IPPROTO_ICMPV6) {
+      p += sprintf(p, " type=%u code=%u id=%u", entry->icmp_type,
+                   entry->icmp_code, ntohs(entry->icmp_id));
+    } else {
+      p += sprintf(p, " sport=%lu dport=%lu", dir ? entry->dstpt : entry->srcpt,
+                   dir ? entry->srcpt : entry->dstpt);
+    }
+    p += sprintf(p, " packets=%" PRIu64 " bytes=%" PRIu64 " ",
+                 entry->packets / 2, entry->bytes / 2);
+  }
+  p += sprintf(p, "mark=%u zone=%u use=1\n", entry->mark, entry->zone);
+  return p - buf;
+}
+
+void bench_phase(unsigned long size, const string &phase, uint64_t start)
+{
+  double secs = (now_usec() - start) / 1000000.0;
+  printf("%9lu  %-16s %10.1f ms %10.2f M states/s\n", size, phase.c_str(),
+         secs * 1000, secs > 0 ? size / secs / 1000000 : 0);
+}
+
+void run_bench(const vector<unsigned long> &sizes, const source_t &source,
+               flags_t flags)
+{
+  const synth_t &synth = source.synth;
+  printf("Synthetic states: tcp/udp/icmp/other %u/%u/%u/%u, %u%% IPv6, ",
+         synth.tcp, synth.udp, synth.icmp, synth.other, synth.v6);
+  if (synth.hot_dsts)
+    printf("%u%% to %u hot destinations, ", synth.hot, synth.hot_dsts);
+  printf("TTL up to %us, ~%" PRIu64 " packets max\n\n", synth.ttl,
+         synth.packets);
+  printf("%9s  %-16s %13s %21s\n", "states", "phase", "time", "throughput");
+
+  // render to /dev/null rather than the terminal
+  fflush(stdout);
+  int saved_fd = stdout_buf.fd;
+  stdout_buf.fd = open("/dev/null", O_WRONLY);
+
+  flags.single = true;
+  flags.lookup = false;
+  filters_t filters;
+  memset(&filters, 0, sizeof(filters));
+
+  for (unsigned long size : sizes) {
+    vector<tentry_t*> stable;
+    counters_t counts;
+    max_t max;
+    memset(&counts, 0, sizeof(counts));
+    initialize_maxes(max, flags);
+    stable.reserve(size);
+
+    // reading states and building their display strings
+    uint64_t start = now_usec();
+    for (unsigned long i = 0; i < size; i++) {
+      tentry_t *entry = new tentry_t;
+      synthetic_entry(synth, 0, i, entry);
+      describe_entry(entry, max, counts);
+      stable.push_back(entry);
+    }
+    bench_phase(size, "ingest", start);
+
+    // the same states as /proc/net/nf_conntrack text
+    string text;
+    text.reserve(size * 200);
+    char line[512];
+    for (const tentry_t *entry : stable)
+      text.append(line, bench_procfs_line(line, entry));
+    tentry_t parsed;
+    start = now_usec();
+    const char *p = text.data(), *end = p + text.size();
+    while (p < end) {
+      const char *nl = (const char *)memchr(p, '\n', end - p);
+      procfs_parse(p, nl, &parsed);
+      p = nl + 1;
+    }
+    bench_phase(size, "procfs parse", start);
+    string().swap(text);
+
+    // a typical filter, that most states fail
+    flags_t fflags = flags;
+    fflags.filter_dstpt = true;
+    filters.dstpt = 443;
+    unsigned long kept = 0;
+    start = now_usec();
+    for (const tentry_t *entry : stable)
+      kept += filter_entry(entry, fflags, filters);
+    bench_phase(size, "filter", start);
+
+    start = now_usec();
+    for (tentry_t *entry : stable)
+      stringify_entry(entry, max, flags);
+    bench_phase(size, "stringify", start);
+
+    string sorting;
+    for (int sortby = 0; sortby <= SORT_MAX; sortby++) {
+      vector<tentry_t*> sorted(stable);
+      start = now_usec();
+      sort_table(sortby, false, false, sorted, sorting);
+      bench_phase(size, "sort " + sorting, start);
+    }
+
+    string format;
+    screensize_t ssize;
+    sort_table(SORT_SRC, false, false, stable, sorting);
+    start = now_usec();
+    determine_format(NULL, max, ssize, format, flags);
+    print_table(stable, flags, format, sorting, filters, counts, ssize, max,
+                NULL, 0, 0, 0, NULL);
+    bench_phase(size, "render", start);
+
+    clear_table(stable);
+
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%9lu  %-16s %10.1f MB  (%lu states passed the filter)\n\n",
+           size, "peak RSS", usage.ru_maxrss / 1024.0, kept);
+    fflush(stdout);
+  }
+
+  close(stdout_buf.fd);
+  stdout_buf.fd = saved_fd;
 }
 
 /*
@@ -2285,15 +7532,54 @@ int main(int argc, char *argv[])
       secs, hrs, sorting, tmpstring, format, prompt;
   ostringstream ostream;
   vector<tentry_t*> stable;
-  int tmpint = 0, sortby = 0, rate = 1, hdrs = 0;
-  unsigned int py = 0, px = 0, curr_state = 0;
+  int tmpint = 0, sortby = 0, hdrs = 0;
+  bool reverse = false;
+  /*
+   * rate is the refresh interval in milliseconds. In adaptive mode we
+   * adjust it after each refresh based on what it cost, see adapt_rate().
+   */
+  unsigned int rate = DEFAULT_RATE, cpu_budget = DEFAULT_CPU_BUDGET;
+  bool adaptive = false;
+  /*
+   * rebuild is whether the next pass around the main loop should get a new
+   * table, or just redraw the one we have (e.g. after scrolling), and
+   * next_refresh is when (on the monotonic clock) the next rebuild is due.
+   */
+  bool rebuild = true;
+  /*
+   * output is one of the OUTPUT_* formats, and output_started is whether
+   * we've written anything in it yet (CSV/TSV only write a header once).
+   */
+  int output = OUTPUT_TEXT;
+  bool output_started = false;
+  // table sizes to benchmark, if --bench was given
+  vector<unsigned long> bench_sizes;
+  int stats_format = STATS_TEXT;
+  // what to group states by, if anything
+  grouping_t grouping;
+  grouping.by = GROUP_NONE;
+  grouping.prefix4 = 32;
+  grouping.prefix6 = 128;
+  // the namespaces to watch (--netns), opened once we've read the options
+  string netns_arg, netns_filter_arg;
+  // top talkers for --top
+  talkers_t *talkers = NULL;
+  uint64_t next_refresh = 0, refresh_start = 0, refresh_cpu = 0;
+  /*
+   * py is the index of the first state on the screen, rows is how many
+   * states fit on it and curr_state is the index of the highlighted state.
+   */
+  unsigned int py = 0, rows = 0, curr_state = 0;
+  rowcache_t rowcache;
   timeval selecttimeout;
+  uint64_t now;
   fd_set readfd;
   flags_t flags;
   counters_t counts;
   screensize_t ssize;
   filters_t filters;
   max_t max;
+  source_t source;
 
   /*
    * Initialize
@@ -2301,33 +7587,85 @@ int main(int argc, char *argv[])
   flags.single = flags.totals = flags.lookup = flags.skiplb = flags.staticsize
       = flags.skipdns = flags.tag_truncate = flags.filter_src
       = flags.filter_dst = flags.filter_srcpt = flags.filter_dstpt
-      = flags.noscroll = flags.nocolor = flags.counters = flags.filter_inv = false;
+      = flags.noscroll = flags.nocolor = flags.counters = flags.filter_inv
+      = flags.headless = flags.stream = flags.stats = flags.group
+      = flags.rates = flags.changes = flags.nat = flags.filter_mark
+      = flags.mark = flags.filter_netns = false;
   ssize.x = ssize.y = 0;
   counts.tcp = counts.udp = counts.icmp = counts.other = counts.skipped = 0;
+  counts.dropped = 0;
   filters.src = filters.dst = in6addr_any;
   filters.srcpt = filters.dstpt = 0;
+  filters.mark = filters.markmask = 0;
+  filters.netns = filters.zone = 0;
+  filters.has_zone = false;
+  // the namespace we're in is always there, even without --netns
+  netns.enabled = netns.all = false;
+  netns.self = -1;
+  netns_add(".");
   max.src = max.dst = max.proto = max.state = max.ttl = 0;
-  px = py = 0;
+  invalidate_rows(rowcache);
+  source.type = SOURCE_NETLINK;
+  source.file = NULL;
+  source.have_snap = false;
+  source.count = source.generation = 0;
+  source.synth.tcp = 75;
+  source.synth.udp = 20;
+  source.synth.icmp = 5;
+  source.synth.other = 0;
+  source.synth.v6 = 10;
+  source.synth.hot = source.synth.hot_dsts = 0;
+  source.synth.ttl = 432000;
+  source.synth.packets = 1000;
+  source.speed = 0;
+  source.snap_time = source.next_snap_time = 0;
+  source.record = NULL;
+  source.rates = NULL;
+  source.changes = NULL;
 
   static struct option long_options[] = {
+    {"alert-cmd", required_argument, 0, 0},
+    {"bench", optional_argument, 0, 0},
+    {"changes", no_argument, 0, 0},
+    {"churn", no_argument, 0, 0},
     {"counters", no_argument , 0, 'C'},
+    {"cpu-budget", required_argument, 0, 0},
     {"dst-filter", required_argument, 0, 'd'},
     {"dstpt-filter", required_argument, 0, 'D'},
+    {"group", required_argument, 0, 0},
+    {"headless", no_argument, 0, 0},
+    {"history", required_argument, 0, 0},
     {"help", no_argument, 0, 'h'},
     {"invert-filters", no_argument, 0, 'i'},
     {"lookup", no_argument, 0, 'l'},
+    {"mark", no_argument, 0, 0},
+    {"mark-filter", required_argument, 0, 0},
     {"mark-truncated", no_argument, 0, 'm'},
+    {"max-memory", required_argument, 0, 0},
+    {"nat", no_argument, 0, 0},
+    {"netns", required_argument, 0, 0},
+    {"netns-filter", required_argument, 0, 0},
     {"no-color", no_argument, 0, 'c'},
     {"no-dynamic", no_argument, 0, 'o'},
     {"no-dns", no_argument, 0, 'L'},
     {"no-loopback", no_argument, 0, 'f'},
     {"no-scroll", no_argument, 0, 'p'},
+    {"output", required_argument, 0, 0},
     {"rate", required_argument, 0, 'R'},
+    {"rates", no_argument, 0, 0},
+    {"record", required_argument, 0, 0},
+    {"replay", required_argument, 0, 0},
     {"reverse", no_argument, 0, 'r'},
     {"single", no_argument, 0, '1'},
+    {"speed", required_argument, 0, 0},
     {"sort", required_argument, 0, 'b'},
+    {"source", required_argument, 0, 0},
     {"src-filter", required_argument, 0, 's'},
     {"srcpt-filter", required_argument, 0, 'S'},
+    {"stats", optional_argument, 0, 0},
+    {"stream", no_argument, 0, 0},
+    {"syn-alert", required_argument, 0, 0},
+    {"top", optional_argument, 0, 0},
     {"totals", no_argument, 0, 't'},
     {"version", no_argument, 0, 'v'},
     {0, 0, 0,0}
@@ -2354,7 +7692,139 @@ int main(int argc, char *argv[])
        *   }
        *
        */
-
+      tmpstring = long_options[option_index].name;
+      if (tmpstring == "cpu-budget") {
+        cpu_budget = atoi(optarg);
+        if (cpu_budget < 1 || cpu_budget > 100) {
+          cerr << "Invalid CPU budget: " << optarg << endl;
+          exit(1);
+        }
+      } else if (tmpstring == "bench") {
+        if (!parse_bench(optarg ? optarg : DEFAULT_BENCH, bench_sizes)) {
+          cerr << "Invalid benchmark sizes: " << optarg << endl;
+          exit(1);
+        }
+      } else if (tmpstring == "group") {
+        if (!parse_group(optarg, grouping)) {
+          cerr << "Invalid grouping: " << optarg << endl;
+          exit(1);
+        }
+        flags.group = grouping.by != GROUP_NONE;
+      } else if (tmpstring == "changes") {
+        flags.changes = true;
+        source.changes = new changes_t();
+      } else if (tmpstring == "mark") {
+        flags.mark = true;
+      } else if (tmpstring == "mark-filter") {
+        if (!parse_mark(optarg, filters)) {
+          cerr << "Invalid mark filter: " << optarg << endl;
+          exit(1);
+        }
+        flags.filter_mark = true;
+      } else if (tmpstring == "nat") {
+        flags.nat = true;
+      } else if (tmpstring == "netns") {
+        netns_arg = optarg;
+      } else if (tmpstring == "netns-filter") {
+        // checked once we know which namespaces there are, see below
+        netns_filter_arg = optarg;
+      } else if (tmpstring == "churn") {
+        churn.enabled = true;
+      } else if (tmpstring == "rates") {
+        flags.rates = flags.counters = true;
+        source.rates = new rates_t();
+      } else if (tmpstring == "history") {
+        if (!parse_size(optarg, history.budget) || !history.budget) {
+          cerr << "Invalid history size: " << optarg << endl;
+          exit(1);
+        }
+      } else if (tmpstring == "headless") {
+        flags.single = flags.headless = true;
+      } else if (tmpstring == "max-memory") {
+        if (!parse_size(optarg, mem.budget)) {
+          cerr << "Invalid memory limit: " << optarg << endl;
+          exit(1);
+        }
+        if (mem.budget < MIN_MEMORY) {
+          cerr << "Memory limit must be at least " << (MIN_MEMORY >> 20)
+               << "M" << endl;
+          exit(1);
+        }
+      } else if (tmpstring == "source") {
+        if (!parse_source(optarg, source)) {
+          cerr << "Invalid source: " << optarg << endl;
+          exit(1);
+        }
+      } else if (tmpstring == "record") {
+        int fd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+          cerr << "Couldn't open " << optarg << ": " << strerror(errno)
+            << endl;
+          exit(1);
+        }
+        source.record = new outbuf_t;
+        source.record->fd = fd;
+        source.record->used = 0;
+      } else if (tmpstring == "replay") {
+        source.type = SOURCE_REPLAY;
+        source.path = optarg;
+        if (source.speed == 0)
+          source.speed = 1;
+      } else if (tmpstring == "speed") {
+        char *end;
+        source.speed = strtod(optarg, &end);
+        if (*end != '\0' || source.speed <= 0) {
+          cerr << "Invalid speed: " << optarg << endl;
+          exit(1);
+        }
+      } else if (tmpstring == "stats") {
+        flags.stats = true;
+        if (optarg == NULL || !strcmp(optarg, "text")) {
+          stats_format = STATS_TEXT;
+        } else if (!strcmp(optarg, "json")) {
+          stats_format = STATS_JSON;
+        } else {
+          cerr << "Invalid stats format: " << optarg << endl;
+          exit(1);
+        }
+      } else if (tmpstring == "stream") {
+        flags.single = flags.stream = true;
+      } else if (tmpstring == "syn-alert") {
+        char *end;
+        synflood.threshold = strtoul(optarg, &end, 10);
+        if (end != optarg && *end == '/') {
+          const char *p = end + 1;
+          synflood.growth = strtoul(p, &end, 10);
+          if (end == p)
+            end = (char *)optarg;
+        }
+        if (end == optarg || *end
+            || (!synflood.threshold && !synflood.growth)) {
+          cerr << "Invalid SYN flood thresholds: " << optarg << endl;
+          exit(1);
+        }
+        synflood.enabled = true;
+      } else if (tmpstring == "alert-cmd") {
+        synflood.command = optarg;
+      } else if (tmpstring == "top") {
+        flags.single = flags.stream = true;
+        talkers = new talkers_t();
+        talkers->k = TOP_DEFAULT;
+        if (optarg) {
+          char *end;
+          unsigned long k = strtoul(optarg, &end, 10);
+          if (end == optarg || *end || k == 0 || k > 10000) {
+            cerr << "Invalid number of top talkers: " << optarg << endl;
+            exit(1);
+          }
+          talkers->k = k;
+        }
+      } else if (tmpstring == "output") {
+        if (!parse_output(optarg, output)) {
+          cerr << "Invalid output format: " << optarg << endl;
+          exit(1);
+        }
+      }
       break;
     // --counters
     case 'C':
@@ -2424,11 +7894,14 @@ int main(int argc, char *argv[])
       break;
     // --reverse
     case 'r':
-      sort_factor = -1;
+      reverse = true;
       break;
     // --rate
     case 'R':
-      rate = atoi(optarg);
+      if (!parse_rate(optarg, rate, adaptive)) {
+        cerr << "Invalid rate: " << optarg << endl;
+        exit(1);
+      }
       break;
     // --sort
     case 'b':
@@ -2487,8 +7960,117 @@ int main(int argc, char *argv[])
     }
   }
 
-  if (rate < 0 || rate > 60) {
-    rate = 1;
+  // The other formats can't be drawn on the screen, so they mean -1
+  if (output != OUTPUT_TEXT && !flags.headless && !flags.stream)
+    flags.single = true;
+
+  if (history.budget && flags.single) {
+    cerr << "--history is only supported in interactive mode" << endl;
+    exit(1);
+  }
+
+  if (flags.changes && flags.single) {
+    cerr << "--changes is only supported in interactive mode" << endl;
+    exit(1);
+  }
+
+  if (churn.enabled) {
+    if (flags.single) {
+      cerr << "--churn is only supported in interactive mode" << endl;
+      exit(1);
+    }
+    if (source.type != SOURCE_NETLINK) {
+      cerr << "--churn needs the netlink source" << endl;
+      exit(1);
+    }
+    // captures only have the states, so a replay couldn't show the churn
+    if (source.record) {
+      cerr << "--churn events can't be recorded, so --churn can't be"
+           << " combined with --record" << endl;
+      exit(1);
+    }
+    if (!churn_open()) {
+      cerr << "Couldn't subscribe to conntrack events: " << strerror(errno)
+           << endl;
+      exit(2);
+    }
+  }
+
+  if (!netns_arg.empty()) {
+    if (source.type != SOURCE_NETLINK) {
+      cerr << "--netns needs the netlink source" << endl;
+      exit(1);
+    }
+    if (churn.enabled) {
+      cerr << "--churn only watches our own namespace, not --netns" << endl;
+      exit(1);
+    }
+    netns_setup(netns_arg);
+    if (netns.all)
+      netns_scan(flags, filters);
+  }
+
+  if (!netns_filter_arg.empty()) {
+    if (!parse_netns_filter(netns_filter_arg, filters)) {
+      cerr << "Invalid namespace filter, or no such namespace: "
+           << netns_filter_arg << endl;
+      exit(1);
+    }
+    flags.filter_netns = true;
+  }
+
+  if (!synflood.command.empty() && !synflood.enabled) {
+    cerr << "--alert-cmd needs --syn-alert" << endl;
+    exit(1);
+  }
+
+  if (!bench_sizes.empty()) {
+    run_bench(bench_sizes, source, flags);
+    exit(0);
+  }
+
+  // The other formats are one record per state
+  if (flags.group && output != OUTPUT_TEXT) {
+    cerr << "Grouping is only supported with --output text" << endl;
+    exit(1);
+  }
+
+  /*
+   * Streaming never builds a table, so there's nothing to sort and no
+   * screen to draw - just dump, and in headless mode, do it again every
+   * refresh.
+   */
+  if (flags.stream) {
+    if (sortby != SORT_SRC || reverse) {
+      cerr << "Sorting is not supported with --stream" << endl;
+      exit(1);
+    }
+    if (flags.group) {
+      cerr << "Grouping is not supported with --stream" << endl;
+      exit(1);
+    }
+    if (talkers && output != OUTPUT_TEXT && output != OUTPUT_JSON) {
+      cerr << "--top is only supported with --output text or json" << endl;
+      exit(1);
+    }
+    while (1) {
+      refresh_start = now_usec();
+      refresh_cpu = now_usec(CLOCK_PROCESS_CPUTIME_ID);
+      stats_reset(flags.stats);
+      stream_table(flags, filters, counts, source, output, !output_started,
+                   talkers);
+      output_started = true;
+      if (flags.stats)
+        print_stats(stats_format);
+      if (!flags.headless)
+        exit(0);
+      if (adaptive)
+        rate = adapt_rate(rate,
+                          now_usec(CLOCK_PROCESS_CPUTIME_ID) - refresh_cpu,
+                          cpu_budget);
+      sleep_until(refresh_start
+                  + (uint64_t)refresh_interval(source, rate) * 1000);
+    }
   }
 
   // Initialize Curses Stuff
@@ -2505,121 +8087,200 @@ int main(int argc, char *argv[])
    */
   while (1) {
 
-    /*
-     * We get the screensize_t up-front so we can die if the
-     * screen doesn't meet our minimum requirements without making
-     * the user wait while we gather and process all the data.
-     * We'll do it again afterwards just in case
-     */
+    if (rebuild) {
+      refresh_start = now_usec();
+      refresh_cpu = now_usec(CLOCK_PROCESS_CPUTIME_ID);
+      stats_reset(flags.stats);
 
-    ssize = get_size(flags.single);
+      /*
+       * We get the screensize_t up-front so we can die if the
+       * screen doesn't meet our minimum requirements without making
+       * the user wait while we gather and process all the data.
+       * We'll do it again afterwards just in case
+       */
 
-    if (ssize.x < 72) {
-      term_too_small();
-    }
+      ssize = get_size(flags.single);
 
-    // And our header size
-    hdrs = 3;
-    if (flags.totals) {
-      hdrs++;
-    }
-    if (flags.filter_src || flags.filter_dst || flags.filter_srcpt
-        || flags.filter_dstpt) {
-      hdrs++;
-    }
+      if (ssize.x < 72) {
+        term_too_small();
+      }
 
-    // clear maxes
-    initialize_maxes(max, flags);
+      /*
+       * What we'll need for drawing this refresh, for --max-memory: our
+       * output buffers, and curses' copies of the screen
+       */
+      mem.render = OUTBUF_SIZE * (source.record ? 2 : 1)
+        + rowcache.lines.capacity() * sizeof(uint64_t);
+      if (!flags.single)
+        mem.render += 3 * ssize.x * ssize.y * sizeof(chtype);
+
+      // And our header size
+      hdrs = 3;
+      if (flags.totals) {
+        hdrs++;
+      }
+      if (flags.filter_src || flags.filter_dst || flags.filter_srcpt
+          || flags.filter_dstpt || flags.filter_mark
+          || flags.filter_netns) {
+        hdrs++;
+      }
+      if (flags.stats && !flags.single) {
+        hdrs++;
+      }
 
-    // Build our table
-    build_table(flags, filters, stable, counts, max);
+      // clear maxes
+      initialize_maxes(max, flags);
 
-    /*
-     * Now that we have the new table, make sure our page/cursor
-     * positions still make sense.
-     */
-    if (curr_state > stable.size() - 1) {
-      curr_state = stable.size() - 1;
-    }
+      // Build our table
+      build_table(flags, filters, stable, counts, max, source);
+      if (mem.level >= MEM_TOPK) {
+        hdrs++;
+      }
+      if (!flags.single)
+        hdrs += syn_panel_lines();
+      if (churn.enabled)
+        hdrs += CHURN_PANEL_LINES;
+      if (history.offset)
+        hdrs++;
+      if (flags.group) {
+        uint64_t phase = now_usec();
+        group_table(stable, grouping, max, flags);
+        stats_time(PHASE_PROCESS, phase);
+      }
 
-    /*
-     * The bottom of the screen is stable.size()+hdrs+1
-     *   (the +1 is so we can have a blank line at the end)
-     * but we want to never have py be more than that - ssize.y
-     * so we're showing a page full of states.
-     */
-    int bottom = stable.size() + hdrs + 1 - ssize.y;
-    if (bottom < 0)
-      bottom = 0;
-    if (py > (unsigned)bottom)
-      py = bottom;
+      /*
+       * Now that we have the new table, make sure our page/cursor
+       * positions still make sense.
+       */
+      rows = visible_rows(ssize, hdrs);
+      clamp_view(stable.size(), rows, py, curr_state);
 
-    /*
-     * Originally I strived to do this the "right" way by calling
-     * nfct_is_set(ct, ATTR_ORIG_COUNGERS) to determine if
-     * counters were enabled. BUT, if counters are not enabled,
-     * nfct_get_attr() returns NULL, so this test is just as
-     * valid.
-     *
-     * Conversely checking is_set and then get_attr() inside our
-     * callback is twice the calls per-state if they are enabled,
-     * for no additional benefit.
-     */
-    if (flags.counters && stable.size() > 0 && stable[0]->bytes == 0) {
-      prompt = "Counters requested, but not enabled in the";
-      prompt += " kernel!";
-      flags.counters = 0;
-      if (flags.single)
-        cerr << prompt << endl;
-      else
-        c_warn(mainwin, prompt, flags);
-    }
+      /*
+       * Originally I strived to do this the "right" way by calling
+       * nfct_is_set(ct, ATTR_ORIG_COUNGERS) to determine if
+       * counters were enabled. BUT, if counters are not enabled,
+       * nfct_get_attr() returns NULL, so this test is just as
+       * valid.
+       *
+       * Conversely checking is_set and then get_attr() inside our
+       * callback is twice the calls per-state if they are enabled,
+       * for no additional benefit.
+       */
+      if (flags.counters && stable.size() > 0 && stable[0]->bytes == 0) {
+        prompt = "Counters requested, but not enabled in the";
+        prompt += " kernel!";
+        flags.counters = 0;
+        if (flags.single)
+          cerr << prompt << endl;
+        else
+          c_warn(mainwin, prompt, flags);
+      }
 
-    // Sort our table
-    sort_table(sortby, flags.lookup, sort_factor, stable, sorting);
+      // Sort our table
+      uint64_t phase = now_usec();
+      sort_table(sortby, flags.lookup, reverse, stable, sorting, flags.group,
+                 flags.rates);
+      stats_time(PHASE_SORT, phase);
 
-    /*
-     * From here on out 'max' is no longer "the maximum size of
-     * this field throughout the table", but is instead the actual
-     * size to print each field.
-     *
-     * BTW, we do "get_size" again here incase the window changed
-     * while we were off parsing and sorting data.
-     */
-    determine_format(mainwin, max, ssize, format, flags);
+      /*
+       * From here on out 'max' is no longer "the maximum size of
+       * this field throughout the table", but is instead the actual
+       * size to print each field.
+       *
+       * BTW, we do "get_size" again here incase the window changed
+       * while we were off parsing and sorting data.
+       */
+      if (output == OUTPUT_TEXT)
+        determine_format(mainwin, max, ssize, format, flags);
+      stats_time(PHASE_FORMAT, phase);
+    }
 
     /*
      * Now we print out the table in whichever format we're
      * configured for
      */
-    print_table(stable, flags, format, sorting, filters, counts, ssize, max,
-                mainwin, curr_state);
+    uint64_t phase = now_usec();
+    if (output == OUTPUT_TEXT) {
+      print_table(stable, flags, format, sorting, filters, counts, ssize, max,
+                  mainwin, py, rows, curr_state, &rowcache);
+    } else {
+      write_table(stdout_buf, stable, output, !output_started);
+      output_started = true;
+    }
+
+    if (flags.single) {
+      stats_render(phase);
+      if (flags.stats)
+        print_stats(stats_format);
+    }
 
     // Exit if we're only supposed to run once
-    if (flags.single)
+    if (flags.single && !flags.headless)
       exit(0);
 
+    /*
+     * In headless mode there's no screen and no keyboard, just sleep
+     * until it's time to write out the next snapshot.
+     */
+    if (flags.headless) {
+      if (adaptive)
+        rate = adapt_rate(rate,
+                          now_usec(CLOCK_PROCESS_CPUTIME_ID) - refresh_cpu,
+                          cpu_budget);
+      next_refresh = refresh_start
+        + (uint64_t)refresh_interval(source, rate) * 1000;
+      sleep_until(next_refresh);
+      continue;
+    }
+
     // Otherwise refresh the curses display
-    if (flags.noscroll) {
-      refresh();
-    } else {
-      prefresh(mainwin, py, px, 0, 0, ssize.y-1, ssize.x-1);
+    wrefresh(mainwin);
+    stats_render(phase);
+
+    /*
+     * Schedule the next refresh relative to when this one started, not
+     * when it finished, so slow dumps don't make us drift. In adaptive mode
+     * we first work out how long to wait based on what this one cost.
+     */
+    if (rebuild) {
+      if (adaptive)
+        rate = adapt_rate(rate,
+                          now_usec(CLOCK_PROCESS_CPUTIME_ID) - refresh_cpu,
+                          cpu_budget);
+      next_refresh = refresh_start
+        + (uint64_t)refresh_interval(source, rate) * 1000;
     }
 
-    //check for key presses for one second
-    //or whatever the user said
-    selecttimeout.tv_sec = rate;
-    selecttimeout.tv_usec = 0;
-    // I don't care about fractions of seconds. I don't want them.
-    FD_ZERO(&readfd);
-    FD_SET(0, &readfd);
-    select(1,&readfd, NULL, NULL, &selecttimeout);
+    /*
+     * check for key presses until the next refresh is due - and with
+     * --churn, read events as they come in while we wait
+     */
+    while (1) {
+      now = now_usec();
+      if (now > next_refresh)
+        now = next_refresh;
+      selecttimeout.tv_sec = (next_refresh - now) / 1000000;
+      selecttimeout.tv_usec = (next_refresh - now) % 1000000;
+      FD_ZERO(&readfd);
+      FD_SET(0, &readfd);
+      if (churn.enabled)
+        FD_SET(churn.fd, &readfd);
+      select(churn.enabled ? churn.fd + 1 : 1, &readfd, NULL, NULL,
+             &selecttimeout);
+      if (!churn.enabled || !FD_ISSET(churn.fd, &readfd))
+        break;
+      churn_read();
+      if (FD_ISSET(0, &readfd) || now_usec() >= next_refresh)
+        break;
+    }
+    rebuild = true;
     if (FD_ISSET(0, &readfd)) {
       tmpint = wgetch(mainwin);
       switch (tmpint) {
       // This is ^L
       case 12:
         handle_resize(mainwin, flags, ssize);
+        invalidate_rows(rowcache);
         break;
       /*
        * This is at the top because the rest are in
@@ -2641,11 +8302,29 @@ int main(int argc, char *argv[])
         break;
       case 'C':
         flags.counters = !flags.counters;
+        // rates are shown in the counter columns, so they go too
+        if (!flags.counters) {
+          flags.rates = false;
+          delete source.rates;
+          source.rates = NULL;
+        }
         if (sortby >= SORT_BYTES)
           sortby = SORT_BYTES-1;
         break;
+      case 'a':
+        flags.rates = !flags.rates;
+        // we only keep counters from refresh to refresh while we need them
+        if (flags.rates) {
+          flags.counters = true;
+          if (source.rates == NULL)
+            source.rates = new rates_t();
+        } else {
+          delete source.rates;
+          source.rates = NULL;
+        }
+        break;
       case 'h':
-        interactive_help(sorting, flags, filters);
+        interactive_help(sorting, flags, filters, rate, adaptive);
         break;
       case 'i':
         flags.filter_inv = !flags.filter_inv;
@@ -2674,10 +8353,10 @@ int main(int argc, char *argv[])
         flags.skiplb = !flags.skiplb;
         break;
       case 'p':
-        switch_scroll(flags, mainwin);
+        switch_scroll(flags);
         break;
       case 'r':
-        sort_factor = -sort_factor;
+        reverse = !reverse;
         break;
       case 'b':
         if (sortby < SORT_MAX) {
@@ -2701,6 +8380,9 @@ int main(int argc, char *argv[])
       case 't':
         flags.totals = !flags.totals;
         break;
+      case 'I':
+        flags.stats = !flags.stats;
+        break;
       /*
        * Update-filters
        */
@@ -2735,17 +8417,30 @@ int main(int argc, char *argv[])
         wmove(mainwin, 0, 0);
         wclrtoeol(mainwin);
         break;
+      case 'g':
+        prompt = "Group by src, dst, dport, dst:dport, proto, state, mark or";
+        prompt += " netns, or";
+        prompt += " src/N or dst/N (leave blank for none): ";
+        get_input(mainwin, tmpstring, prompt, flags);
+        if (!parse_group(tmpstring, grouping)) {
+          prompt = "Invalid grouping,";
+          prompt += " ignoring!";
+          c_warn(mainwin, prompt, flags);
+        } else {
+          flags.group = grouping.by != GROUP_NONE;
+          py = curr_state = 0;
+        }
+        wmove(mainwin, 0, 0);
+        wclrtoeol(mainwin);
+        break;
       case 'R':
-        prompt = "Rate: ";
+        prompt = "Rate (seconds, or auto): ";
         get_input(mainwin, tmpstring, prompt, flags);
         if (tmpstring != "") {
-          int i = atoi(tmpstring.c_str());
-          if (i < 1) {
+          if (!parse_rate(tmpstring.c_str(), rate, adaptive)) {
             prompt = "Invalid rate,";
             prompt += " ignoring!";
             c_warn(mainwin, prompt, flags);
-          } else {
-            rate = i;
           }
         }
         break;
@@ -2782,93 +8477,97 @@ int main(int argc, char *argv[])
         wmove(mainwin, 0, 0);
         wclrtoeol(mainwin);
         break;
+      case 'K':
+        flags.mark = !flags.mark;
+        break;
+      case 'M':
+        prompt = "New mark filter, as value[/mask]? (leave blank for";
+        prompt += " none): ";
+        get_input(mainwin, tmpstring, prompt, flags);
+        if (tmpstring == "") {
+          flags.filter_mark = false;
+          filters.mark = filters.markmask = 0;
+        } else if (!parse_mark(tmpstring.c_str(), filters)) {
+          prompt = "Invalid mark,";
+          prompt += " ignoring!";
+          c_warn(mainwin, prompt, flags);
+        } else {
+          flags.filter_mark = true;
+        }
+        wmove(mainwin, 0, 0);
+        wclrtoeol(mainwin);
+        break;
+      case 'N':
+        flags.nat = !flags.nat;
+        break;
+      case 'Z':
+        prompt = "New namespace filter, as name[/zone]? (leave blank for";
+        prompt += " none): ";
+        get_input(mainwin, tmpstring, prompt, flags);
+        if (tmpstring == "") {
+          flags.filter_netns = false;
+        } else if (!parse_netns_filter(tmpstring, filters)) {
+          prompt = "Invalid namespace filter or no such namespace,";
+          prompt += " ignoring!";
+          c_warn(mainwin, prompt, flags);
+        } else {
+          flags.filter_netns = true;
+        }
+        wmove(mainwin, 0, 0);
+        wclrtoeol(mainwin);
+        break;
+      case 'n':
+        flags.changes = !flags.changes;
+        // start afresh, rather than diff against a refresh from a while ago
+        delete source.changes;
+        source.changes = flags.changes ? new changes_t() : NULL;
+        break;
+      case '[':
+        if (!history.budget)
+          c_warn(mainwin, "No history to go back to, see --history", flags);
+        else if (history.offset < history.deltas.size())
+          history.offset++;
+        break;
+      case ']':
+        if (history.offset)
+          history.offset--;
+        break;
       case 'x':
-        delete_state(mainwin, stable[curr_state], flags);
+        if (source.type != SOURCE_NETLINK)
+          c_warn(mainwin, "States can only be deleted with the netlink source",
+                 flags);
+        else if (flags.group)
+          c_warn(mainwin, "States can't be deleted while grouping", flags);
+        else if (history.offset)
+          c_warn(mainwin, "States can't be deleted from history", flags);
+        else if (!stable.empty() && stable[curr_state]->ghost)
+          c_warn(mainwin, "That state has already closed", flags);
+        else if (!stable.empty())
+          delete_state(mainwin, stable[curr_state], flags);
         break;
       /*
        * Window navigation
+       *
+       * All of these just move the cursor (curr_state) and/or the view
+       * (py) around the sorted table. clamp_view() then makes sure the
+       * cursor is on the screen and the view doesn't run off either end.
+       *
+       * None of them change the table itself, so unless a refresh is due
+       * anyway we just redraw what we have rather than getting a new one.
        */
       case KEY_DOWN:
       case 'j':
         if (flags.noscroll)
           break;
-        /*
-         * GENERAL NOTE:
-         * py is the top of the window,
-         * ssize.y is the height of the window,
-         * so py+ssize.y is the bottom of the window.
-         *
-         * BOTTOM OF SCROLLING:
-         * Since stable.size()+hdrs+1 is
-         * the bottom of the text we've written, if
-         *    py+ssize.y == stable.size()+hdrs+1
-         * then the bottom of the screen as at the
-         * bottom of the text, no more scrolling.
-         *
-         * However, we only want to scroll the page
-         * when the cursor is at the bottom, i.e.
-         * when curr_state+4 == py+ssize.y
-         */
-
-        /*
-         * If we have room to scroll down AND if cur is
-         * at the bottom of a page scroll down.
-         */
-        if ((py + ssize.y <= stable.size() + hdrs + 1)
-            && (curr_state + 4 == py + ssize.y))
-            py++;
-
-        /*
-         * As long as the cursor isn't at the end,
-         * move it down one.
-         */
-        if (curr_state < stable.size() - 1)
+        if (curr_state + 1 < stable.size())
           curr_state++;
-        prefresh(mainwin, py, px, 0, 0, ssize.y - 1, ssize.x - 1);
         break;
       case KEY_UP:
       case 'k':
         if (flags.noscroll)
           break;
-
-        /*
-         * This one is tricky.
-         *
-         * First thing we need to know is when the cursor
-         * is at the top of the page. This is simply when
-         * curr_state+hdrs+1 cursor location), is
-         * exactly one more than the top of the window
-         * (py), * i.e. when curr_state+hdrs+1 == py+1.
-         *
-         * PAGE SCROLLING:
-         * IF we're not page-scrolled all the way up
-         *    (i.e. py > 0)
-         *    AND the cursor is at the top of the page
-         * OR the cursor is at the top of the list,
-         *    AND we're not yet at the top (showing
-         *    the headers).
-         * THEN we scroll up.
-         *
-         * CURSOR SCROLLING:
-         * Unlike KEY_DOWN, we don't break just because
-         * the cursor can't move anymore - on the way
-         * ip we may still have page-scrolling to do. So
-         * test to make sure we're not at state 0, and
-         * if so, we scroll up.
-         */
-
-        /*
-         * Basically:
-         *  IF the cursor bumps the top of the screen
-         *  OR we need to scroll up for headers
-         */
-        if ((py > 0 && (curr_state + hdrs + 1) == (py + 1))
-            || (curr_state == 0 && py > 0))
-          py--;
-
         if (curr_state > 0)
           curr_state--;
-        prefresh(mainwin, py, px, 0, 0, ssize.y - 1, ssize.x - 1);
         break;
       // 4 is ^d
       case 4:
@@ -2876,41 +8575,8 @@ int main(int argc, char *argv[])
       case KEY_SNEXT:
         if (flags.noscroll)
           break;
-        /*
-         * If the screen is bigger than the text,
-         * and the cursor is at the bottom, ignore.
-         */
-        if (stable.size() + hdrs + 1 < ssize.y && curr_state == stable.size())
-          break;
-
-        /*
-         * Otherwise, if the bottom of the screen
-         *    (current position + screen size
-         *     == py + ssize.y)
-         * were to go down one screen (thus:
-         *     py + ssize.y*2),
-         * and that is bigger than the whole pad, just
-         * go to the bottom.
-         *
-         * Otherwise, go down a screen size.
-         */
-        if (py + ssize.y * 2 > stable.size() + hdrs + 1) {
-          py = stable.size() + hdrs + 1 - ssize.y;
-        } else {
-          py += ssize.y;
-        }
-
-        /*
-         * For the cursor, we try to move it down one
-         * screen as well, but if that's too far,
-         * we bring it up to the largest number it can
-         * be.
-         */
-        curr_state += ssize.y;
-        if (curr_state > stable.size()) {
-          curr_state = stable.size();
-        }
-        prefresh(mainwin, py, px, 0, 0, ssize.y - 1, ssize.x - 1);
+        py += rows;
+        curr_state += rows;
         break;
       // 21 is ^u
       case 21:
@@ -2918,54 +8584,44 @@ int main(int argc, char *argv[])
       case KEY_SPREVIOUS:
         if (flags.noscroll)
           break;
-        /*
-         * If we're at the top, ignore
-         */
-        if (py == 0 && curr_state == 0)
-          break;
-        /*
-         * Otherwise if we're less than a page from the
-         * top, go to the top, else go up a page.
-         */
-        if (py < ssize.y) {
-          py = 0;
-        } else {
-          py -= ssize.y;
-        }
-
-        /*
-         * We bring the cursor up a page too, unless
-         * that's too far.
-         */
-        if (curr_state < ssize.y) {
-          curr_state = 0;
-        } else {
-          curr_state -= ssize.y;
-        }
-        prefresh(mainwin, py, px, 0, 0, ssize.y - 1, ssize.x - 1);
+        py = (py < rows) ? 0 : py - rows;
+        curr_state = (curr_state < rows) ? 0 : curr_state - rows;
         break;
       case KEY_HOME:
         if (flags.noscroll)
           break;
-        px = py = curr_state = 0;
-        prefresh(mainwin, py, px, 0, 0, ssize.y - 1, ssize.x - 1);
+        py = curr_state = 0;
         break;
       case KEY_END:
         if (flags.noscroll)
           break;
-        py = stable.size() + hdrs + 1 - ssize.y;
-        if (py < 0)
-          py = 0;
-        curr_state = stable.size();
-        prefresh(mainwin, py, px, 0, 0, ssize.y - 1, ssize.x - 1);
+        py = curr_state = stable.size();
+        break;
+      }
+      switch (tmpint) {
+      case KEY_DOWN:
+      case 'j':
+      case KEY_UP:
+      case 'k':
+      case 4:
+      case KEY_NPAGE:
+      case KEY_SNEXT:
+      case 21:
+      case KEY_PPAGE:
+      case KEY_SPREVIOUS:
+      case KEY_HOME:
+      case KEY_END:
+        rebuild = now_usec() >= next_refresh;
         break;
       }
+      clamp_view(stable.size(), rows, py, curr_state);
     }
     /*
      * If we got a sigwinch, we need to redraw
      */
     if (need_resize) {
       handle_resize(mainwin, flags, ssize);
+      invalidate_rows(rowcache);
       need_resize = false;
     }
   } // end while(1)